@@ -0,0 +1,402 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "aio.h"
+#include "log.h"
+
+/* a batch given to the thread pool */
+typedef struct aio_job {
+    dev_io *ios;
+    u_int32_t count;
+    u_int32_t next;                 // first io nobody has started
+    u_int32_t done;                 // ios finished
+    u_int8_t failed;                // an io failed
+    pthread_cond_t finished;        // signalled when done reaches count
+    struct aio_job *link;           // next batch waiting for the workers
+} aio_job;
+
+struct aio_engine {
+    int fd;                         // file the ios go to
+    int kind;                       // AIO_URING or AIO_THREADS
+    pthread_mutex_t lock;           // guards the ring, or the job queue
+
+    /* io_uring */
+    int ring_fd;
+    u_int32_t entries;              // submission queue entries
+    u_int32_t *sq_tail;
+    u_int32_t *sq_mask;
+    u_int32_t *sq_array;
+    u_int32_t *cq_head;
+    u_int32_t *cq_tail;
+    u_int32_t *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;                  // same as sq_ring when the kernel maps both at once
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    /* thread pool */
+    pthread_t workers[AIO_WORKERS];
+    u_int32_t started;              // workers running
+    pthread_cond_t work;            // signalled when a job is queued or the engine closes
+    aio_job *jobs;                  // jobs with ios not started yet, oldest first
+    u_int8_t closing;
+};
+
+static int aio_kind = AIO_ANY;
+
+void set_aio_kind(int kind) {
+    aio_kind = kind;
+}
+
+/* runs one io with plain positioned reads or writes */
+static u_int8_t run_io(int fd, dev_io *io) {
+    u_int8_t *buf = io->buf;
+    u_int64_t off = io->off;
+    u_int32_t len = io->len;
+    ssize_t n;
+
+    while (len > 0) {
+        n = io->write ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            log_error("Device %s failed -> Offset: %llx; Length: %u\n", io->write ? "write" : "read",
+                      (unsigned long long) off, len);
+            return 0;
+        }
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * io_uring, the rings are shared with the kernel. The tail of the submission
+ * queue and the head of the completion queue are ours, the kernel moves the
+ * other ends
+ * ------------------------------------------------------------------------- */
+
+static int uring_setup(u_int32_t entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int ring_fd, u_int32_t submit, u_int32_t wait) {
+    return syscall(__NR_io_uring_enter, ring_fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static void uring_unmap(aio_engine *e) {
+    if (e->sqes != NULL && e->sqes != MAP_FAILED) munmap(e->sqes, e->sqes_size);
+    if (e->cq_ring != NULL && e->cq_ring != MAP_FAILED && e->cq_ring != e->sq_ring) munmap(e->cq_ring, e->cq_ring_size);
+    if (e->sq_ring != NULL && e->sq_ring != MAP_FAILED) munmap(e->sq_ring, e->sq_ring_size);
+    close(e->ring_fd);
+}
+
+/* puts the rest of io i on the ring, done bytes of it are finished already */
+static void uring_prep(aio_engine *e, dev_io *ios, u_int32_t i, u_int32_t done) {
+    u_int32_t tail = *e->sq_tail;
+    u_int32_t idx = tail & *e->sq_mask;
+    struct io_uring_sqe *sqe = &e->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = ios[i].write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = e->fd;
+    sqe->off = ios[i].off + done;
+    sqe->addr = (u_int64_t) (unsigned long) ((u_int8_t *) ios[i].buf + done);
+    sqe->len = ios[i].len - done;
+    sqe->user_data = i;
+
+    e->sq_array[idx] = idx;
+    __atomic_store_n(e->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Keeps the ring full until every io has finished. An io the kernel only did
+ * part of goes back on the ring for the rest */
+static u_int8_t uring_run(aio_engine *e, dev_io *ios, u_int32_t count) {
+    u_int32_t *done;                // bytes finished of each io
+    u_int32_t *redo;                // ios to put back on the ring
+    u_int32_t redo_count = 0;
+    u_int32_t next = 0;
+    u_int32_t inflight = 0;
+    u_int32_t finished = 0;
+    u_int32_t queued = 0;           // on the ring but not yet taken by the kernel
+    u_int32_t head, tail, i;
+    u_int8_t ok = 1;
+    int res;
+
+    done = calloc(count, sizeof(u_int32_t));
+    redo = malloc(count * sizeof(u_int32_t));
+    if (done == NULL || redo == NULL) {
+        free(done);
+        free(redo);
+        return 0;
+    }
+
+    pthread_mutex_lock(&e->lock);
+    while (finished < count) {
+        while (inflight < e->entries && (redo_count > 0 || next < count)) {
+            i = redo_count > 0 ? redo[--redo_count] : next++;
+            uring_prep(e, ios, i, done[i]);
+            inflight++;
+            queued++;
+        }
+
+        res = uring_enter(e->ring_fd, queued, 1);
+        if (res < 0 && errno != EINTR && errno != EAGAIN) {
+            log_error("io_uring_enter failed -> Error: %d\n", errno);
+            ok = 0;
+            break;
+        }
+        if (res > 0) queued -= res;
+
+        head = *e->cq_head;
+        tail = __atomic_load_n(e->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &e->cqes[head & *e->cq_mask];
+
+            i = cqe->user_data;
+            res = cqe->res;
+            inflight--;
+
+            if (res < 0 || (res == 0 && done[i] < ios[i].len)) {
+                log_error("Device %s failed -> Offset: %llx; Length: %u; Error: %d\n", ios[i].write ? "write" : "read",
+                          (unsigned long long) ios[i].off, ios[i].len, -res);
+                ok = 0;
+                finished++;
+                continue;
+            }
+            done[i] += res;
+            if (done[i] < ios[i].len) redo[redo_count++] = i;
+            else finished++;
+        }
+        __atomic_store_n(e->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    /* waits for anything the kernel has taken after an error so no buffer is
+     * touched once we have returned. What it never took is dropped */
+    if (queued > 0) {
+        __atomic_store_n(e->sq_tail, *e->sq_tail - queued, __ATOMIC_RELEASE);
+        inflight -= queued;
+    }
+    while (inflight > 0) {
+        if (uring_enter(e->ring_fd, 0, 1) < 0 && errno != EINTR) break;
+        head = *e->cq_head;
+        tail = __atomic_load_n(e->cq_tail, __ATOMIC_ACQUIRE);
+        inflight -= tail - head;
+        __atomic_store_n(e->cq_head, tail, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&e->lock);
+
+    free(done);
+    free(redo);
+    return ok;
+}
+
+/* Sets up the ring. The kernel may know io_uring but not the plain read and
+ * write operations, so an empty read is tried before the ring is trusted */
+static u_int8_t uring_open(aio_engine *e) {
+    struct io_uring_params p;
+    u_int8_t probe;
+    dev_io io;
+
+    memset(&p, 0, sizeof(p));
+    e->ring_fd = uring_setup(AIO_DEPTH, &p);
+    if (e->ring_fd < 0) return 0;
+
+    e->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(u_int32_t);
+    e->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (e->cq_ring_size > e->sq_ring_size) e->sq_ring_size = e->cq_ring_size;
+        e->cq_ring_size = e->sq_ring_size;
+    }
+    e->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    e->sq_ring = mmap(NULL, e->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_SQ_RING);
+    if (e->sq_ring == MAP_FAILED) {
+        uring_unmap(e);
+        return 0;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        e->cq_ring = e->sq_ring;
+    } else {
+        e->cq_ring = mmap(NULL, e->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_CQ_RING);
+    }
+    e->sqes = mmap(NULL, e->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_SQES);
+    if (e->cq_ring == MAP_FAILED || e->sqes == MAP_FAILED) {
+        uring_unmap(e);
+        return 0;
+    }
+
+    e->sq_tail = (u_int32_t *) ((u_int8_t *) e->sq_ring + p.sq_off.tail);
+    e->sq_mask = (u_int32_t *) ((u_int8_t *) e->sq_ring + p.sq_off.ring_mask);
+    e->sq_array = (u_int32_t *) ((u_int8_t *) e->sq_ring + p.sq_off.array);
+    e->cq_head = (u_int32_t *) ((u_int8_t *) e->cq_ring + p.cq_off.head);
+    e->cq_tail = (u_int32_t *) ((u_int8_t *) e->cq_ring + p.cq_off.tail);
+    e->cq_mask = (u_int32_t *) ((u_int8_t *) e->cq_ring + p.cq_off.ring_mask);
+    e->cqes = (struct io_uring_cqe *) ((u_int8_t *) e->cq_ring + p.cq_off.cqes);
+    e->entries = p.sq_entries;
+
+    io.off = 0;
+    io.buf = &probe;
+    io.len = 0;
+    io.write = 0;
+    if (!uring_run(e, &io, 1)) {
+        uring_unmap(e);
+        return 0;
+    }
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * thread pool
+ * ------------------------------------------------------------------------- */
+
+/* Takes the next io of the oldest job, or of job when it is given. Returns
+ * the job and sets *i, NULL when there is nothing to start. Called with the
+ * lock held */
+static aio_job *take_io(aio_engine *e, aio_job *job, u_int32_t *i) {
+    aio_job **p;
+
+    if (job == NULL) job = e->jobs;
+    if (job == NULL || job->next == job->count) return NULL;
+
+    *i = job->next++;
+    if (job->next == job->count) {
+        /* every io has started, nothing more for the workers here */
+        for (p = &e->jobs; *p != NULL; p = &(*p)->link) {
+            if (*p == job) {
+                *p = job->link;
+                break;
+            }
+        }
+    }
+    return job;
+}
+
+/* Runs io i of job outside the lock and records that it finished */
+static void finish_io(aio_engine *e, aio_job *job, u_int32_t i) {
+    u_int8_t ok;
+
+    pthread_mutex_unlock(&e->lock);
+    ok = run_io(e->fd, &job->ios[i]);
+    pthread_mutex_lock(&e->lock);
+
+    if (!ok) job->failed = 1;
+    if (++job->done == job->count) pthread_cond_signal(&job->finished);
+}
+
+static void *worker(void *arg) {
+    aio_engine *e = arg;
+    aio_job *job;
+    u_int32_t i;
+
+    pthread_mutex_lock(&e->lock);
+    for (;;) {
+        job = take_io(e, NULL, &i);
+        if (job != NULL) {
+            finish_io(e, job, i);
+            continue;
+        }
+        if (e->closing) break;
+        pthread_cond_wait(&e->work, &e->lock);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+static u_int8_t pool_run(aio_engine *e, dev_io *ios, u_int32_t count) {
+    aio_job job;
+    aio_job **p;
+    u_int32_t i;
+
+    memset(&job, 0, sizeof(job));
+    job.ios = ios;
+    job.count = count;
+    pthread_cond_init(&job.finished, NULL);
+
+    pthread_mutex_lock(&e->lock);
+    for (p = &e->jobs; *p != NULL; p = &(*p)->link);
+    *p = &job;
+    pthread_cond_broadcast(&e->work);
+
+    /* helps with its own job rather than just waiting */
+    while (take_io(e, &job, &i) != NULL) finish_io(e, &job, i);
+    while (job.done < job.count) pthread_cond_wait(&job.finished, &e->lock);
+    pthread_mutex_unlock(&e->lock);
+
+    pthread_cond_destroy(&job.finished);
+    return !job.failed;
+}
+
+static u_int8_t pool_open(aio_engine *e) {
+    pthread_cond_init(&e->work, NULL);
+    for (e->started = 0; e->started < AIO_WORKERS; e->started++) {
+        if (pthread_create(&e->workers[e->started], NULL, worker, e) != 0) break;
+    }
+
+    /* the thread running a batch works on it too, so no workers still works */
+    if (e->started < AIO_WORKERS) log_warn("Started fewer I/O threads -> Threads: %u\n", e->started);
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * engine
+ * ------------------------------------------------------------------------- */
+
+aio_engine *aio_open(int fd) {
+    aio_engine *e;
+
+    e = calloc(1, sizeof(aio_engine));
+    if (e == NULL) return NULL;
+    e->fd = fd;
+    e->ring_fd = -1;
+    pthread_mutex_init(&e->lock, NULL);
+
+    if (aio_kind != AIO_THREADS && uring_open(e)) {
+        e->kind = AIO_URING;
+        log_debug("Asynchronous I/O -> io_uring; Depth: %u\n", e->entries);
+        return e;
+    }
+    if (aio_kind == AIO_URING) log_warn("io_uring not available, using threads\n");
+
+    e->kind = AIO_THREADS;
+    pool_open(e);
+    log_debug("Asynchronous I/O -> threads; Workers: %u\n", e->started);
+    return e;
+}
+
+u_int8_t aio_run(aio_engine *e, dev_io *ios, u_int32_t count) {
+    if (count == 0) return 1;
+
+    /* one io is quicker done than handed over */
+    if (count == 1) return run_io(e->fd, &ios[0]);
+    if (e->kind == AIO_URING) return uring_run(e, ios, count);
+    return pool_run(e, ios, count);
+}
+
+const char *aio_name(aio_engine *e) {
+    return e->kind == AIO_URING ? "io_uring" : "threads";
+}
+
+void aio_close(aio_engine *e) {
+    if (e->kind == AIO_URING) {
+        uring_unmap(e);
+    } else {
+        pthread_mutex_lock(&e->lock);
+        e->closing = 1;
+        pthread_cond_broadcast(&e->work);
+        pthread_mutex_unlock(&e->lock);
+        for (u_int32_t i = 0; i < e->started; i++) pthread_join(e->workers[i], NULL);
+        pthread_cond_destroy(&e->work);
+    }
+    pthread_mutex_destroy(&e->lock);
+    free(e);
+}
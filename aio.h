@@ -0,0 +1,50 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <sys/types.h>
+#include "device.h"
+
+/* Asynchronous I/O engine behind the batches of the file backend. A batch is
+ * handed over whole and the call returns once every io in it has finished.
+ *
+ * The engine uses io_uring when the kernel has it, driven through the raw
+ * system calls so nothing has to be installed. Up to AIO_DEPTH ios are in
+ * flight at once and their completions are reaped in batches. One batch runs
+ * on the ring at a time.
+ *
+ * Where io_uring can not be set up, or AIO_THREADS is asked for, a pool of
+ * AIO_WORKERS threads runs the ios with pread and pwrite instead. The thread
+ * that submitted a batch works on it too, and batches from different threads
+ * run side by side.
+ *
+ * A batch of a single io is run at once by the calling thread with either
+ * engine, handing it over would cost more than it saves.
+ */
+
+#define AIO_ANY         0           // io_uring if the kernel has it, else threads
+#define AIO_URING       1
+#define AIO_THREADS     2
+
+#define AIO_DEPTH       0x0040      // ios in flight on the ring at once
+#define AIO_WORKERS     0x0004      // threads in the fallback pool
+
+typedef struct aio_engine aio_engine;
+
+/* Chooses the engine used by devices opened from now on, AIO_ANY to begin
+ * with. Asking for AIO_URING where it is not there falls back to threads */
+void set_aio_kind(int kind);
+
+/* Starts an engine for the open file fd. Returns NULL if neither engine can
+ * be started */
+aio_engine *aio_open(int fd);
+
+/* Runs count ios and waits for them all. Returns 0 if any of them failed */
+u_int8_t aio_run(aio_engine *e, dev_io *ios, u_int32_t count);
+
+/* "io_uring" or "threads" */
+const char *aio_name(aio_engine *e);
+
+/* Waits for the workers and frees the engine, the file is left open */
+void aio_close(aio_engine *e);
+
+#endif
@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "device.h"
+#include "aio.h"
+#include "cache.h"
+#include "crc.h"
+#include "log.h"
+#include "stats.h"
+#include "main.h"
+
+/* Benchmarks for the file system. Each benchmark times every operation on its
+ * own and reports the rate and the 50th and 99th percentile latency as JSON,
+ * so the output of two versions can be compared by a script.
+ *
+ * Build with main.c compiled as a library, see the README
+ *   gcc -O2 -DMINIFAT_LIB -o bench bench.c main.c device.c aio.c cache.c crc.c lz.c stats.c -lpthread
+ *
+ * The log of the file system is turned off unless -v is given so only the
+ * JSON is left on stdout. -S prints the statistics the file system kept to
+ * stderr at the end.
+ *
+ * With -e the image sits behind a simulated EEPROM. Each result then also
+ * has the device time and write cycles used since the result before, and the
+ * wear of the device is printed to stderr at the end. -W saves the wear of
+ * every meta data byte and data block as CSV. -F sets how often the meta data
+ * is flushed, so flush policies can be compared on the simulated device.
+ */
+
+#define BENCH_FILES     16          // files the operations are spread over
+#define FILL_FILES      16          // files used to fill the device
+#define BENCH_MAX_FILES 64          // directory entries on the bench image
+#define BENCH_BUDGET    0x400000    // 4M bytes moved per benchmark at most
+#define MIN_OPS         16          // fewest operations timed per benchmark
+#define IO_SIZE         0x1000      // 4k bytes per read or write in the profiles
+#define PROFILE_SIZE    0x40000     // 256k bytes per file in the profiles
+
+static const u_int32_t file_sizes[] = {64, 1024, 16384, 262144};
+static const u_int32_t fill_levels[] = {0, 50, 90};
+
+static FILE *out;                   // where the JSON goes
+static u_int8_t first_result = 1;   // no comma before the first result
+static char *buf;                   // data written and read back
+
+/* settings from the command line */
+static const char *image = "/tmp/minifat_bench.img";
+static u_int64_t image_bytes = 64ULL << 20;
+static u_int32_t block_size = 512;
+static u_int32_t max_ops = 2000;
+static u_int8_t file_backend = 0;
+static block_dev *sim_dev;          // the simulated EEPROM with -e, NULL otherwise
+static eeprom_stats sim_last;       // its totals at the result before
+
+static u_int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    u_int64_t x = *(const u_int64_t *) a;
+    u_int64_t y = *(const u_int64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* operations to time for a benchmark moving size bytes per operation */
+static u_int32_t ops_for(u_int32_t size) {
+    u_int32_t ops = BENCH_BUDGET / size;
+    if (ops < MIN_OPS) ops = MIN_OPS;
+    if (ops > max_ops) ops = max_ops;
+    return ops;
+}
+
+/* Writes one result. lat holds the latency of each operation in nanoseconds
+ * and is sorted here */
+static void report(const char *name, u_int32_t size, u_int32_t fill, u_int64_t *lat, u_int32_t ops,
+                   u_int32_t errors, u_int64_t bytes) {
+    u_int64_t total = 0;
+    eeprom_stats now;
+
+    for (u_int32_t i = 0; i < ops; i++) total += lat[i];
+    qsort(lat, ops, sizeof(u_int64_t), cmp_u64);
+
+    fprintf(out, "%s\n    {\"name\": \"%s\", \"file_size\": %u, \"fill\": %u, \"ops\": %u, \"errors\": %u, "
+                 "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu",
+            first_result ? "" : ",", name, size, fill, ops, errors,
+            total ? ops * 1e9 / total : 0.0,
+            total ? bytes * 1e3 / total : 0.0,
+            (unsigned long long) lat[ops / 2],
+            (unsigned long long) lat[(u_int64_t) ops * 99 / 100],
+            (unsigned long long) lat[ops - 1]);
+
+    /* device time includes setting up the benchmark, which is not timed */
+    if (sim_dev != NULL && eeprom_get_stats(sim_dev, &now)) {
+        fprintf(out, ", \"sim_ms\": %.3f, \"sim_write_cycles\": %llu, \"sim_erases\": %llu",
+                (now.sim_ns - sim_last.sim_ns) / 1e6, (unsigned long long) (now.write_cycles - sim_last.write_cycles),
+                (unsigned long long) (now.erases - sim_last.erases));
+        sim_last = now;
+    }
+    fprintf(out, "}");
+    fflush(out);
+    first_result = 0;
+}
+
+/* writes size bytes to a file, not timed */
+static u_int8_t put_file(meta_data *md, filename fn, u_int64_t size) {
+    file_handle *h;
+    u_int32_t n;
+    u_int8_t ok = 1;
+
+    h = open_for_write(md, fn);
+    if (h == NULL) return 0;
+    while (ok && size > 0) {
+        n = size < PROFILE_SIZE ? size : PROFILE_SIZE;
+        ok = write_file(md, h, buf, n);
+        size -= n;
+    }
+    close_file(md, h);
+    return ok;
+}
+
+static void clear_files(meta_data *md, filename first, u_int32_t count) {
+    for (filename fn = first; fn < first + count; fn++) {
+        if (md->dir[fn].startblock != FREE_BLOCK) delete_file(md, fn);
+    }
+}
+
+/* Fills pct percent of the data blocks with files that the benchmarks leave
+ * alone, so allocation is timed on a device that is partly in use */
+static void fill_device(meta_data *md, u_int32_t pct) {
+    u_int64_t each;
+
+    clear_files(md, BENCH_MAX_FILES - FILL_FILES, FILL_FILES);
+    each = (u_int64_t) md->sb.total_blocks * pct / 100 / FILL_FILES * md->sb.block_size;
+    if (each == 0) return;
+    for (filename fn = BENCH_MAX_FILES - FILL_FILES; fn < BENCH_MAX_FILES; fn++) put_file(md, fn, each);
+}
+
+/* open_for_write, write_file and close_file of a whole file */
+static void bench_write(meta_data *md, u_int32_t size, u_int32_t fill, u_int64_t *lat) {
+    u_int32_t ops = ops_for(size);
+    u_int32_t errors = 0;
+    file_handle *h;
+    u_int64_t t;
+
+    for (u_int32_t i = 0; i < ops; i++) {
+        t = now_ns();
+        h = open_for_write(md, i % BENCH_FILES);
+        if (h == NULL || !write_file(md, h, buf, size)) errors++;
+        if (h != NULL) close_file(md, h);
+        lat[i] = now_ns() - t;
+    }
+    report("write", size, fill, lat, ops, errors, (u_int64_t) ops * size);
+}
+
+/* open_for_read, read_file and close_file of a whole file, uses the files
+ * left by bench_write */
+static void bench_read(meta_data *md, u_int32_t size, u_int32_t fill, u_int64_t *lat) {
+    u_int32_t ops = ops_for(size);
+    u_int32_t errors = 0;
+    file_handle *h;
+    u_int64_t t;
+
+    for (u_int32_t i = 0; i < ops; i++) {
+        t = now_ns();
+        h = open_for_read(md, i % BENCH_FILES);
+        if (h == NULL || read_file(md, h, buf, size) != size) errors++;
+        if (h != NULL) close_file(md, h);
+        lat[i] = now_ns() - t;
+    }
+    report("read", size, fill, lat, ops, errors, (u_int64_t) ops * size);
+}
+
+/* open_for_append, append_file and close_file adding size bytes, starting
+ * from empty files */
+static void bench_append(meta_data *md, u_int32_t size, u_int32_t fill, u_int64_t *lat) {
+    u_int32_t ops = ops_for(size);
+    u_int32_t errors = 0;
+    file_handle *h;
+    u_int64_t t;
+
+    clear_files(md, 0, BENCH_FILES);
+    for (u_int32_t i = 0; i < ops; i++) {
+        t = now_ns();
+        h = open_for_append(md, i % BENCH_FILES);
+        if (h == NULL || !append_file(md, h, buf, size)) errors++;
+        if (h != NULL) close_file(md, h);
+        lat[i] = now_ns() - t;
+    }
+    report("append", size, fill, lat, ops, errors, (u_int64_t) ops * size);
+}
+
+/* delete_file of a file of size bytes, the files are written untimed in
+ * batches of BENCH_FILES */
+static void bench_delete(meta_data *md, u_int32_t size, u_int32_t fill, u_int64_t *lat) {
+    u_int32_t ops = ops_for(size);
+    u_int32_t errors = 0;
+    u_int64_t t;
+
+    clear_files(md, 0, BENCH_FILES);
+    for (u_int32_t i = 0; i < ops; i++) {
+        if (i % BENCH_FILES == 0) {
+            for (filename fn = 0; fn < BENCH_FILES; fn++) put_file(md, fn, size);
+        }
+        t = now_ns();
+        if (!delete_file(md, i % BENCH_FILES)) errors++;
+        lat[i] = now_ns() - t;
+    }
+    report("delete", size, fill, lat, ops, errors, (u_int64_t) ops * size);
+}
+
+/* Workload profiles over BENCH_FILES files of PROFILE_SIZE bytes.
+ *   seq     read_file of IO_SIZE bytes through every file in turn
+ *   random  read_at of IO_SIZE bytes at random offsets
+ *   mixed   70% read_at of IO_SIZE bytes, 20% rewriting a whole file and 10%
+ *           append_file of IO_SIZE bytes. A file can not be read while it is
+ *           open for writing so each operation opens and closes its file
+ * seq and random keep the files open and only time the read */
+static void bench_profile(meta_data *md, const char *name, u_int32_t fill, u_int64_t *lat) {
+    u_int32_t ops = max_ops;
+    u_int32_t errors = 0;
+    file_handle *h;
+    file_handle *hs[BENCH_FILES];
+    u_int64_t bytes = 0;
+    u_int64_t t;
+    u_int64_t off;
+    filename fn;
+    int r;
+
+    for (fn = 0; fn < BENCH_FILES; fn++) put_file(md, fn, PROFILE_SIZE);
+    srand(1);
+
+    if (strcmp(name, "mixed") != 0) {
+        for (fn = 0; fn < BENCH_FILES; fn++) hs[fn] = open_for_read(md, fn);
+    }
+
+    for (u_int32_t i = 0; i < ops; i++) {
+        fn = rand() % BENCH_FILES;
+        off = (u_int64_t) (rand() % (PROFILE_SIZE / IO_SIZE)) * IO_SIZE;
+
+        if (strcmp(name, "seq") == 0) {
+            fn = i / (PROFILE_SIZE / IO_SIZE) % BENCH_FILES;
+            if (i % (PROFILE_SIZE / IO_SIZE) == 0) seek_file(md, hs[fn], 0, SEEK_SET);
+            t = now_ns();
+            if (read_file(md, hs[fn], buf, IO_SIZE) != IO_SIZE) errors++;
+        } else if (strcmp(name, "random") == 0) {
+            t = now_ns();
+            if (read_at(md, hs[fn], off, buf, IO_SIZE) != IO_SIZE) errors++;
+        } else {
+            r = rand() % 10;
+            t = now_ns();
+            if (r < 7) {
+                h = open_for_read(md, fn);
+                if (h == NULL || read_at(md, h, off, buf, IO_SIZE) != IO_SIZE) errors++;
+            } else if (r < 9) {
+                h = open_for_write(md, fn);
+                if (h == NULL || !write_file(md, h, buf, PROFILE_SIZE)) errors++;
+                bytes += PROFILE_SIZE - IO_SIZE;
+            } else {
+                h = open_for_append(md, fn);
+                if (h == NULL || !append_file(md, h, buf, IO_SIZE)) errors++;
+            }
+            if (h != NULL) close_file(md, h);
+        }
+        lat[i] = now_ns() - t;
+        bytes += IO_SIZE;
+    }
+
+    if (strcmp(name, "mixed") != 0) {
+        for (fn = 0; fn < BENCH_FILES; fn++) {
+            if (hs[fn] != NULL) close_file(md, hs[fn]);
+        }
+    }
+    report(name, IO_SIZE, fill, lat, ops, errors, bytes);
+}
+
+/* Reads page:write_us[:erase_size:erase_us[:byte_ns[:endurance]]] into m,
+ * what is left out keeps the defaults. Returns 0 if it does not parse */
+static u_int8_t parse_model(const char *arg, eeprom_model *m) {
+    u_int64_t v[6] = {EEPROM_PAGE, EEPROM_WRITE_NS / 1000, 0, 0, EEPROM_BYTE_NS, EEPROM_ENDURANCE};
+    char *end;
+
+    for (u_int32_t i = 0; i < 6 && *arg != '\0'; i++) {
+        v[i] = strtoull(arg, &end, 0);
+        if (end == arg || (*end != ':' && *end != '\0')) return 0;
+        arg = *end == ':' ? end + 1 : end;
+    }
+    m->page_size = v[0];
+    m->write_ns = v[1] * 1000;
+    m->erase_size = v[2];
+    m->erase_ns = v[3] * 1000;
+    m->byte_ns = v[4];
+    m->endurance = v[5];
+    return 1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-s image MB] [-b block size] [-n max ops] [-c] [-f] [-t] [-e model] [-W wear.csv] [-F ops:secs] [-v] [-S] [-o out.json] [image]\n"
+                    "  -c  keep a checksum of every block and check it on every read\n"
+                    "  -f  use positioned reads and writes with the block cache instead of mmap\n"
+                    "  -t  run batches on the thread pool rather than io_uring, with -f\n"
+                    "  -e  put the image behind a simulated EEPROM,\n"
+                    "      page:write_us[:erase_size:erase_us[:byte_ns[:endurance]]], 64:5000 for a serial EEPROM\n"
+                    "  -W  save the wear of the simulated EEPROM as CSV\n"
+                    "  -F  flush the meta data every ops operations or secs seconds, 0 for never\n"
+                    "  -v  keep the log of the file system\n"
+                    "  -S  print the statistics of the file system to stderr at the end\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    const char *out_path = NULL;
+    const char *wear_path = NULL;
+    u_int32_t flush_ops = DEFAULT_FLUSH_OPS;
+    u_int32_t flush_secs = DEFAULT_FLUSH_SECS;
+    u_int8_t simulate = 0;
+    eeprom_model model;
+    FILE *wear;
+    char *end;
+    u_int8_t verbose = 0;
+    u_int8_t show_stats = 0;
+    u_int8_t checksums = 0;
+    meta_data *md;
+    block_dev *dev;
+    u_int64_t *lat;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:b:n:o:cfte:W:F:vSh")) != -1) {
+        switch (opt) {
+            case 's': image_bytes = strtoull(optarg, NULL, 0) << 20; break;
+            case 'b': block_size = strtoul(optarg, NULL, 0); break;
+            case 'n': max_ops = strtoul(optarg, NULL, 0); break;
+            case 'o': out_path = optarg; break;
+            case 'c': checksums = 1; break;
+            case 'f': file_backend = 1; break;
+            case 't': set_aio_kind(AIO_THREADS); break;
+            case 'e':
+                if (!parse_model(optarg, &model)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                simulate = 1;
+                break;
+            case 'W': wear_path = optarg; break;
+            case 'F':
+                flush_ops = strtoul(optarg, &end, 0);
+                if (*end == ':') flush_secs = strtoul(end + 1, NULL, 0);
+                break;
+            case 'v': verbose = 1; break;
+            case 'S': show_stats = 1; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind < argc) image = argv[optind];
+    if (max_ops < MIN_OPS) max_ops = MIN_OPS;
+
+    out = out_path != NULL ? fopen(out_path, "w") : stdout;
+    if (out == NULL) {
+        fprintf(stderr, "ERROR Cannot open output -> Path: %s\n", out_path);
+        return 1;
+    }
+    if (!verbose) set_log_level(LOG_NONE);
+
+    buf = malloc(PROFILE_SIZE);
+    lat = malloc((max_ops > BENCH_BUDGET / file_sizes[0] ? max_ops : BENCH_BUDGET / file_sizes[0]) * sizeof(u_int64_t));
+    md = calloc(1, sizeof(meta_data));
+    if (buf == NULL || lat == NULL || md == NULL) {
+        fprintf(stderr, "ERROR Out of memory\n");
+        return 1;
+    }
+    for (u_int32_t i = 0; i < PROFILE_SIZE; i++) buf[i] = i * 31 + 7;
+
+    /* init_fat would set this, format_fs on its own does not */
+    set_flush_policy(md, flush_ops, flush_secs);
+    set_checksums(md, checksums);
+
+    unlink(image); // a fresh image of exactly the size asked for
+    dev = file_backend ? file_dev_open(image, image_bytes) : mmap_dev_open(image, image_bytes);
+    if (simulate) dev = sim_dev = eeprom_dev_open(dev, &model);
+    if (dev == NULL || !format_fs(md, dev, block_size, BENCH_MAX_FILES)) {
+        fprintf(stderr, "ERROR Cannot create image -> Path: %s\n", image);
+        return 1;
+    }
+
+    fprintf(out, "{\n  \"fs_version\": %u, \"backend\": \"%s\", \"image_size\": %llu, \"block_size\": %u, "
+                 "\"total_blocks\": %u, \"checksums\": \"%s\", \"flush_ops\": %u, \"flush_secs\": %u,",
+            FS_VERSION, file_backend ? "file" : "mmap", (unsigned long long) image_bytes, md->sb.block_size,
+            md->sb.total_blocks, checksums ? crc32c_impl() : "off", flush_ops, flush_secs);
+    if (simulate) {
+        fprintf(out, " \"eeprom\": {\"page_size\": %u, \"write_ns\": %llu, \"erase_size\": %u, \"erase_ns\": %llu, "
+                     "\"byte_ns\": %llu, \"endurance\": %u},",
+                model.page_size, (unsigned long long) model.write_ns, model.erase_size,
+                (unsigned long long) model.erase_ns, (unsigned long long) model.byte_ns, model.endurance);
+        eeprom_get_stats(sim_dev, &sim_last);   // formatting is not charged to the first result
+    }
+    fprintf(out, "\n  \"results\": [");
+
+    for (u_int32_t f = 0; f < sizeof(fill_levels) / sizeof(fill_levels[0]); f++) {
+        clear_files(md, 0, BENCH_FILES);
+        fill_device(md, fill_levels[f]);
+
+        for (u_int32_t s = 0; s < sizeof(file_sizes) / sizeof(file_sizes[0]); s++) {
+            bench_write(md, file_sizes[s], fill_levels[f], lat);
+            bench_read(md, file_sizes[s], fill_levels[f], lat);
+            bench_append(md, file_sizes[s], fill_levels[f], lat);
+            bench_delete(md, file_sizes[s], fill_levels[f], lat);
+        }
+
+        clear_files(md, 0, BENCH_FILES);
+        bench_profile(md, "seq", fill_levels[f], lat);
+        bench_profile(md, "random", fill_levels[f], lat);
+        bench_profile(md, "mixed", fill_levels[f], lat);
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) fclose(out);
+
+    if (show_stats) dump_stats(md, stderr);
+    if (simulate) {
+        sync_fs(md);    // what the cache still holds is charged too
+        dump_wear(md, stderr);
+    }
+    if (simulate && wear_path != NULL) {
+        wear = fopen(wear_path, "w");
+        if (wear == NULL || !save_wear(md, wear)) fprintf(stderr, "ERROR Cannot save wear -> Path: %s\n", wear_path);
+        if (wear != NULL) fclose(wear);
+    }
+
+    unmount(md);
+    free(md);
+    free(lat);
+    free(buf);
+    return 0;
+}
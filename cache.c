@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+#include "log.h"
+
+#define NO_SLOT     0xFFFFFFFF  // end of a hash chain
+#define CACHE_RUN   0x0010      // most blocks read in one go
+
+static u_int32_t hash(block_cache *c, u_int32_t blk) {
+    return (blk * 2654435761u) & c->mask;
+}
+
+/* returns the slot holding blk or NO_SLOT */
+static u_int32_t lookup(block_cache *c, u_int32_t blk) {
+    u_int32_t i;
+
+    for (i = c->buckets[hash(c, blk)]; i != NO_SLOT; i = c->slots[i].next) {
+        if (c->slots[i].blk == blk) return i;
+    }
+    return NO_SLOT;
+}
+
+static void unlink_slot(block_cache *c, u_int32_t i) {
+    u_int32_t *p = &c->buckets[hash(c, c->slots[i].blk)];
+
+    while (*p != i) p = &c->slots[*p].next;
+    *p = c->slots[i].next;
+    c->slots[i].valid = 0;
+}
+
+static u_int8_t write_back(block_cache *c, u_int32_t i) {
+    cache_slot *s = &c->slots[i];
+
+    if (!s->dirty) return 1;
+    if (!dev_write(c->dev, c->data_start + (u_int64_t) s->blk * c->block_size, s->data, c->block_size)) return 0;
+    s->dirty = 0;
+    return 1;
+}
+
+/* Moves the hand round until it finds a slot that has not been used since it
+ * last passed, writing the old block back if it was changed. Once a write back
+ * has failed the hand goes round once more at most, if it comes back to that
+ * slot every block is dirty and can not be written and NO_SLOT is returned */
+static u_int32_t take_slot(block_cache *c) {
+    u_int32_t failed = NO_SLOT;     // first slot that could not be written back
+    cache_slot *s;
+    u_int32_t i;
+
+    for (;;) {
+        i = c->hand;
+        if (i == failed) {
+            log_error("No cache slot can be written back -> Blocks: %u\n", c->count);
+            return NO_SLOT;
+        }
+        s = &c->slots[i];
+        c->hand = (c->hand + 1) % c->count;
+
+        if (!s->valid) return i;
+        if (s->ref) {
+            s->ref = 0;
+            continue;
+        }
+        if (!write_back(c, i)) {
+            log_error("Cannot write back cached block -> Block: %u\n", s->blk);
+            if (failed == NO_SLOT) failed = i;
+            continue;
+        }
+        unlink_slot(c, i);
+        return i;
+    }
+}
+
+/* Reads count blocks from blk onwards into the scratch buffer with one device
+ * read and puts each in a slot. Fails if no slot can be had for one of them,
+ * the blocks before it stay cached */
+static u_int8_t load_run(block_cache *c, u_int32_t blk, u_int32_t count, u_int8_t ref) {
+    cache_slot *s;
+    u_int32_t i;
+
+    if (!dev_read(c->dev, c->data_start + (u_int64_t) blk * c->block_size, c->buf, count * c->block_size)) return 0;
+
+    for (u_int32_t k = 0; k < count; k++) {
+        i = take_slot(c);
+        if (i == NO_SLOT) return 0;
+        s = &c->slots[i];
+        memcpy(s->data, c->buf + (u_int64_t) k * c->block_size, c->block_size);
+        s->blk = blk + k;
+        s->valid = 1;
+        s->dirty = 0;
+        s->ref = ref;
+        s->next = c->buckets[hash(c, s->blk)];
+        c->buckets[hash(c, s->blk)] = i;
+    }
+    return 1;
+}
+
+/* counts the blocks from blk that are not cached, stopping at max */
+static u_int32_t missing_run(block_cache *c, u_int32_t blk, u_int32_t max) {
+    u_int32_t n = 1;
+
+    if (max > c->run) max = c->run;
+    while (n < max && lookup(c, blk + n) == NO_SLOT) n++;
+    return n;
+}
+
+block_cache *cache_open(block_dev *dev, u_int64_t data_start, u_int32_t block_size, u_int32_t count) {
+    block_cache *c;
+    u_int32_t buckets = 1;
+
+    if (count == 0) return NULL;
+    while (buckets < count * 2) buckets <<= 1;
+
+    c = calloc(1, sizeof(block_cache));
+    if (c == NULL) return NULL;
+
+    c->dev = dev;
+    c->data_start = data_start;
+    c->block_size = block_size;
+    c->count = count;
+    c->mask = buckets - 1;
+    c->run = count / 2 < CACHE_RUN ? count / 2 : CACHE_RUN;
+    if (c->run == 0) c->run = 1;
+
+    c->slots = calloc(count, sizeof(cache_slot));
+    c->buckets = malloc(buckets * sizeof(u_int32_t));
+    c->buf = malloc((size_t) c->run * block_size);
+    if (c->slots != NULL) c->slots[0].data = malloc((size_t) count * block_size);
+
+    if (c->slots == NULL || c->buckets == NULL || c->buf == NULL || c->slots[0].data == NULL) {
+        log_error("Out of memory for block cache -> Blocks: %u\n", count);
+        if (c->slots != NULL) free(c->slots[0].data);
+        free(c->slots);
+        free(c->buckets);
+        free(c->buf);
+        free(c);
+        return NULL;
+    }
+
+    for (u_int32_t i = 0; i < buckets; i++) c->buckets[i] = NO_SLOT;
+    for (u_int32_t i = 1; i < count; i++) c->slots[i].data = c->slots[0].data + (u_int64_t) i * block_size;
+    pthread_mutex_init(&c->lock, NULL);
+    return c;
+}
+
+/* Copies len bytes from block blk on into out. Missing blocks are read into
+ * the cache in runs, or with a batch they are read straight into out once the
+ * batch runs and are not cached */
+static u_int8_t read_range(block_cache *c, u_int32_t blk, u_int32_t off, u_int8_t *out, u_int64_t len, dev_batch *b) {
+    u_int64_t n;
+    u_int32_t i, run, want;
+
+    while (len > 0) {
+        i = lookup(c, blk);
+        want = (off + len + c->block_size - 1) / c->block_size;
+        if (i != NO_SLOT) {
+            n = c->block_size - off;
+            if (n > len) n = len;
+            memcpy(out, c->slots[i].data + off, n);
+            c->slots[i].ref = 1;
+            c->hits++;
+            blk++;
+        } else if (b != NULL) {
+            run = 1;
+            while (run < want && lookup(c, blk + run) == NO_SLOT) run++;
+            n = (u_int64_t) run * c->block_size - off;
+            if (n > len) n = len;
+            if (!dev_batch_add(b, 0, c->data_start + (u_int64_t) blk * c->block_size + off, out, n)) return 0;
+            c->misses += run;
+            blk += run;
+        } else {
+            /* reads this block and the missing ones after it that are wanted */
+            run = missing_run(c, blk, want);
+            if (!load_run(c, blk, run, 1)) return 0;
+            n = (u_int64_t) run * c->block_size - off;
+            if (n > len) n = len;
+            memcpy(out, c->buf + off, n);
+            c->misses += run;
+            blk += run;
+        }
+        out += n;
+        len -= n;
+        off = 0;
+    }
+    return 1;
+}
+
+/* Writes len bytes from in to block blk on. Whole blocks that are not cached
+ * go to the device, at once or when the batch runs */
+static u_int8_t write_range(block_cache *c, u_int32_t blk, u_int32_t off, const u_int8_t *in, u_int64_t len, dev_batch *b) {
+    u_int64_t n, addr;
+    u_int32_t i, run;
+
+    while (len > 0) {
+        n = c->block_size - off;
+        if (n > len) n = len;
+        i = lookup(c, blk);
+
+        if (i == NO_SLOT && off == 0 && n == c->block_size) {
+            /* whole blocks that are not cached go straight to the device */
+            run = 1;
+            while ((u_int64_t) (run + 1) * c->block_size <= len && lookup(c, blk + run) == NO_SLOT) run++;
+            n = (u_int64_t) run * c->block_size;
+            addr = c->data_start + (u_int64_t) blk * c->block_size;
+            if (b != NULL) {
+                if (!dev_batch_add(b, 1, addr, (void *) in, n)) return 0;
+            } else if (!dev_write(c->dev, addr, in, n)) {
+                return 0;
+            }
+            blk += run;
+        } else {
+            /* part of a block, the rest of it has to come from the device first */
+            if (i == NO_SLOT) {
+                if (!load_run(c, blk, 1, 1)) return 0;
+                i = lookup(c, blk);
+            }
+            memcpy(c->slots[i].data + off, in, n);
+            c->slots[i].dirty = 1;
+            c->slots[i].ref = 1;
+            blk++;
+        }
+        in += n;
+        len -= n;
+        off = 0;
+    }
+    return 1;
+}
+
+u_int8_t cache_read(block_cache *c, u_int32_t blk, u_int32_t off, void *buf, u_int64_t len) {
+    u_int8_t ok;
+
+    pthread_mutex_lock(&c->lock);
+    ok = read_range(c, blk, off, buf, len, NULL);
+    pthread_mutex_unlock(&c->lock);
+    return ok;
+}
+
+u_int8_t cache_read_batch(block_cache *c, dev_batch *b, u_int32_t blk, u_int32_t off, void *buf, u_int64_t len) {
+    u_int8_t ok;
+
+    pthread_mutex_lock(&c->lock);
+    ok = read_range(c, blk, off, buf, len, b);
+    pthread_mutex_unlock(&c->lock);
+    return ok;
+}
+
+u_int8_t cache_write(block_cache *c, u_int32_t blk, u_int32_t off, const void *buf, u_int64_t len) {
+    u_int8_t ok;
+
+    pthread_mutex_lock(&c->lock);
+    ok = write_range(c, blk, off, buf, len, NULL);
+    pthread_mutex_unlock(&c->lock);
+    return ok;
+}
+
+u_int8_t cache_write_batch(block_cache *c, dev_batch *b, u_int32_t blk, u_int32_t off, const void *buf, u_int64_t len) {
+    u_int8_t ok;
+
+    pthread_mutex_lock(&c->lock);
+    ok = write_range(c, blk, off, buf, len, b);
+    pthread_mutex_unlock(&c->lock);
+    return ok;
+}
+
+void cache_prefetch(block_cache *c, u_int32_t blk, u_int32_t count) {
+    u_int32_t run;
+
+    pthread_mutex_lock(&c->lock);
+    while (count > 0) {
+        if (lookup(c, blk) != NO_SLOT) {
+            blk++;
+            count--;
+            continue;
+        }
+        run = missing_run(c, blk, count);
+        if (!load_run(c, blk, run, 0)) break;
+        blk += run;
+        count -= run;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Dirty blocks are written back in one batch. Slots share one buffer so
+ * neighbouring slots holding neighbouring blocks are written as one io */
+u_int8_t cache_flush(block_cache *c) {
+    dev_batch b;
+    u_int8_t ok;
+
+    dev_batch_init(&b);
+    pthread_mutex_lock(&c->lock);
+    for (u_int32_t i = 0; i < c->count; i++) {
+        if (c->slots[i].valid && c->slots[i].dirty)
+            dev_batch_add(&b, 1, c->data_start + (u_int64_t) c->slots[i].blk * c->block_size, c->slots[i].data, c->block_size);
+    }
+
+    /* without memory for the batch the blocks are written one at a time */
+    if (b.failed) {
+        dev_batch_free(&b);
+        ok = 1;
+        for (u_int32_t i = 0; i < c->count; i++) {
+            if (c->slots[i].valid) ok &= write_back(c, i);
+        }
+        pthread_mutex_unlock(&c->lock);
+        return ok;
+    }
+
+    /* the slots stay dirty if the batch failed, as nothing is known to have been written */
+    ok = dev_batch_run(c->dev, &b);
+    for (u_int32_t i = 0; ok && i < c->count; i++) {
+        if (c->slots[i].valid) c->slots[i].dirty = 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+    dev_batch_free(&b);
+    return ok;
+}
+
+void cache_counts(block_cache *c, u_int64_t *hits, u_int64_t *misses) {
+    pthread_mutex_lock(&c->lock);
+    *hits = c->hits;
+    *misses = c->misses;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void cache_close(block_cache *c) {
+    cache_flush(c);
+    pthread_mutex_destroy(&c->lock);
+    free(c->slots[0].data);
+    free(c->slots);
+    free(c->buckets);
+    free(c->buf);
+    free(c);
+}
@@ -0,0 +1,75 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include "device.h"
+
+/* Block cache. Keeps copies of data blocks in memory for devices that can not
+ * be mapped, so reading the same blocks again does not go back to the device.
+ *
+ * Slots are given out with the CLOCK algorithm. Each slot has a reference bit
+ * set when it is used, the hand sweeps round clearing bits and takes the first
+ * slot it finds clear. Blocks brought in by read ahead start with the bit
+ * clear so they are the first to go if nobody reads them.
+ *
+ * Writes to a block are kept in the cache and written back when the slot is
+ * reused or the cache is flushed. Whole blocks that are not in the cache are
+ * written straight to the device.
+ */
+
+typedef struct cache_slot {
+    u_int32_t blk;                  // block held in the slot
+    u_int32_t next;                 // next slot in the same hash bucket
+    u_int8_t valid;                 // slot holds a block
+    u_int8_t dirty;                 // slot differs from the device
+    u_int8_t ref;                   // used since the hand last passed
+    u_int8_t *data;                 // block_size bytes
+} cache_slot;
+
+typedef struct block_cache {
+    block_dev *dev;                 // device the blocks live on
+    u_int64_t data_start;           // device offset of block 0
+    u_int32_t block_size;           // bytes per block
+    u_int32_t count;                // number of slots
+    u_int32_t hand;                 // CLOCK hand
+    u_int32_t mask;                 // buckets - 1
+    u_int32_t run;                  // most blocks read from the device in one go
+    u_int32_t *buckets;             // first slot of each hash bucket
+    cache_slot *slots;
+    u_int8_t *buf;                  // scratch for reading runs of blocks
+    u_int64_t hits;                 // blocks found in the cache
+    u_int64_t misses;               // blocks read from the device
+    pthread_mutex_t lock;
+} block_cache;
+
+/* Creates a cache of count blocks. Returns NULL if out of memory */
+block_cache *cache_open(block_dev *dev, u_int64_t data_start, u_int32_t block_size, u_int32_t count);
+
+/* Copies len bytes starting off bytes into block blk, reading on into the
+ * blocks after it. Blocks that are missing are read in runs */
+u_int8_t cache_read(block_cache *c, u_int32_t blk, u_int32_t off, void *buf, u_int64_t len);
+
+/* Writes len bytes starting off bytes into block blk, carrying on into the
+ * blocks after it */
+u_int8_t cache_write(block_cache *c, u_int32_t blk, u_int32_t off, const void *buf, u_int64_t len);
+
+/* Same as cache_read and cache_write, but what has to come from or go to the
+ * device is added to b rather than done at once. Blocks read this way are not
+ * kept in the cache. buf is only complete once b has run */
+u_int8_t cache_read_batch(block_cache *c, dev_batch *b, u_int32_t blk, u_int32_t off, void *buf, u_int64_t len);
+u_int8_t cache_write_batch(block_cache *c, dev_batch *b, u_int32_t blk, u_int32_t off, const void *buf, u_int64_t len);
+
+/* Brings count blocks from blk onwards into the cache if they are not there */
+void cache_prefetch(block_cache *c, u_int32_t blk, u_int32_t count);
+
+/* Writes every dirty block back to the device in one batch */
+u_int8_t cache_flush(block_cache *c);
+
+/* Reads the hit and miss counters */
+void cache_counts(block_cache *c, u_int64_t *hits, u_int64_t *misses);
+
+/* Flushes the cache and frees it */
+void cache_close(block_cache *c);
+
+#endif
@@ -0,0 +1,228 @@
+#include <string.h>
+#include <pthread.h>
+#include "crc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC_X86
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC_ARM
+#endif
+
+#define CRC_POLY        0x82F63B78  // reflected Castagnoli polynomial
+#define CRC_LONG        0x2000      // bytes per stream for long buffers
+#define CRC_SHORT       0x0100      // bytes per stream for what is left
+
+typedef u_int32_t (*crc_fn)(u_int32_t crc, const u_int8_t *p, u_int64_t len);
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static crc_fn crc_run;
+static const char *crc_name;
+
+static u_int32_t slice[8][256];     // tables for the portable version
+static u_int32_t zeros_long[4][256];    // move a CRC past CRC_LONG zero bytes
+static u_int32_t zeros_short[4][256];   // and past CRC_SHORT zero bytes
+
+static u_int64_t load64(const u_int8_t *p) {
+    u_int64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* ---------------------------------------------------------------------------
+ * portable, slicing by eight
+ * ------------------------------------------------------------------------- */
+
+static u_int32_t crc_table(u_int32_t crc, const u_int8_t *p, u_int64_t len) {
+    u_int64_t v;
+
+    while (len > 0 && ((unsigned long) p & 7) != 0) {
+        crc = slice[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        v = load64(p) ^ crc;        // little endian, as on the CPUs this runs on
+        crc = slice[7][v & 0xFF] ^ slice[6][(v >> 8) & 0xFF] ^ slice[5][(v >> 16) & 0xFF] ^ slice[4][(v >> 24) & 0xFF]
+            ^ slice[3][(v >> 32) & 0xFF] ^ slice[2][(v >> 40) & 0xFF] ^ slice[1][(v >> 48) & 0xFF] ^ slice[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) crc = slice[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+/* ---------------------------------------------------------------------------
+ * Joining streams. Running a CRC over n more zero bytes is linear in the CRC,
+ * so it is a 32 by 32 matrix over GF(2). The matrix for n bytes is built by
+ * squaring the one for a single bit and kept as four byte tables
+ * ------------------------------------------------------------------------- */
+
+static u_int32_t gf2_times(const u_int32_t *mat, u_int32_t vec) {
+    u_int32_t sum = 0;
+
+    while (vec) {
+        if (vec & 1) sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_square(u_int32_t *square, const u_int32_t *mat) {
+    for (int n = 0; n < 32; n++) square[n] = gf2_times(mat, mat[n]);
+}
+
+/* fills zeros with the tables for len zero bytes, len a power of two */
+static void zeros_table(u_int32_t zeros[4][256], u_int32_t len) {
+    u_int32_t odd[32], even[32];
+    u_int32_t row = 1;
+
+    odd[0] = CRC_POLY;              // one zero bit
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_square(even, odd);          // two bits
+    gf2_square(odd, even);          // four bits
+
+    /* each square doubles, the first one here reaches a byte */
+    for (;;) {
+        gf2_square(even, odd);
+        len >>= 1;
+        if (len == 0) {
+            memcpy(odd, even, sizeof(odd));
+            break;
+        }
+        gf2_square(odd, even);
+        len >>= 1;
+        if (len == 0) break;
+    }
+
+    for (u_int32_t n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_times(odd, n);
+        zeros[1][n] = gf2_times(odd, n << 8);
+        zeros[2][n] = gf2_times(odd, n << 16);
+        zeros[3][n] = gf2_times(odd, n << 24);
+    }
+}
+
+static u_int32_t shift(u_int32_t zeros[4][256], u_int32_t crc) {
+    return zeros[0][crc & 0xFF] ^ zeros[1][(crc >> 8) & 0xFF] ^ zeros[2][(crc >> 16) & 0xFF] ^ zeros[3][crc >> 24];
+}
+
+/* ---------------------------------------------------------------------------
+ * SSE4.2
+ * ------------------------------------------------------------------------- */
+
+#ifdef CRC_X86
+__attribute__((target("sse4.2")))
+static u_int32_t crc_sse42(u_int32_t crc, const u_int8_t *p, u_int64_t len) {
+    u_int64_t crc0 = crc, crc1, crc2;
+    const u_int8_t *end;
+
+    while (len > 0 && ((unsigned long) p & 7) != 0) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+        len--;
+    }
+
+    /* three streams at once, then the first two are moved past the data of
+     * the ones after them and joined */
+    while (len >= 3 * CRC_LONG) {
+        crc1 = crc2 = 0;
+        for (end = p + CRC_LONG; p < end; p += 8) {
+            crc0 = _mm_crc32_u64(crc0, load64(p));
+            crc1 = _mm_crc32_u64(crc1, load64(p + CRC_LONG));
+            crc2 = _mm_crc32_u64(crc2, load64(p + 2 * CRC_LONG));
+        }
+        crc0 = shift(zeros_long, crc0) ^ crc1;
+        crc0 = shift(zeros_long, crc0) ^ crc2;
+        p += 2 * CRC_LONG;
+        len -= 3 * CRC_LONG;
+    }
+    while (len >= 3 * CRC_SHORT) {
+        crc1 = crc2 = 0;
+        for (end = p + CRC_SHORT; p < end; p += 8) {
+            crc0 = _mm_crc32_u64(crc0, load64(p));
+            crc1 = _mm_crc32_u64(crc1, load64(p + CRC_SHORT));
+            crc2 = _mm_crc32_u64(crc2, load64(p + 2 * CRC_SHORT));
+        }
+        crc0 = shift(zeros_short, crc0) ^ crc1;
+        crc0 = shift(zeros_short, crc0) ^ crc2;
+        p += 2 * CRC_SHORT;
+        len -= 3 * CRC_SHORT;
+    }
+
+    while (len >= 8) {
+        crc0 = _mm_crc32_u64(crc0, load64(p));
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) crc0 = _mm_crc32_u8(crc0, *p++);
+    return crc0;
+}
+#endif
+
+/* ---------------------------------------------------------------------------
+ * ARMv8
+ * ------------------------------------------------------------------------- */
+
+#ifdef CRC_ARM
+__attribute__((target("+crc")))
+static u_int32_t crc_armv8(u_int32_t crc, const u_int8_t *p, u_int64_t len) {
+    while (len > 0 && ((unsigned long) p & 7) != 0) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        crc = __crc32cd(crc, load64(p));
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+static void crc_init(void) {
+    u_int32_t crc;
+
+    for (u_int32_t n = 0; n < 256; n++) {
+        crc = n;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (CRC_POLY & -(crc & 1));
+        slice[0][n] = crc;
+    }
+    for (u_int32_t n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) slice[k][n] = slice[0][slice[k - 1][n] & 0xFF] ^ (slice[k - 1][n] >> 8);
+    }
+    zeros_table(zeros_long, CRC_LONG);
+    zeros_table(zeros_short, CRC_SHORT);
+
+    crc_run = crc_table;
+    crc_name = "table";
+#ifdef CRC_X86
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_run = crc_sse42;
+        crc_name = "sse4.2";
+    }
+#endif
+#ifdef CRC_ARM
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc_run = crc_armv8;
+        crc_name = "armv8";
+    }
+#endif
+}
+
+u_int32_t crc32c(u_int32_t crc, const void *buf, u_int64_t len) {
+    pthread_once(&crc_once, crc_init);
+    return ~crc_run(~crc, buf, len);
+}
+
+const char *crc32c_impl(void) {
+    pthread_once(&crc_once, crc_init);
+    return crc_name;
+}
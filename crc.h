@@ -0,0 +1,24 @@
+#ifndef CRC_H
+#define CRC_H
+
+#include <sys/types.h>
+
+/* CRC32C (Castagnoli) of buffers, used for the meta data slots, journal
+ * transactions, the super block and the checksums of data blocks.
+ *
+ * The CRC instructions of SSE4.2 or ARMv8 are used when the CPU has them,
+ * picked once on the first call. On x86 long buffers are split into three
+ * streams run side by side, which hides the latency of the instruction, and
+ * the three results joined with tables. Other CPUs use a table driven version
+ * that takes eight bytes a step.
+ *
+ * crc is the CRC of the data before buf, 0 to start, so a buffer can be
+ * checked a piece at a time.
+ */
+
+u_int32_t crc32c(u_int32_t crc, const void *buf, u_int64_t len);
+
+/* "sse4.2", "armv8" or "table" */
+const char *crc32c_impl(void);
+
+#endif
@@ -0,0 +1,540 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "device.h"
+#include "aio.h"
+#include "log.h"
+
+/* Opens the image and grows it to size if needed. Returns the file descriptor
+ * or -1 and sets *len to the final size of the image */
+static int open_image(const char *path, u_int64_t size, u_int64_t *len) {
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        log_error("Cannot open image -> Path: %s\n", path);
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    /* extends the image so that the whole device can be addressed */
+    if ((u_int64_t) st.st_size < size) {
+        if (ftruncate(fd, size) < 0) {
+            log_error("Cannot resize image -> Size: %llu\n", (unsigned long long) size);
+            close(fd);
+            return -1;
+        }
+        st.st_size = size;
+    }
+
+    *len = st.st_size;
+    return fd;
+}
+
+/* checks an access lies within the device */
+static u_int8_t in_range(block_dev *dev, u_int64_t off, u_int32_t len) {
+    if (off > dev->size || len > dev->size - off) {
+        log_error("Access outside of device -> Offset: %llx; Length: %u\n", (unsigned long long) off, len);
+        return 0;
+    }
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * mmap backend, the image is mapped once when opened and every block access
+ * is a memory copy.
+ * ------------------------------------------------------------------------- */
+
+static u_int8_t mmap_read(block_dev *dev, u_int64_t off, void *buf, u_int32_t len) {
+    if (!in_range(dev, off, len)) return 0;
+    memcpy(buf, (u_int8_t *) dev->ctx + off, len);
+    return 1;
+}
+
+static u_int8_t mmap_write(block_dev *dev, u_int64_t off, const void *buf, u_int32_t len) {
+    if (!in_range(dev, off, len)) return 0;
+    memcpy((u_int8_t *) dev->ctx + off, buf, len);
+    return 1;
+}
+
+static void *mmap_map(block_dev *dev, u_int64_t off, u_int32_t len) {
+    if (!in_range(dev, off, len)) return NULL;
+    return (u_int8_t *) dev->ctx + off;
+}
+
+static u_int8_t mmap_sync(block_dev *dev) {
+    return msync(dev->ctx, dev->size, MS_SYNC) == 0;
+}
+
+static void mmap_close(block_dev *dev) {
+    msync(dev->ctx, dev->size, MS_SYNC);
+    munmap(dev->ctx, dev->size);
+    free(dev);
+}
+
+static const dev_ops mmap_ops = {
+    .read = mmap_read,
+    .write = mmap_write,
+    .map = mmap_map,
+    .sync = mmap_sync,
+    .close = mmap_close,
+};
+
+block_dev *mmap_dev_open(const char *path, u_int64_t size) {
+    block_dev *dev;
+    u_int64_t len;
+    void *base;
+    int fd;
+
+    fd = open_image(path, size, &len);
+    if (fd < 0) return NULL;
+
+    if (len == 0) {
+        log_error("Cannot map empty image -> Path: %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file referenced
+
+    if (base == MAP_FAILED) {
+        log_error("Cannot map image -> Path: %s\n", path);
+        return NULL;
+    }
+
+    dev = calloc(1, sizeof(block_dev));
+    if (dev == NULL) {
+        log_error("Out of memory for device -> Path: %s\n", path);
+        munmap(base, len);
+        return NULL;
+    }
+    dev->ops = &mmap_ops;
+    dev->size = len;
+    dev->ctx = base;
+    return dev;
+}
+
+/* ---------------------------------------------------------------------------
+ * file backend, one positioned read or write per access. Used where the image
+ * cannot be mapped. Batches are handed to the asynchronous engine.
+ * ------------------------------------------------------------------------- */
+
+typedef struct file_ctx {
+    int fd;
+    aio_engine *aio;                // NULL if no engine could be started
+} file_ctx;
+
+static u_int8_t file_read(block_dev *dev, u_int64_t off, void *buf, u_int32_t len) {
+    int fd = ((file_ctx *) dev->ctx)->fd;
+    ssize_t n;
+
+    if (!in_range(dev, off, len)) return 0;
+    while (len > 0) {
+        n = pread(fd, buf, len, off);
+        if (n <= 0) return 0;
+        buf = (u_int8_t *) buf + n;
+        off += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static u_int8_t file_write(block_dev *dev, u_int64_t off, const void *buf, u_int32_t len) {
+    int fd = ((file_ctx *) dev->ctx)->fd;
+    ssize_t n;
+
+    if (!in_range(dev, off, len)) return 0;
+    while (len > 0) {
+        n = pwrite(fd, buf, len, off);
+        if (n <= 0) return 0;
+        buf = (const u_int8_t *) buf + n;
+        off += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static u_int8_t file_submit(block_dev *dev, dev_io *ios, u_int32_t count) {
+    file_ctx *f = dev->ctx;
+    u_int8_t ok = 1;
+
+    for (u_int32_t i = 0; i < count; i++) {
+        if (!in_range(dev, ios[i].off, ios[i].len)) return 0;
+    }
+    if (f->aio != NULL) return aio_run(f->aio, ios, count);
+
+    for (u_int32_t i = 0; i < count; i++) {
+        if (ios[i].write) ok &= file_write(dev, ios[i].off, ios[i].buf, ios[i].len);
+        else ok &= file_read(dev, ios[i].off, ios[i].buf, ios[i].len);
+    }
+    return ok;
+}
+
+static u_int8_t file_sync(block_dev *dev) {
+    return fsync(((file_ctx *) dev->ctx)->fd) == 0;
+}
+
+static void file_close(block_dev *dev) {
+    file_ctx *f = dev->ctx;
+
+    if (f->aio != NULL) aio_close(f->aio);
+    close(f->fd);
+    free(f);
+    free(dev);
+}
+
+static const dev_ops file_ops = {
+    .read = file_read,
+    .write = file_write,
+    .map = NULL,
+    .sync = file_sync,
+    .close = file_close,
+    .submit = file_submit,
+};
+
+block_dev *file_dev_open(const char *path, u_int64_t size) {
+    block_dev *dev;
+    file_ctx *f;
+    u_int64_t len;
+    int fd;
+
+    fd = open_image(path, size, &len);
+    if (fd < 0) return NULL;
+
+    f = calloc(1, sizeof(file_ctx));
+    dev = calloc(1, sizeof(block_dev));
+    if (f == NULL || dev == NULL) {
+        log_error("Out of memory for device -> Path: %s\n", path);
+        free(f);
+        free(dev);
+        close(fd);
+        return NULL;
+    }
+
+    f->fd = fd;
+    f->aio = aio_open(fd);
+    if (f->aio == NULL) log_warn("No asynchronous I/O, batches run one io at a time\n");
+
+    dev->ops = &file_ops;
+    dev->size = len;
+    dev->ctx = f;
+    return dev;
+}
+
+/* ---------------------------------------------------------------------------
+ * simulated EEPROM, in front of another backend that holds the data. Keeps a
+ * clock of what the accesses would have taken and a write count per byte.
+ * ------------------------------------------------------------------------- */
+
+typedef struct eeprom_ctx {
+    block_dev *under;               // holds the data
+    eeprom_model model;
+    pthread_mutex_t lock;           // one access at a time, like the bus
+    u_int32_t *wear;                // writes to each byte
+    u_int8_t *programmed;           // bit per byte written since its erase, NULL without erase_size
+    u_int64_t sim_ns;
+    u_int64_t write_cycles;
+    u_int64_t erases;
+    u_int64_t cell_writes;
+    u_int64_t bytes_read;
+} eeprom_ctx;
+
+/* counts a write to the bytes from start to end */
+static void eeprom_program(eeprom_ctx *e, u_int64_t start, u_int64_t end) {
+    for (u_int64_t i = start; i < end; i++) {
+        e->wear[i]++;
+        if (e->programmed != NULL) e->programmed[i >> 3] |= 1 << (i & 7);
+    }
+    e->cell_writes += end - start;
+}
+
+/* 1 if any byte from start to end was written since it was last erased */
+static u_int8_t eeprom_dirty(eeprom_ctx *e, u_int64_t start, u_int64_t end) {
+    for (u_int64_t i = start; i < end; i++) {
+        if (e->programmed[i >> 3] & 1 << (i & 7)) return 1;
+    }
+    return 0;
+}
+
+/* Charges a write of len bytes at off. A write cycle programs the part of
+ * one page it covers. With an erase size, writing a byte that was written
+ * since its erase takes an erase of the whole unit first and the unit is
+ * then written back page by page */
+static void eeprom_charge_write(block_dev *dev, u_int64_t off, u_int32_t len) {
+    eeprom_ctx *e = dev->ctx;
+    eeprom_model *m = &e->model;
+    u_int64_t end = off + len;
+    u_int64_t unit_start, unit_end, stop, pages;
+
+    e->sim_ns += (u_int64_t) len * m->byte_ns;
+    while (off < end) {
+        if (e->programmed != NULL) {
+            unit_start = off - off % m->erase_size;
+            unit_end = unit_start + m->erase_size < dev->size ? unit_start + m->erase_size : dev->size;
+            stop = end < unit_end ? end : unit_end;
+            if (eeprom_dirty(e, off, stop)) {
+                memset(e->programmed + (unit_start >> 3), 0, (unit_end - unit_start + 7) >> 3);
+                pages = (unit_end - unit_start + m->page_size - 1) / m->page_size;
+                e->erases++;
+                e->write_cycles += pages;
+                e->sim_ns += m->erase_ns + pages * m->write_ns;
+                eeprom_program(e, unit_start, unit_end);
+                off = stop;
+                continue;
+            }
+        }
+        stop = off - off % m->page_size + m->page_size;
+        if (stop > end) stop = end;
+        e->write_cycles++;
+        e->sim_ns += m->write_ns;
+        eeprom_program(e, off, stop);
+        off = stop;
+    }
+}
+
+static u_int8_t eeprom_read(block_dev *dev, u_int64_t off, void *buf, u_int32_t len) {
+    eeprom_ctx *e = dev->ctx;
+
+    if (!in_range(dev, off, len)) return 0;
+    pthread_mutex_lock(&e->lock);
+    e->sim_ns += (u_int64_t) len * e->model.byte_ns;
+    e->bytes_read += len;
+    pthread_mutex_unlock(&e->lock);
+    return dev_read(e->under, off, buf, len);
+}
+
+static u_int8_t eeprom_write(block_dev *dev, u_int64_t off, const void *buf, u_int32_t len) {
+    eeprom_ctx *e = dev->ctx;
+
+    if (!in_range(dev, off, len)) return 0;
+    pthread_mutex_lock(&e->lock);
+    eeprom_charge_write(dev, off, len);
+    pthread_mutex_unlock(&e->lock);
+    return dev_write(e->under, off, buf, len);
+}
+
+static u_int8_t eeprom_sync(block_dev *dev) {
+    return dev_sync(((eeprom_ctx *) dev->ctx)->under);
+}
+
+static void eeprom_close(block_dev *dev) {
+    eeprom_ctx *e = dev->ctx;
+
+    dev_close(e->under);
+    pthread_mutex_destroy(&e->lock);
+    free(e->wear);
+    free(e->programmed);
+    free(e);
+    free(dev);
+}
+
+static const dev_ops eeprom_ops = {
+    .read = eeprom_read,
+    .write = eeprom_write,
+    .map = NULL,
+    .sync = eeprom_sync,
+    .close = eeprom_close,
+};
+
+block_dev *eeprom_dev_open(block_dev *under, const eeprom_model *model) {
+    block_dev *dev;
+    eeprom_ctx *e;
+
+    if (under == NULL) return NULL;
+    if (model->page_size == 0 || (model->erase_size != 0 && model->erase_size % model->page_size != 0)) {
+        log_error("Invalid EEPROM model -> Page size: %u; Erase size: %u\n", model->page_size, model->erase_size);
+        return NULL;
+    }
+
+    e = calloc(1, sizeof(eeprom_ctx));
+    dev = calloc(1, sizeof(block_dev));
+    if (e != NULL) e->wear = calloc(under->size, sizeof(u_int32_t));
+    if (e != NULL && model->erase_size != 0) e->programmed = calloc((under->size + 7) >> 3, 1);
+    if (e == NULL || dev == NULL || e->wear == NULL || (model->erase_size != 0 && e->programmed == NULL)) {
+        log_error("Out of memory for wear counters -> Size: %llu\n", (unsigned long long) under->size);
+        if (e != NULL) {
+            free(e->wear);
+            free(e->programmed);
+        }
+        free(e);
+        free(dev);
+        return NULL;
+    }
+
+    e->under = under;
+    e->model = *model;
+    pthread_mutex_init(&e->lock, NULL);
+
+    dev->ops = &eeprom_ops;
+    dev->size = under->size;
+    dev->ctx = e;
+    return dev;
+}
+
+u_int8_t eeprom_get_stats(block_dev *dev, eeprom_stats *st) {
+    eeprom_ctx *e = dev->ctx;
+
+    if (dev->ops != &eeprom_ops) return 0;
+    memset(st, 0, sizeof(eeprom_stats));
+
+    pthread_mutex_lock(&e->lock);
+    st->sim_ns = e->sim_ns;
+    st->write_cycles = e->write_cycles;
+    st->erases = e->erases;
+    st->cell_writes = e->cell_writes;
+    st->bytes_read = e->bytes_read;
+    for (u_int64_t i = 0; i < dev->size; i++) {
+        if (e->wear[i] > st->max_wear) st->max_wear = e->wear[i];
+        if (e->wear[i] > e->model.endurance) st->worn_cells++;
+    }
+    pthread_mutex_unlock(&e->lock);
+    return 1;
+}
+
+const eeprom_model *eeprom_get_model(block_dev *dev) {
+    if (dev->ops != &eeprom_ops) return NULL;
+    return &((eeprom_ctx *) dev->ctx)->model;
+}
+
+const u_int32_t *eeprom_wear(block_dev *dev) {
+    if (dev->ops != &eeprom_ops) return NULL;
+    return ((eeprom_ctx *) dev->ctx)->wear;
+}
+
+/* ---------------------------------------------------------------------------
+ * batches
+ * ------------------------------------------------------------------------- */
+
+void dev_batch_init(dev_batch *b) {
+    memset(b, 0, sizeof(dev_batch));
+}
+
+/* makes room for one more io */
+static u_int8_t grow_ios(dev_batch *b) {
+    dev_io *ios;
+    u_int32_t cap;
+
+    if (b->count < b->cap) return 1;
+    cap = b->cap ? b->cap * 2 : 0x10;
+    ios = realloc(b->ios, cap * sizeof(dev_io));
+    if (ios == NULL) {
+        b->failed = 1;
+        return 0;
+    }
+    b->ios = ios;
+    b->cap = cap;
+    return 1;
+}
+
+u_int8_t dev_batch_add(dev_batch *b, u_int8_t write, u_int64_t off, void *buf, u_int32_t len) {
+    dev_io *last;
+
+    if (len == 0) return 1;
+
+    /* a run of blocks laid out one after the other in both places is one io */
+    if (b->count > 0) {
+        last = &b->ios[b->count - 1];
+        if (last->write == write && last->off + last->len == off &&
+            (u_int8_t *) last->buf + last->len == (u_int8_t *) buf && (u_int64_t) last->len + len <= 0x40000000) {
+            last->len += len;
+            return 1;
+        }
+    }
+
+    if (!grow_ios(b)) return 0;
+    last = &b->ios[b->count++];
+    last->off = off;
+    last->buf = buf;
+    last->len = len;
+    last->write = write;
+    return 1;
+}
+
+u_int8_t dev_batch_copy(dev_batch *b, u_int64_t off, const void *buf, u_int32_t len) {
+    dev_io *last;
+    void **copies;
+    u_int8_t *copy;
+    u_int64_t cap;
+
+    if (len == 0) return 1;
+
+    /* writes that follow on from the newest copy are added to the end of it */
+    if (b->count > 0 && b->copies_count > 0) {
+        last = &b->ios[b->count - 1];
+        if (last->write && last->buf == b->copies[b->copies_count - 1] && last->off + last->len == off &&
+            (u_int64_t) last->len + len <= 0x40000000) {
+            if (last->len + len > b->last_copy_cap) {
+                cap = (last->len + len) * 2;
+                copy = realloc(last->buf, cap);
+                if (copy == NULL) {
+                    b->failed = 1;
+                    return 0;
+                }
+                last->buf = copy;
+                b->copies[b->copies_count - 1] = copy;
+                b->last_copy_cap = cap;
+            }
+            memcpy((u_int8_t *) last->buf + last->len, buf, len);
+            last->len += len;
+            return 1;
+        }
+    }
+
+    if (b->copies_count == b->copies_cap) {
+        cap = b->copies_cap ? b->copies_cap * 2 : 0x10;
+        copies = realloc(b->copies, cap * sizeof(void *));
+        if (copies == NULL) {
+            b->failed = 1;
+            return 0;
+        }
+        b->copies = copies;
+        b->copies_cap = cap;
+    }
+
+    copy = malloc(len);
+    if (copy == NULL || !grow_ios(b)) {
+        free(copy);
+        b->failed = 1;
+        return 0;
+    }
+    memcpy(copy, buf, len);
+    b->copies[b->copies_count++] = copy;
+    b->last_copy_cap = len;
+
+    last = &b->ios[b->count++];
+    last->off = off;
+    last->buf = copy;
+    last->len = len;
+    last->write = 1;
+    return 1;
+}
+
+u_int8_t dev_batch_run(block_dev *dev, dev_batch *b) {
+    u_int8_t ok = !b->failed;
+
+    if (b->count > 0 && !dev_submit(dev, b->ios, b->count)) ok = 0;
+
+    for (u_int32_t i = 0; i < b->copies_count; i++) free(b->copies[i]);
+    b->copies_count = 0;
+    b->count = 0;
+    b->failed = 0;
+    return ok;
+}
+
+void dev_batch_free(dev_batch *b) {
+    for (u_int32_t i = 0; i < b->copies_count; i++) free(b->copies[i]);
+    free(b->copies);
+    free(b->ios);
+    dev_batch_init(b);
+}
@@ -0,0 +1,179 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <sys/types.h>
+
+/* Block device layer. The file system only ever talks to the storage through
+ * one of these, so the backing store can be swapped without touching main.c.
+ *
+ * All offsets are byte offsets from the start of the device. read and write
+ * return 1 on success and 0 on failure like the rest of the file system.
+ * map is optional and returns a direct pointer into the device for backends
+ * that can provide one (NULL otherwise).
+ */
+
+typedef struct block_dev block_dev;
+
+/* one read or write of a batch */
+typedef struct dev_io {
+    u_int64_t off;                  // device offset
+    void *buf;                      // data to write or where to read it to
+    u_int32_t len;                  // bytes
+    u_int8_t write;                 // 1 to write, 0 to read
+} dev_io;
+
+/* submit is optional too. It runs every io of a batch, in any order and as
+ * many at once as the backend likes, and returns when they have all finished.
+ * Without it the ios are run one after another with read and write */
+typedef struct dev_ops {
+    u_int8_t (*read)(block_dev *dev, u_int64_t off, void *buf, u_int32_t len);
+    u_int8_t (*write)(block_dev *dev, u_int64_t off, const void *buf, u_int32_t len);
+    void *(*map)(block_dev *dev, u_int64_t off, u_int32_t len);
+    u_int8_t (*sync)(block_dev *dev);
+    void (*close)(block_dev *dev);
+    u_int8_t (*submit)(block_dev *dev, dev_io *ios, u_int32_t count);
+} dev_ops;
+
+struct block_dev {
+    const dev_ops *ops;             // backend implementation
+    u_int64_t size;                 // size of the device in bytes
+    void *ctx;                      // backend private data
+    u_int64_t reads;                // calls to read, counted by dev_read
+    u_int64_t read_bytes;
+    u_int64_t writes;               // calls to write, counted by dev_write
+    u_int64_t write_bytes;
+    u_int64_t syncs;                // calls to sync
+    u_int64_t batches;              // batches run by dev_submit
+};
+
+/* Reads and writes gathered up and then run in one go by dev_batch_run, so a
+ * transfer of many blocks costs one submission rather than a call each. The
+ * ios of a batch may run in any order and at the same time, so a batch must
+ * not touch the same bytes twice. Buffers added with dev_batch_add have to
+ * stay put until the batch has run, dev_batch_copy takes a copy instead */
+typedef struct dev_batch {
+    dev_io *ios;
+    u_int32_t count;                // ios in the batch
+    u_int32_t cap;                  // ios allocated
+    u_int8_t failed;                // ran out of memory adding an io
+    void **copies;                  // buffers owned by the batch
+    u_int32_t copies_count;
+    u_int32_t copies_cap;
+    u_int64_t last_copy_cap;        // bytes allocated for the newest copy
+} dev_batch;
+
+/* Opens an image file and maps it into memory. If size is larger than the
+ * current image the file is extended, a size of 0 keeps the file as is */
+block_dev *mmap_dev_open(const char *path, u_int64_t size);
+
+/* Opens an image file using plain positioned reads and writes. Batches go
+ * through io_uring or a pool of threads, see aio.h */
+block_dev *file_dev_open(const char *path, u_int64_t size);
+
+/* What an EEPROM simulated by eeprom_dev_open costs. Times are nanoseconds */
+typedef struct eeprom_model {
+    u_int32_t page_size;            // bytes programmed by one write cycle
+    u_int32_t erase_size;           // bytes erased together, 0 when a write cycle erases what it writes
+    u_int64_t write_ns;             // one write cycle
+    u_int64_t erase_ns;             // one erase of erase_size bytes
+    u_int64_t byte_ns;              // moving a byte over the bus, read or written
+    u_int32_t endurance;            // writes each cell is rated for
+} eeprom_model;
+
+/* defaults of a typical serial EEPROM on a 1MHz bus */
+#define EEPROM_PAGE         0x0040      // 64 byte pages
+#define EEPROM_WRITE_NS     5000000     // 5ms write cycle
+#define EEPROM_BYTE_NS      9000        // 9 clocks a byte
+#define EEPROM_ENDURANCE    1000000     // writes a cell lasts
+
+/* what the simulated device has done since it was opened */
+typedef struct eeprom_stats {
+    u_int64_t sim_ns;               // device time taken
+    u_int64_t write_cycles;         // pages programmed
+    u_int64_t erases;               // erase cycles, 0 without erase_size
+    u_int64_t cell_writes;          // bytes programmed, including ones an erase made write again
+    u_int64_t bytes_read;
+    u_int64_t max_wear;             // writes to the most written cell
+    u_int64_t worn_cells;           // cells written more often than the endurance
+} eeprom_stats;
+
+/* Puts a simulated EEPROM in front of another device, which still holds the
+ * data and is closed with it. Every access is charged to the clock of the
+ * model and every byte written counted against its cell, nothing sleeps.
+ * It can not be mapped, so the file system uses the block cache over it */
+block_dev *eeprom_dev_open(block_dev *under, const eeprom_model *model);
+
+/* Fills in the totals of a simulated EEPROM. Returns 0 for any other device */
+u_int8_t eeprom_get_stats(block_dev *dev, eeprom_stats *st);
+
+/* the model and the write count of every byte of a simulated EEPROM, NULL
+ * for any other device */
+const eeprom_model *eeprom_get_model(block_dev *dev);
+const u_int32_t *eeprom_wear(block_dev *dev);
+
+void dev_batch_init(dev_batch *b);
+
+/* Adds a read or write of len bytes at off. Joins on to the io before it when
+ * both the device range and the buffer follow on */
+u_int8_t dev_batch_add(dev_batch *b, u_int8_t write, u_int64_t off, void *buf, u_int32_t len);
+
+/* Adds a write of a copy of buf, so buf can be reused at once */
+u_int8_t dev_batch_copy(dev_batch *b, u_int64_t off, const void *buf, u_int32_t len);
+
+/* Runs every io in the batch and empties it. Returns 0 if any failed */
+u_int8_t dev_batch_run(block_dev *dev, dev_batch *b);
+
+/* frees what the batch holds, it can be used again after dev_batch_init */
+void dev_batch_free(dev_batch *b);
+
+/* Helpers so callers dont have to go through the ops table. They also count
+ * the calls, several threads can be using the device at once */
+static inline u_int8_t dev_read(block_dev *dev, u_int64_t off, void *buf, u_int32_t len) {
+    __atomic_fetch_add(&dev->reads, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dev->read_bytes, len, __ATOMIC_RELAXED);
+    return dev->ops->read(dev, off, buf, len);
+}
+
+static inline u_int8_t dev_write(block_dev *dev, u_int64_t off, const void *buf, u_int32_t len) {
+    __atomic_fetch_add(&dev->writes, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dev->write_bytes, len, __ATOMIC_RELAXED);
+    return dev->ops->write(dev, off, buf, len);
+}
+
+static inline void *dev_map(block_dev *dev, u_int64_t off, u_int32_t len) {
+    if (dev->ops->map == NULL) return NULL;
+    return dev->ops->map(dev, off, len);
+}
+
+static inline u_int8_t dev_sync(block_dev *dev) {
+    __atomic_fetch_add(&dev->syncs, 1, __ATOMIC_RELAXED);
+    return dev->ops->sync(dev);
+}
+
+static inline u_int8_t dev_submit(block_dev *dev, dev_io *ios, u_int32_t count) {
+    u_int8_t ok = 1;
+
+    __atomic_fetch_add(&dev->batches, 1, __ATOMIC_RELAXED);
+    for (u_int32_t i = 0; i < count; i++) {
+        if (ios[i].write) {
+            __atomic_fetch_add(&dev->writes, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&dev->write_bytes, ios[i].len, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_add(&dev->reads, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&dev->read_bytes, ios[i].len, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (dev->ops->submit != NULL) return dev->ops->submit(dev, ios, count);
+    for (u_int32_t i = 0; i < count; i++) {
+        if (ios[i].write) ok &= dev->ops->write(dev, ios[i].off, ios[i].buf, ios[i].len);
+        else ok &= dev->ops->read(dev, ios[i].off, ios[i].buf, ios[i].len);
+    }
+    return ok;
+}
+
+static inline void dev_close(block_dev *dev) {
+    dev->ops->close(dev);
+}
+
+#endif
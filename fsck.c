@@ -0,0 +1,584 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "device.h"
+#include "cache.h"
+#include "log.h"
+#include "stats.h"
+#include "main.h"
+
+/* Offline check and repair of a file system image. Every chain in the fat is
+ * followed from its directory entry and checked for
+ *
+ *   cycles             a chain that comes back on itself
+ *   cross links        a block reached from more than one file
+ *   bad links          a block number past the end of the device
+ *   free blocks        a block in a chain that the fat says is free
+ *   length mismatches  a chain shorter or longer than the length needs
+ *   lost blocks        a block in use in the fat that no file reaches
+ *   queue entries      a block in the free queue that a file is using
+ *
+ * and the tree of directories is checked from the root. An image formatted
+ * with block checksums also has every block of every file checked against
+ * them, blocks that fail can only be reported. With -r the problems
+ * are repaired. Chains are cut at the first bad block, a block reached by two
+ * files stays with the lower numbered one, lost blocks are freed and the
+ * free queue and bitmap are built again from the fat. Nothing is written
+ * without -r.
+ *
+ * Chains are checked in parallel. The first pass has every file claim the
+ * blocks of its chain, keeping the lowest file number on each block. After
+ * that a block belongs to one file so the second pass can follow each chain
+ * on its own without locks.
+ *
+ * Build with main.c compiled as a library, see the README
+ *   gcc -O2 -DMINIFAT_LIB -o fsck fsck.c main.c device.c aio.c cache.c crc.c lz.c stats.c -lpthread
+ *
+ * The exit status follows e2fsck, 0 when the image is clean, 1 when problems
+ * were found and repaired, 4 when problems were left and 8 when the image
+ * could not be checked.
+ */
+
+#define FSCK_CHUNK      0x0040      // directory entries a thread takes at a time
+#define MAX_THREADS     0x0040      // most threads checking chains
+#define MAX_REPORTS     0x0020      // problems of one kind printed before they are only counted
+
+#define EXIT_CLEAN      0
+#define EXIT_REPAIRED   1
+#define EXIT_LEFT       4
+#define EXIT_FAILED     8
+
+/* how following a chain stopped */
+enum chain_end {
+    CHAIN_OK,                       // reached END_BLOCK, or the length needed no more
+    CHAIN_BAD_START,                // start block past the end of the device
+    CHAIN_CYCLE,                    // came back to a block of the same chain
+    CHAIN_CROSS,                    // reached a block belonging to a lower numbered file
+    CHAIN_BAD_LINK,                 // next block past the end of the device
+    CHAIN_FREE                      // a block the fat says is free
+};
+
+/* what the second pass found out about the chain of a file */
+typedef struct chain_check {
+    u_int32_t kept;                 // blocks of the chain kept
+    block last;                     // last block kept, END_BLOCK when none are
+    block at;                       // block the problem was found at
+    filename other;                 // file owning the block for CHAIN_CROSS
+    u_int8_t end;                   // enum chain_end
+    u_int8_t too_long;              // more blocks than the length needs
+} chain_check;
+
+typedef struct fsck_state {
+    meta_data *md;
+    u_int32_t *owner;               // lowest file reaching each block, NO_FILE if none
+    u_int8_t *seen;                 // block visited by the second pass
+    u_int8_t *used;                 // block kept in a chain
+    chain_check *chains;            // one per directory entry
+    u_int32_t next;                 // first entry of the next chunk handed out
+    void (*pass)(struct fsck_state *st, filename fn);
+} fsck_state;
+
+/* problems found, by kind */
+typedef struct fsck_counts {
+    u_int32_t bad_start;
+    u_int32_t cycles;
+    u_int32_t cross_links;
+    u_int32_t bad_links;
+    u_int32_t free_in_chain;
+    u_int32_t length;
+    u_int32_t lost;
+    u_int32_t queued_in_use;
+    u_int32_t queue;
+    u_int32_t names;
+    u_int32_t checksums;            // blocks that do not match their checksum
+    u_int32_t left;                 // problems a repair could not fix
+} fsck_counts;
+
+static u_int8_t verbose;
+
+/* blocks a file of length bytes takes, a file always has at least one */
+static u_int32_t blocks_needed(meta_data *md, u_int32_t length) {
+    u_int64_t need = ((u_int64_t) length + md->sb.block_size - 1) / md->sb.block_size;
+    return need ? need : 1;
+}
+
+/* prints a problem unless too many of its kind have been printed already */
+#define report(count, ...) \
+    do { \
+        if ((count)++ < MAX_REPORTS || verbose) printf(__VA_ARGS__); \
+    } while (0)
+
+/* ---------------------------------------------------------------------------
+ * chains, checked in parallel
+ * ------------------------------------------------------------------------- */
+
+/* First pass. Claims every block the chain of fn reaches unless a lower
+ * numbered file has it already. Stops once the length needs no more blocks so
+ * a chain running on into another file does not take its blocks from it */
+static void claim_chain(fsck_state *st, filename fn) {
+    meta_data *md = st->md;
+    u_int32_t need = blocks_needed(md, md->dir[fn].length);
+    u_int32_t owner;
+    block b = md->dir[fn].startblock;
+
+    for (u_int32_t steps = 0; b < md->sb.total_blocks && steps < need; steps++) {
+        owner = __atomic_load_n(&st->owner[b], __ATOMIC_RELAXED);
+        while (fn < owner && !__atomic_compare_exchange_n(&st->owner[b], &owner, fn, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        b = md->fat[b];
+    }
+}
+
+/* Second pass. Follows the chain of fn through the blocks it owns and works
+ * out where it has to be cut. Only fn touches seen for these blocks */
+static void walk_chain(fsck_state *st, filename fn) {
+    meta_data *md = st->md;
+    chain_check *c = &st->chains[fn];
+    u_int32_t need = blocks_needed(md, md->dir[fn].length);
+    block b = md->dir[fn].startblock;
+    block next;
+
+    memset(c, 0, sizeof(chain_check));
+    c->last = END_BLOCK;
+    c->end = CHAIN_OK;
+
+    if (b == FREE_BLOCK) return;
+    if (b >= md->sb.total_blocks) {
+        c->end = CHAIN_BAD_START;
+        c->at = b;
+        return;
+    }
+
+    for (;;) {
+        if (st->owner[b] != fn) {
+            c->end = CHAIN_CROSS;
+            c->other = st->owner[b];
+            c->at = b;
+            return;
+        }
+        if (st->seen[b]) {
+            c->end = CHAIN_CYCLE;
+            c->at = b;
+            return;
+        }
+        st->seen[b] = 1;
+        c->kept++;
+        c->last = b;
+
+        next = md->fat[b];
+        if (next == END_BLOCK) return;
+        if (c->kept == need) {
+            /* a chain looping back from its last block is a cycle rather than just long */
+            if (next < md->sb.total_blocks && st->owner[next] == fn && st->seen[next]) {
+                c->end = CHAIN_CYCLE;
+                c->at = next;
+            } else {
+                c->too_long = 1;
+            }
+            return;
+        }
+        if (next == FREE_BLOCK || next >= md->sb.total_blocks) {
+            c->end = next == FREE_BLOCK ? CHAIN_FREE : CHAIN_BAD_LINK;
+            c->at = b;
+            return;
+        }
+        b = next;
+    }
+}
+
+/* Third pass. Marks the blocks kept by the second pass as used */
+static void mark_chain(fsck_state *st, filename fn) {
+    meta_data *md = st->md;
+    block b = md->dir[fn].startblock;
+
+    for (u_int32_t i = 0; i < st->chains[fn].kept; i++) {
+        st->used[b] = 1;
+        b = md->fat[b];
+    }
+}
+
+static void *pass_worker(void *arg) {
+    fsck_state *st = arg;
+    u_int32_t first;
+    u_int32_t last;
+
+    for (;;) {
+        first = __atomic_fetch_add(&st->next, FSCK_CHUNK, __ATOMIC_RELAXED);
+        if (first >= st->md->sb.max_files) return NULL;
+
+        last = first + FSCK_CHUNK < st->md->sb.max_files ? first + FSCK_CHUNK : st->md->sb.max_files;
+        for (filename fn = first; fn < last; fn++) st->pass(st, fn);
+    }
+}
+
+/* runs pass over every directory entry on threads threads */
+static void run_pass(fsck_state *st, void (*pass)(fsck_state *st, filename fn), u_int32_t threads) {
+    pthread_t tid[MAX_THREADS];
+    u_int32_t started = 0;
+
+    st->next = 0;
+    st->pass = pass;
+    while (started < threads - 1 && pthread_create(&tid[started], NULL, pass_worker, st) == 0) started++;
+    pass_worker(st);
+    for (u_int32_t i = 0; i < started; i++) pthread_join(tid[i], NULL);
+}
+
+/* Prints what the second pass found about each file and, with repair set,
+ * cuts the chains and puts the lengths right */
+static void fix_chains(fsck_state *st, fsck_counts *n, u_int8_t repair) {
+    meta_data *md = st->md;
+    chain_check *c;
+    dir_entry *e;
+    u_int64_t have;
+
+    for (filename fn = 0; fn < md->sb.max_files; fn++) {
+        c = &st->chains[fn];
+        e = &md->dir[fn];
+
+        switch (c->end) {
+            case CHAIN_BAD_START:
+                report(n->bad_start, "File %u -> Start block %u past the end of the device\n", fn, c->at);
+                break;
+            case CHAIN_CYCLE:
+                report(n->cycles, "File %u -> Chain loops back to block %u after %u blocks\n", fn, c->at, c->kept);
+                break;
+            case CHAIN_CROSS:
+                report(n->cross_links, "File %u -> Block %u is also in the chain of file %u\n", fn, c->at, c->other);
+                break;
+            case CHAIN_BAD_LINK:
+                report(n->bad_links, "File %u -> Block %u links past the end of the device -> %u\n", fn, c->at, md->fat[c->at]);
+                break;
+            case CHAIN_FREE:
+                report(n->free_in_chain, "File %u -> Block %u in the chain is marked free\n", fn, c->at);
+                break;
+        }
+
+        have = (u_int64_t) c->kept * md->sb.block_size;
+        if (c->too_long) {
+            report(n->length, "File %u -> Chain longer than the length needs -> Length: %u\n", fn, e->length);
+        } else if (e->startblock != FREE_BLOCK && e->length > have) {
+            report(n->length, "File %u -> Length longer than the chain -> Length: %u; Blocks: %u\n", fn, e->length, c->kept);
+        } else if (e->startblock == FREE_BLOCK && e->length > 0) {
+            report(n->length, "File %u -> Length without any blocks -> Length: %u\n", fn, e->length);
+        }
+
+        if (!repair) continue;
+
+        if (c->kept == 0) {
+            /* nothing of the chain is left */
+            if (e->startblock != FREE_BLOCK || e->length > 0) {
+                e->startblock = FREE_BLOCK;
+                e->length = 0;
+                mark_dirty(&md->dir_dirty, fn);
+            }
+        } else {
+            if (c->end != CHAIN_OK || c->too_long) set_fat(md, c->last, END_BLOCK);
+            if (e->length > have) {
+                e->length = have;
+                mark_dirty(&md->dir_dirty, fn);
+            }
+        }
+        md->extents[fn].valid = 0;
+    }
+}
+
+/* Finds blocks in use in the fat that no chain kept and free blocks that a
+ * chain kept and frees the first with repair set */
+static void check_blocks(fsck_state *st, fsck_counts *n, u_int8_t repair) {
+    meta_data *md = st->md;
+
+    for (block b = 0; b < md->sb.total_blocks; b++) {
+        if (st->used[b]) {
+            if (is_free(md, b)) report(n->queued_in_use, "Block %u -> In the free queue but used by file %u\n", b, st->owner[b]);
+        } else if (md->fat[b] != FREE_BLOCK) {
+            report(n->lost, "Block %u -> In use but not in any file\n", b);
+            if (repair) set_fat(md, b, FREE_BLOCK);
+        }
+    }
+}
+
+/* Forgets the changes made while mounting, such as a rebuilt free queue, so
+ * that only checking leaves the image as it was */
+static void forget_changes(meta_data *md) {
+    memset(md->dir_dirty.bits, 0, (md->dir_dirty.chunks + 63) / 64 * sizeof(u_int64_t));
+    memset(md->fat_dirty.bits, 0, (md->fat_dirty.chunks + 63) / 64 * sizeof(u_int64_t));
+    memset(md->queue_dirty.bits, 0, (md->queue_dirty.chunks + 63) / 64 * sizeof(u_int64_t));
+    if (md->crcs != NULL) memset(md->crc_dirty.bits, 0, (md->crc_dirty.chunks + 63) / 64 * sizeof(u_int64_t));
+    md->ends_dirty = 0;
+}
+
+/* empties the free queue and fills it again with every free block in the fat */
+static void rebuild_queue(meta_data *md) {
+    md->queue.front = -1;
+    md->queue.rear = -1;
+    md->free_count = 0;
+    memset(md->free_bits, 0, (md->sb.total_blocks / 64 + 1) * sizeof(u_int64_t));
+    for (block b = 0; b < md->sb.total_blocks; b++) {
+        if (md->fat[b] == FREE_BLOCK) enQueue(md, b);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * directories, checked from the root down
+ * ------------------------------------------------------------------------- */
+
+/* turns a named entry back into a file only known by its number, so whatever
+ * is in it can still be read */
+static void unname(meta_data *md, filename fn) {
+    md->dir[fn].flags = 0;
+    md->dir[fn].parent = NO_FILE;
+    mark_dirty(&md->dir_dirty, fn);
+}
+
+/* checks a directory entry holds a readable directory */
+static u_int8_t good_dir(fsck_state *st, filename fn, u_int8_t repair) {
+    meta_data *md = st->md;
+    chain_check *c = &st->chains[fn];
+    dir_header hdr;
+
+    if (!(md->dir[fn].flags & DE_NAMED) || !(md->dir[fn].flags & DE_DIR)) return 0;
+
+    /* a broken chain is only safe to follow once it has been cut */
+    if (!repair && (c->end != CHAIN_OK || c->too_long || md->dir[fn].length > (u_int64_t) c->kept * md->sb.block_size))
+        return 0;
+    return stat_dir(md, fn, &hdr);
+}
+
+/* Checks every name in dir, adding the directories it holds to the stack.
+ * A name is dropped when it points at an entry that is not named, is the
+ * wrong kind, was reached already or is a damaged directory */
+static void check_dir(fsck_state *st, filename dir, u_int8_t *reached, filename *stack, u_int32_t *depth,
+                      fsck_counts *n, u_int8_t repair) {
+    meta_data *md = st->md;
+    dir_header hdr;
+    dir_item item;
+    u_int32_t pos = 0;
+    u_int32_t names = 0;
+    filename fn;
+    const char *why;
+
+    stat_dir(md, dir, &hdr);
+
+    while (read_dir(md, dir, &pos, &item)) {
+        names++;
+        fn = item.file_name;
+
+        why = NULL;
+        if (fn >= md->sb.max_files) why = "entry past the end of the table";
+        else if (!(md->dir[fn].flags & DE_NAMED)) why = "entry without a name";
+        else if (item.is_dir != ((md->dir[fn].flags & DE_DIR) != 0)) why = "wrong kind of entry";
+        else if (reached[fn]) why = "entry reached twice";
+        else if (item.is_dir && !good_dir(st, fn, repair)) why = "damaged directory";
+
+        if (why != NULL) {
+            report(n->names, "Directory %u -> Name %s points at %s -> Entry: %u\n", dir, item.name, why, fn);
+            if (repair && !drop_name(md, dir, pos - 1)) n->left++;
+            continue;
+        }
+
+        reached[fn] = 1;
+        if (md->dir[fn].parent != dir) {
+            report(n->names, "File %u -> Parent is %u not %u\n", fn, md->dir[fn].parent, dir);
+            if (repair) {
+                md->dir[fn].parent = dir;
+                mark_dirty(&md->dir_dirty, fn);
+            }
+        }
+        if (item.is_dir) stack[(*depth)++] = fn;
+    }
+
+    if (hdr.used != names) {
+        report(n->names, "Directory %u -> Header counts %u names, found %u\n", dir, hdr.used, names);
+        if (repair && !rebuild_dir(md, dir)) n->left++;
+    }
+}
+
+/* Walks the tree from the root. Named entries that are not reached end up as
+ * files only known by their number */
+static void check_names(fsck_state *st, fsck_counts *n, u_int8_t repair) {
+    meta_data *md = st->md;
+    u_int8_t *reached = calloc(md->sb.max_files, 1);
+    filename *stack = malloc(md->sb.max_files * sizeof(filename));
+    u_int32_t depth = 0;
+    filename root = md->root;
+
+    if (reached == NULL || stack == NULL) {
+        printf("ERROR Out of memory for directories\n");
+        n->left++;
+        free(reached);
+        free(stack);
+        return;
+    }
+
+    if (root != NO_FILE) {
+        if (!good_dir(st, root, repair)) {
+            report(n->names, "Directory %u -> Root directory damaged\n", root);
+            if (repair) md->root = NO_FILE;
+        } else {
+            reached[root] = 1;
+            stack[depth++] = root;
+        }
+    }
+    while (depth > 0) {
+        depth--;
+        check_dir(st, stack[depth], reached, stack, &depth, n, repair);
+    }
+
+    for (filename fn = 0; fn < md->sb.max_files; fn++) {
+        if (!(md->dir[fn].flags & DE_NAMED) || reached[fn]) continue;
+        report(n->names, "File %u -> Named but not in any directory, kept by number\n", fn);
+        if (repair) unname(md, fn);
+    }
+
+    free(reached);
+    free(stack);
+}
+
+/* ---------------------------------------------------------------------------
+ * main
+ * ------------------------------------------------------------------------- */
+
+static double seconds(void) {
+    return stat_start() / 1e9;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-r] [-f] [-t threads] [-v] image\n"
+                    "  -r  repair the problems found, otherwise the image is only read\n"
+                    "  -f  use positioned reads and writes with the block cache instead of mmap\n"
+                    "  -t  threads checking chains, one per CPU by default\n"
+                    "  -v  keep the log of the file system and print every problem\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    u_int32_t threads = sysconf(_SC_NPROCESSORS_ONLN);
+    u_int8_t file_backend = 0;
+    u_int8_t repair = 0;
+    fsck_counts n;
+    fsck_state st;
+    super_block sb;
+    meta_data *md;
+    block_dev *dev;
+    u_int32_t found;
+    double start;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "rft:vh")) != -1) {
+        switch (opt) {
+            case 'r': repair = 1; break;
+            case 'f': file_backend = 1; break;
+            case 't': threads = strtoul(optarg, NULL, 0); break;
+            case 'v': verbose = 1; break;
+            default: usage(argv[0]); return EXIT_FAILED;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return EXIT_FAILED;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    if (!verbose) set_log_level(LOG_NONE);
+
+    dev = file_backend ? file_dev_open(argv[optind], 0) : mmap_dev_open(argv[optind], 0);
+    if (dev == NULL) {
+        printf("ERROR Cannot open image -> Path: %s\n", argv[optind]);
+        return EXIT_FAILED;
+    }
+
+    /* init_fat formats a device without a file system, that is not wanted here */
+    if (dev->size < sizeof(super_block) || !dev_read(dev, EEPROM_START, &sb, sizeof(super_block)) || sb.magic != FS_MAGIC) {
+        printf("ERROR No file system found -> Path: %s\n", argv[optind]);
+        return EXIT_FAILED;
+    }
+
+    md = calloc(1, sizeof(meta_data));
+    if (md == NULL || !init_fat(md, dev)) {
+        printf("ERROR Cannot mount image -> Path: %s\n", argv[optind]);
+        return EXIT_FAILED;
+    }
+    set_flush_policy(md, 0, 0);
+
+    memset(&n, 0, sizeof(n));
+    memset(&st, 0, sizeof(st));
+    st.md = md;
+    st.owner = malloc((size_t) md->sb.total_blocks * sizeof(u_int32_t));
+    st.seen = calloc(md->sb.total_blocks, 1);
+    st.used = calloc(md->sb.total_blocks, 1);
+    st.chains = calloc(md->sb.max_files, sizeof(chain_check));
+    if (st.owner == NULL || st.seen == NULL || st.used == NULL || st.chains == NULL) {
+        printf("ERROR Out of memory -> Blocks: %u\n", md->sb.total_blocks);
+        return EXIT_FAILED;
+    }
+    memset(st.owner, 0xFF, (size_t) md->sb.total_blocks * sizeof(u_int32_t)); // NO_FILE
+
+    printf("Checking -> Blocks: %u; Files: %u; Threads: %u\n", md->sb.total_blocks, md->sb.max_files, threads);
+
+    if (md->queue_rebuilt) report(n.queue, "Free queue did not match the fat\n");
+
+    start = seconds();
+    run_pass(&st, claim_chain, threads);
+    run_pass(&st, walk_chain, threads);
+    run_pass(&st, mark_chain, threads);
+    printf("Chains checked -> %.1f ms\n", (seconds() - start) * 1e3);
+
+    /* the data is checked as it was found, a repair does not change it */
+    if (md->crcs != NULL) {
+        start = seconds();
+        if (!scrub_fs(md, &n.checksums)) printf("ERROR Reading the blocks failed\n");
+        printf("Blocks checked -> %.1f ms\n", (seconds() - start) * 1e3);
+        n.left += n.checksums;
+
+        /* the bad blocks are reported, the checks after this look at what they hold */
+        set_verify(md, 0);
+    }
+
+    fix_chains(&st, &n, repair);
+    check_blocks(&st, &n, repair);
+    check_names(&st, &n, repair);
+
+    found = n.bad_start + n.cycles + n.cross_links + n.bad_links + n.free_in_chain + n.length + n.lost
+            + n.queued_in_use + n.queue + n.names + n.checksums;
+
+    printf("Bad start blocks -> %u\n", n.bad_start);
+    printf("Cycles           -> %u\n", n.cycles);
+    printf("Cross links      -> %u\n", n.cross_links);
+    printf("Bad links        -> %u\n", n.bad_links);
+    printf("Free in chains   -> %u\n", n.free_in_chain);
+    printf("Wrong lengths    -> %u\n", n.length);
+    printf("Lost blocks      -> %u\n", n.lost);
+    printf("Queued but used  -> %u\n", n.queued_in_use);
+    printf("Free queue       -> %u\n", n.queue);
+    printf("Directory errors -> %u\n", n.names);
+    if (md->crcs != NULL) printf("Checksum errors  -> %u\n", n.checksums);
+
+    if (found > 0 && repair) {
+        /* directory repairs go out with the data, then a whole new checkpoint */
+        rebuild_queue(md);
+        if (!sync_fs(md) || !write_meta(md) || !dev_sync(md->dev)) {
+            printf("ERROR Writing the repairs failed\n");
+            n.left++;
+        }
+    }
+    if (!repair) forget_changes(md);
+    unmount(md);
+
+    free(st.owner);
+    free(st.seen);
+    free(st.used);
+    free(st.chains);
+    free(md);
+
+    if (found == 0) {
+        printf("Clean\n");
+        return EXIT_CLEAN;
+    }
+    if (!repair || n.left > 0) {
+        printf("Problems left -> %u\n", repair ? n.left : found);
+        return EXIT_LEFT;
+    }
+    printf("Repaired -> %u\n", found);
+    return EXIT_REPAIRED;
+}
@@ -0,0 +1,580 @@
+#define FUSE_USE_VERSION 31
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "device.h"
+#include "cache.h"
+#include "log.h"
+#include "stats.h"
+#include "main.h"
+
+/* Mounts an image with FUSE so the files in it can be used by any program.
+ * Requests are served by the threads of libfuse, many at once, each going
+ * straight to the file system which does its own locking.
+ *
+ * The kernel opens a file once for every open by a program but the file
+ * system lets a file have many readers or one writer. So every file that is
+ * open has one handle shared by all the opens of it
+ *
+ *   read only opens     share a handle opened for reading
+ *   any open to write   turns the shared handle into one opened with UPDATE,
+ *                       which reads and writes anywhere without truncating
+ *
+ * and the handle is closed with the last of them. Each request gives its own
+ * offset so the position in the shared handle is never used.
+ *
+ * Reads go to read_at straight into the buffer of libfuse while the shared
+ * handle is held, so the blocks can not be freed under them. Answering from
+ * the image file without a copy would need the blocks kept until the reply
+ * is sent, which libfuse only does after read has returned. Writes come in
+ * as one buffer and go to write_at without another copy.
+ *
+ * Build with main.c compiled as a library, see the README
+ *   gcc -O2 -DMINIFAT_LIB -o minifat-fuse fuse.c main.c device.c aio.c cache.c crc.c lz.c stats.c $(pkg-config --cflags --libs fuse3) -lpthread
+ */
+
+/* the handle every open of one file shares */
+typedef struct mount_file {
+    pthread_rwlock_t lock;          // read to use h, write to open, close or change it
+    file_handle *h;                 // NULL when the file is not open
+    u_int32_t users;                // opens sharing h
+} mount_file;
+
+typedef struct mount_state {
+    char *image;                    // absolute path of the image
+    int file_backend;               // -o file
+    int compress;                   // -o compress
+    int verbose;                    // -o verbose
+    meta_data *md;                  // NULL until init has mounted the image
+    mount_file *files;              // one per directory entry
+    pthread_mutex_t names;          // held while names are made or removed
+    time_t mounted;                 // every time stamp, the image keeps none
+} mount_state;
+
+static mount_state ms = {
+    .names = PTHREAD_MUTEX_INITIALIZER
+};
+
+/* opens the image and mounts it, NULL if it holds no file system */
+static meta_data *mount_image(void) {
+    super_block sb;
+    meta_data *md;
+    block_dev *dev;
+
+    dev = ms.file_backend ? file_dev_open(ms.image, 0) : mmap_dev_open(ms.image, 0);
+    if (dev == NULL) {
+        fprintf(stderr, "ERROR Cannot open image -> Path: %s\n", ms.image);
+        return NULL;
+    }
+
+    /* init_fat formats a device without a file system, that is not wanted here */
+    if (dev->size < sizeof(super_block) || !dev_read(dev, EEPROM_START, &sb, sizeof(super_block)) || sb.magic != FS_MAGIC) {
+        fprintf(stderr, "ERROR No file system found -> Path: %s\n", ms.image);
+        dev_close(dev);
+        return NULL;
+    }
+
+    md = calloc(1, sizeof(meta_data));
+    if (md == NULL || !init_fat(md, dev)) {
+        fprintf(stderr, "ERROR Cannot mount image -> Path: %s\n", ms.image);
+        free(md);
+        return NULL;
+    }
+    return md;
+}
+
+/* ---------------------------------------------------------------------------
+ * shared handles
+ * ------------------------------------------------------------------------- */
+
+/* Adds an open of a file with the open flags given. Returns 0 or a negative
+ * errno */
+static int attach(filename fn, int flags) {
+    mount_file *mf = &ms.files[fn];
+    u_int8_t writable = (flags & O_ACCMODE) != O_RDONLY;
+    u_int8_t trunc = writable && (flags & O_TRUNC);
+    file_handle *h;
+    u_int8_t was = CLOSED_FILE;     // mode of the handle replaced
+
+    pthread_rwlock_wrlock(&mf->lock);
+    h = mf->h;
+
+    /* a handle that only reads can not take a writer, and truncating starts
+     * the file again, both need a new handle. A writer can not be opened
+     * beside the old handle, so it is closed first and opened again the way
+     * it was if the new one can not be had, the opens sharing it keep going */
+    if (h == NULL || (writable && (h->mode == READ || trunc))) {
+        if (h != NULL) {
+            was = h->mode;
+            close_file(ms.md, h);
+        }
+        if (!writable) h = open_for_read(ms.md, fn);
+        else if (trunc) h = open_for_write(ms.md, fn);
+        else h = open_for_update(ms.md, fn);
+
+        if (h == NULL && was != CLOSED_FILE) {
+            mf->h = was == READ ? open_for_read(ms.md, fn) : open_for_update(ms.md, fn);
+            if (mf->h == NULL) log_error("Cannot open file again -> Filename: %u\n", fn);
+        } else {
+            mf->h = h;
+        }
+    }
+    if (h != NULL) mf->users++;
+    pthread_rwlock_unlock(&mf->lock);
+
+    return h != NULL ? 0 : -EBUSY;
+}
+
+/* drops an open of a file, the last one closes the handle */
+static void detach(filename fn) {
+    mount_file *mf = &ms.files[fn];
+
+    pthread_rwlock_wrlock(&mf->lock);
+    if (mf->users > 0 && --mf->users == 0 && mf->h != NULL) {
+        close_file(ms.md, mf->h);
+        mf->h = NULL;
+    }
+    pthread_rwlock_unlock(&mf->lock);
+}
+
+/* a write that failed, most likely for want of space */
+static int write_error(void) {
+    return availableBlocks(ms.md) == 0 ? -ENOSPC : -EIO;
+}
+
+/* Checks a name can be made at path. Returns 0 or a negative errno */
+static int check_new(const char *path) {
+    const char *name = strrchr(path, '/');
+    char parent[PATH_MAX];
+    file_stat st;
+    size_t len;
+
+    if (stat_path(ms.md, path, &st)) return -EEXIST;
+    if (name == NULL || strlen(name + 1) > NAME_LEN) return -ENAMETOOLONG;
+
+    len = name - path;
+    if (len >= sizeof(parent)) return -ENAMETOOLONG;
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+    if (len == 0) return 0;     // the root is made when first used
+    if (!stat_path(ms.md, parent, &st)) return -ENOENT;
+    return st.is_dir ? 0 : -ENOTDIR;
+}
+
+/* ---------------------------------------------------------------------------
+ * operations
+ * ------------------------------------------------------------------------- */
+
+static void *mf_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    (void) conn;
+    cfg->use_ino = 1;
+
+    /* the image is mounted here, after libfuse has gone into the background,
+     * as the threads of the file backend would not live through the fork */
+    ms.md = mount_image();
+    if (ms.md == NULL) return NULL;
+    ms.files = calloc(ms.md->sb.max_files, sizeof(mount_file));
+    if (ms.files == NULL) {
+        unmount(ms.md);
+        free(ms.md);
+        ms.md = NULL;
+        return NULL;
+    }
+    for (u_int32_t i = 0; i < ms.md->sb.max_files; i++) pthread_rwlock_init(&ms.files[i].lock, NULL);
+    return NULL;
+}
+
+static void mf_destroy(void *private_data) {
+    (void) private_data;
+    if (ms.md == NULL) return;
+
+    for (u_int32_t i = 0; i < ms.md->sb.max_files; i++) {
+        if (ms.files[i].h != NULL) close_file(ms.md, ms.files[i].h);
+        pthread_rwlock_destroy(&ms.files[i].lock);
+    }
+    unmount(ms.md);
+    free(ms.files);
+    free(ms.md);
+    ms.md = NULL;
+}
+
+static int mf_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+    file_stat fs;
+
+    (void) fi;
+    if (ms.md == NULL) return -EIO;
+    if (!stat_path(ms.md, path, &fs)) return -ENOENT;
+
+    memset(st, 0, sizeof(*st));
+    st->st_ino = fs.file_name + 1;  // inode 0 means none to some programs
+    st->st_mode = fs.is_dir ? S_IFDIR | 0755 : S_IFREG | 0644;
+    st->st_nlink = fs.is_dir ? 2 : 1;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_size = fs.length;
+    st->st_blksize = ms.md->sb.block_size;
+    st->st_blocks = ((u_int64_t) fs.stored + 511) / 512;
+    st->st_atime = st->st_mtime = st->st_ctime = ms.mounted;
+    return 0;
+}
+
+static int mf_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off,
+                      struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    u_int32_t pos = 0;
+    dir_item item;
+    file_stat fs;
+
+    (void) off;
+    (void) fi;
+    (void) flags;
+    if (ms.md == NULL) return -EIO;
+    if (!stat_path(ms.md, path, &fs)) return -ENOENT;
+    if (!fs.is_dir) return -ENOTDIR;
+
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+    while (read_dir(ms.md, fs.file_name, &pos, &item)) {
+        if (filler(buf, item.name, NULL, 0, 0)) break;
+    }
+    return 0;
+}
+
+static int mf_mkdir(const char *path, mode_t mode) {
+    int err;
+
+    (void) mode;
+    if (ms.md == NULL) return -EIO;
+
+    pthread_mutex_lock(&ms.names);
+    err = check_new(path);
+    if (err == 0 && !make_dir(ms.md, path)) err = write_error();
+    pthread_mutex_unlock(&ms.names);
+    return err;
+}
+
+static int mf_unlink(const char *path) {
+    file_stat fs;
+    u_int32_t users;
+    int err = 0;
+
+    if (ms.md == NULL) return -EIO;
+
+    pthread_mutex_lock(&ms.names);
+    if (!stat_path(ms.md, path, &fs)) {
+        err = -ENOENT;
+    } else if (fs.is_dir) {
+        err = -EISDIR;
+    } else {
+        pthread_rwlock_rdlock(&ms.files[fs.file_name].lock);
+        users = ms.files[fs.file_name].users;
+        pthread_rwlock_unlock(&ms.files[fs.file_name].lock);
+        if (users > 0) err = -EBUSY;    // the file system can not remove an open file
+        else if (!remove_path(ms.md, path)) err = -EIO;
+    }
+    pthread_mutex_unlock(&ms.names);
+    return err;
+}
+
+static int mf_rmdir(const char *path) {
+    dir_header hdr;
+    file_stat fs;
+    int err = 0;
+
+    if (ms.md == NULL) return -EIO;
+
+    pthread_mutex_lock(&ms.names);
+    if (!stat_path(ms.md, path, &fs)) err = -ENOENT;
+    else if (!fs.is_dir) err = -ENOTDIR;
+    else if (strcmp(path, "/") == 0) err = -EBUSY;
+    else if (stat_dir(ms.md, fs.file_name, &hdr) && hdr.used > 0) err = -ENOTEMPTY;
+    else if (!remove_path(ms.md, path)) err = -EIO;
+    pthread_mutex_unlock(&ms.names);
+    return err;
+}
+
+static int mf_open(const char *path, struct fuse_file_info *fi) {
+    file_stat fs;
+    int err;
+
+    if (ms.md == NULL) return -EIO;
+    if (!stat_path(ms.md, path, &fs)) return -ENOENT;
+    if (fs.is_dir) return -EISDIR;
+
+    err = attach(fs.file_name, fi->flags);
+    if (err == 0) fi->fh = fs.file_name;
+    return err;
+}
+
+static int mf_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    file_handle *h;
+    file_stat fs;
+    mount_file *mf;
+    int err;
+
+    (void) mode;
+    if (ms.md == NULL) return -EIO;
+
+    pthread_mutex_lock(&ms.names);
+    if (stat_path(ms.md, path, &fs)) {
+        /* made by someone else in between, opened like open would */
+        if (fs.is_dir) err = -EISDIR;
+        else if (fi->flags & O_EXCL) err = -EEXIST;
+        else err = attach(fs.file_name, fi->flags);
+        if (err == 0) fi->fh = fs.file_name;
+        pthread_mutex_unlock(&ms.names);
+        return err;
+    }
+
+    err = check_new(path);
+    h = err == 0 ? open_path(ms.md, path, UPDATE) : NULL;
+    if (err == 0 && h == NULL) err = write_error();
+    if (h != NULL) {
+        if (ms.compress) set_compressed(ms.md, h, 1);
+        mf = &ms.files[h->file_name];
+        pthread_rwlock_wrlock(&mf->lock);
+        mf->h = h;
+        mf->users = 1;
+        pthread_rwlock_unlock(&mf->lock);
+        fi->fh = h->file_name;
+    }
+    pthread_mutex_unlock(&ms.names);
+    return err;
+}
+
+static int mf_release(const char *path, struct fuse_file_info *fi) {
+    (void) path;
+    if (ms.md == NULL) return -EIO;
+    detach(fi->fh);
+    return 0;
+}
+
+/* changes the length through the shared handle, turned into one that can
+ * write for the time it takes */
+static int mf_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    file_stat fs;
+    filename fn;
+    int err;
+
+    if (ms.md == NULL) return -EIO;
+    if (!stat_path(ms.md, path, &fs)) return -ENOENT;
+    if (fs.is_dir) return -EISDIR;
+    if (size < 0) return -EINVAL;
+    if (size > UINT32_MAX) return -EFBIG;
+    if ((u_int64_t) size == fs.length) return 0;
+
+    fn = fi != NULL ? fi->fh : fs.file_name;
+    err = attach(fn, O_WRONLY);
+    if (err != 0) return err;
+    pthread_rwlock_rdlock(&ms.files[fn].lock);
+    if (!truncate_file(ms.md, ms.files[fn].h, size)) err = write_error();
+    pthread_rwlock_unlock(&ms.files[fn].lock);
+    detach(fn);
+    return err;
+}
+
+/* Reads into the buffer of libfuse. The shared handle is held until the data
+ * is copied out, so attach and mf_truncate wait for it before they can close
+ * the handle or cut the file and let its blocks go */
+static int mf_read(const char *path, char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+    mount_file *mf;
+    int64_t n = -1;
+    int err = 0;
+
+    (void) path;
+    if (ms.md == NULL) return -EIO;
+    mf = &ms.files[fi->fh];
+
+    pthread_rwlock_rdlock(&mf->lock);
+    if (mf->h == NULL) err = -EBADF;
+    else if ((n = read_at(ms.md, mf->h, off, buf, size)) < 0) err = -EIO;
+    pthread_rwlock_unlock(&mf->lock);
+
+    return err != 0 ? err : n;
+}
+
+static int mf_write_buf(const char *path, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *fi) {
+    size_t size = fuse_buf_size(buf);
+    struct fuse_bufvec copy = FUSE_BUFVEC_INIT(size);
+    const void *data;
+    mount_file *mf;
+    int64_t n = -1;
+    int err = 0;
+
+    (void) path;
+    if (ms.md == NULL) return -EIO;
+    mf = &ms.files[fi->fh];
+
+    /* data already in memory is written from where it is, data still in a
+     * pipe is copied out first */
+    if (buf->count == 1 && buf->idx == 0 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+        data = (const char *) buf->buf[0].mem + buf->off;
+    } else {
+        copy.buf[0].mem = malloc(size);
+        if (copy.buf[0].mem == NULL) return -ENOMEM;
+        if (fuse_buf_copy(&copy, buf, 0) != (ssize_t) size) {
+            free(copy.buf[0].mem);
+            return -EIO;
+        }
+        data = copy.buf[0].mem;
+    }
+
+    pthread_rwlock_rdlock(&mf->lock);
+    if (mf->h == NULL) err = -EBADF;
+    else if ((n = write_at(ms.md, mf->h, off, data, size)) < 0) err = write_error();
+    pthread_rwlock_unlock(&mf->lock);
+    free(copy.buf[0].mem);
+
+    return err != 0 ? err : n;
+}
+
+static int mf_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void) path;
+    (void) datasync;
+    (void) fi;
+    if (ms.md == NULL) return -EIO;
+    return sync_fs(ms.md) ? 0 : -EIO;
+}
+
+static int mf_statfs(const char *path, struct statvfs *st) {
+    (void) path;
+    if (ms.md == NULL) return -EIO;
+
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = st->f_frsize = ms.md->sb.block_size;
+    st->f_blocks = ms.md->sb.total_blocks;
+    st->f_bfree = st->f_bavail = availableBlocks(ms.md);
+    st->f_files = ms.md->sb.max_files;
+    st->f_namemax = NAME_LEN;
+    return 0;
+}
+
+/* the image keeps no times, owners or modes, changing them is allowed so
+ * programs like cp -p and touch work */
+static int mf_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
+    (void) path;
+    (void) tv;
+    (void) fi;
+    return 0;
+}
+
+static int mf_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    (void) path;
+    (void) mode;
+    (void) fi;
+    return 0;
+}
+
+static int mf_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
+    (void) path;
+    (void) uid;
+    (void) gid;
+    (void) fi;
+    return 0;
+}
+
+static const struct fuse_operations mount_ops = {
+    .init       = mf_init,
+    .destroy    = mf_destroy,
+    .getattr    = mf_getattr,
+    .readdir    = mf_readdir,
+    .mkdir      = mf_mkdir,
+    .unlink     = mf_unlink,
+    .rmdir      = mf_rmdir,
+    .open       = mf_open,
+    .create     = mf_create,
+    .release    = mf_release,
+    .truncate   = mf_truncate,
+    .read       = mf_read,
+    .write_buf  = mf_write_buf,
+    .fsync      = mf_fsync,
+    .statfs     = mf_statfs,
+    .utimens    = mf_utimens,
+    .chmod      = mf_chmod,
+    .chown      = mf_chown,
+};
+
+/* ---------------------------------------------------------------------------
+ * main
+ * ------------------------------------------------------------------------- */
+
+enum {
+    KEY_HELP
+};
+
+static const struct fuse_opt mount_opts[] = {
+    { "file", offsetof(mount_state, file_backend), 1 },
+    { "compress", offsetof(mount_state, compress), 1 },
+    { "verbose", offsetof(mount_state, verbose), 1 },
+    FUSE_OPT_KEY("-h", KEY_HELP),
+    FUSE_OPT_KEY("--help", KEY_HELP),
+    FUSE_OPT_END
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s image mountpoint [options]\n"
+                    "  -o file      use positioned reads and writes with the block cache instead of mmap\n"
+                    "  -o compress  compress the files made through the mount\n"
+                    "  -o verbose   keep the log of the file system\n"
+                    "  -f           stay in the foreground, -s to serve one request at a time\n"
+                    "and the options of libfuse\n", prog);
+}
+
+/* takes the image as the first argument that is not an option, the rest go
+ * to libfuse */
+static int mount_arg(void *data, const char *arg, int key, struct fuse_args *outargs) {
+    (void) data;
+    if (key == KEY_HELP) {
+        usage(outargs->argv[0]);
+        return 1;
+    }
+    if (key == FUSE_OPT_KEY_NONOPT && ms.image == NULL) {
+        /* libfuse goes to / when it goes into the background */
+        ms.image = realpath(arg, NULL);
+        if (ms.image == NULL) {
+            fprintf(stderr, "ERROR Cannot open image -> Path: %s\n", arg);
+            return -1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    meta_data *md;
+    int ret;
+
+    if (fuse_opt_parse(&args, &ms, mount_opts, mount_arg) != 0) return 1;
+    if (ms.image == NULL) {
+        usage(argv[0]);
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    if (!ms.verbose) set_log_level(LOG_NONE);
+
+    /* mounted once here so a bad image is reported before going into the
+     * background, init mounts it again for good */
+    md = mount_image();
+    if (md == NULL) {
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    unmount(md);
+    free(md);
+
+    ms.mounted = time(NULL);
+    ret = fuse_main(args.argc, args.argv, &mount_ops, NULL);
+    fuse_opt_free_args(&args);
+    free(ms.image);
+    return ret;
+}
@@ -0,0 +1,49 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+
+/* Leveled logging. Messages above LOG_LEVEL are compiled out, so in a release
+ * build (NDEBUG) the info and debug messages cost nothing, not even the test
+ * of the level. Below that log_level picks what is printed while running.
+ *
+ *   log_error   something failed, the operation returns 0
+ *   log_warn    something unexpected that the file system copes with
+ *   log_info    what the file system is doing, formats, mounts, deletes
+ *   log_debug   per block detail on the hot path
+ *
+ * Messages go to stdout like the rest of the output of the file system.
+ * Errors are prefixed with "ERROR " and warnings with "WARNING ".
+ */
+
+#define LOG_NONE        0
+#define LOG_ERROR       1
+#define LOG_WARN        2
+#define LOG_INFO        3
+#define LOG_DEBUG       4
+
+#ifndef LOG_LEVEL
+#ifdef NDEBUG
+#define LOG_LEVEL       LOG_WARN    // release builds keep errors and warnings
+#else
+#define LOG_LEVEL       LOG_DEBUG
+#endif
+#endif
+
+/* messages above this level are not printed, LOG_LEVEL to begin with. Kept
+ * in stats.c with the rest of the instrumentation */
+extern int log_level;
+
+void set_log_level(int level);
+
+#define log_at(level, ...) \
+    do { \
+        if ((level) <= LOG_LEVEL && (level) <= log_level) printf(__VA_ARGS__); \
+    } while (0)
+
+#define log_error(fmt, ...) log_at(LOG_ERROR, "ERROR " fmt, ##__VA_ARGS__)
+#define log_warn(fmt, ...)  log_at(LOG_WARN, "WARNING " fmt, ##__VA_ARGS__)
+#define log_info(...)       log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...)      log_at(LOG_DEBUG, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,157 @@
+#include <string.h>
+#include "lz.h"
+
+#define HASH_BITS       12          // entries in the table of places seen
+#define SKIP_SHIFT      6           // steps grow by one every 64 bytes without a match
+
+static u_int32_t load32(const u_int8_t *p) {
+    u_int32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static u_int64_t load64(const u_int8_t *p) {
+    u_int64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static u_int32_t hash4(u_int32_t v) {
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* writes the rest of a count that did not fit in its half of the token */
+static u_int8_t put_count(u_int8_t **op, u_int8_t *end, u_int32_t n) {
+    for (; n >= 255; n -= 255) {
+        if (*op >= end) return 0;
+        *(*op)++ = 255;
+    }
+    if (*op >= end) return 0;
+    *(*op)++ = n;
+    return 1;
+}
+
+/* Writes one sequence. A match length of 0 ends the output with literals only */
+static u_int8_t put_seq(u_int8_t **op, u_int8_t *end, const u_int8_t *lit, u_int32_t nlit, u_int32_t offset, u_int32_t mlen) {
+    u_int8_t *token = *op;
+    u_int32_t m = mlen ? mlen - LZ_MIN_MATCH : 0;
+
+    if (*op >= end) return 0;
+    (*op)++;
+    *token = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+    if (nlit >= 15 && !put_count(op, end, nlit - 15)) return 0;
+
+    if ((u_int64_t) (end - *op) < nlit) return 0;
+    memcpy(*op, lit, nlit);
+    *op += nlit;
+    if (mlen == 0) return 1;
+
+    if (end - *op < 2) return 0;
+    *(*op)++ = offset & 0xFF;
+    *(*op)++ = offset >> 8;
+    if (m >= 15 && !put_count(op, end, m - 15)) return 0;
+    return 1;
+}
+
+u_int32_t lz_compress(const u_int8_t *src, u_int32_t len, u_int8_t *dst, u_int32_t cap) {
+    u_int16_t seen[1 << HASH_BITS];
+    u_int8_t *op = dst;
+    u_int8_t *end = dst + cap;
+    u_int32_t ip = 0, anchor = 0, ref, mlen, h;
+    u_int32_t v;
+    u_int64_t diff;
+
+    if (len > LZ_MAX_INPUT) return 0;
+    memset(seen, 0, sizeof(seen));
+
+    /* a match needs four bytes to compare, the last ones are literals */
+    while (len >= LZ_MIN_MATCH && ip <= len - LZ_MIN_MATCH) {
+        v = load32(src + ip);
+        h = hash4(v);
+        ref = seen[h];
+        seen[h] = ip;
+
+        if (ref >= ip || load32(src + ref) != v) {
+            ip += 1 + ((ip - anchor) >> SKIP_SHIFT);
+            continue;
+        }
+
+        /* runs the match forwards as far as it goes, eight bytes at a time
+         * while there are eight left, and back over literals */
+        mlen = LZ_MIN_MATCH;
+        while (ip + mlen + 8 <= len && (diff = load64(src + ref + mlen) ^ load64(src + ip + mlen)) == 0) mlen += 8;
+        if (ip + mlen + 8 <= len) mlen += __builtin_ctzll(diff) >> 3;  // little endian, the first byte that differs
+        else while (ip + mlen < len && src[ref + mlen] == src[ip + mlen]) mlen++;
+        while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+            ip--;
+            ref--;
+            mlen++;
+        }
+
+        if (!put_seq(&op, end, src + anchor, ip - anchor, ip - ref, mlen)) return 0;
+        ip += mlen;
+        anchor = ip;
+        if (ip + 2 <= len) seen[hash4(load32(src + ip - 2))] = ip - 2;   // so a run finds itself
+    }
+
+    if (!put_seq(&op, end, src + anchor, len - anchor, 0, 0)) return 0;
+    return op - dst;
+}
+
+/* reads the rest of a count, returns 0 if the input ends first */
+static u_int8_t get_count(const u_int8_t **ip, const u_int8_t *end, u_int32_t *n) {
+    u_int8_t b;
+
+    do {
+        if (*ip >= end) return 0;
+        b = *(*ip)++;
+        *n += b;
+        if (*n > LZ_MAX_INPUT) return 0;
+    } while (b == 255);
+    return 1;
+}
+
+u_int8_t lz_decompress(const u_int8_t *src, u_int32_t packed, u_int8_t *dst, u_int32_t len) {
+    const u_int8_t *ip = src;
+    const u_int8_t *end = src + packed;
+    u_int32_t op = 0;
+    u_int32_t nlit, mlen, offset;
+    u_int8_t token;
+
+    while (ip < end) {
+        token = *ip++;
+
+        /* short runs are copied sixteen bytes at once when both buffers have
+         * room for it, the bytes past the run are written over later */
+        nlit = token >> 4;
+        if (nlit == 15 && !get_count(&ip, end, &nlit)) return 0;
+        if ((u_int64_t) (end - ip) < nlit || len - op < nlit) return 0;
+        if (end - ip >= 16 && len - op >= 16) memcpy(dst + op, ip, 16);
+        if (nlit > 16 || end - ip < 16 || len - op < 16) memcpy(dst + op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == end) break; // the last sequence has no match
+
+        if (end - ip < 2) return 0;
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        mlen = token & 15;
+        if (mlen == 15 && !get_count(&ip, end, &mlen)) return 0;
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || len - op < mlen) return 0;
+
+        /* A match may run into the bytes it is making, so those go one at a
+         * time. Otherwise eight bytes at a time when there is room to go past */
+        if (offset >= 8 && len - op >= mlen + 8) {
+            for (u_int32_t i = 0; i < mlen; i += 8) memcpy(dst + op + i, dst + op - offset + i, 8);
+        } else if (offset >= mlen) {
+            memcpy(dst + op, dst + op - offset, mlen);
+        } else {
+            for (u_int32_t i = 0; i < mlen; i++) dst[op + i] = dst[op - offset + i];
+        }
+        op += mlen;
+    }
+    return op == len;
+}
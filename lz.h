@@ -0,0 +1,34 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <sys/types.h>
+
+/* A small LZ77 codec in the style of LZ4, used for compressed files. It is
+ * built for speed rather than ratio, a single pass over the input with a hash
+ * table of the last place each four bytes were seen.
+ *
+ * The output is a run of sequences, each a token, literals and a match
+ *
+ *   token      high four bits literal count, low four bits match length - 4,
+ *              15 in either means more bytes of the count follow, each adding
+ *              up to 255, until one below 255
+ *   literals   copied as they are
+ *   match      two bytes of offset back into the output, little endian, then
+ *              the rest of the match length
+ *
+ * The last sequence is literals only and ends the input. Inputs are at most
+ * LZ_MAX_INPUT bytes so an offset always fits in two bytes.
+ */
+
+#define LZ_MAX_INPUT    0xFFFF      // largest input, offsets are 16 bits
+#define LZ_MIN_MATCH    4           // shortest match worth a sequence
+
+/* Compresses len bytes of src into dst, which has room for cap bytes.
+ * Returns the bytes written, 0 if they do not fit or len is too large */
+u_int32_t lz_compress(const u_int8_t *src, u_int32_t len, u_int8_t *dst, u_int32_t cap);
+
+/* Decompresses packed bytes of src into exactly len bytes at dst. Never reads
+ * or writes outside the buffers, returns 0 if src is damaged */
+u_int8_t lz_decompress(const u_int8_t *src, u_int32_t packed, u_int8_t *dst, u_int32_t len);
+
+#endif
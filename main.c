@@ -1,537 +1,3714 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "device.h"
+#include "cache.h"
+#include "crc.h"
+#include "lz.h"
+#include "log.h"
+#include "stats.h"
 #include "main.h"
 
 
 meta_data meta;
 
-void init_fat(meta_data *md, FILE *f) {
+/* The following are used functions used to create a circular
+ * queue. This was done to add some level of wear leveling to
+ * the device. the idea hear is that the first blocks of memory
+ * freed for use are to be the last blocks used in storage.
+ *
+ * This only levels the wear on the data blocks. The meta data
+ * is spread over the ring of slots and the journal, see the
+ * layout in main.h.
+*/
+
+/* Checks to see if the queue is empty. An empty queue implies all free blocks are in use */
+int8_t isEmpty(meta_data *md) {
+    if (md->queue.front == -1) return -1;
+    return 0;
+}
+
+/* Checks to see if the queue is full. A full queue implies all blocks are free */
+int8_t isFull(meta_data *md) {
+    if ((md->queue.front == md->queue.rear + 1) || (md->queue.front == 0 && md->queue.rear == (int32_t) md->sb.total_blocks - 1)) {
+        return 1;
+    }
+    return 0;
+}
+
+/* Adds a block to the rear of the queue, this helps for wear levelling */
+void enQueue(meta_data *md, block blk) {
+
+    if (isFull(md)) {
+        log_warn("Cannot free more blocks as all blocks are free\n");
+    } else {
+        if (md->queue.front == -1) md->queue.front = 0;
+
+        md->queue.rear = (md->queue.rear + 1);                      // two lines work as mod as mod can have
+        if (md->queue.rear == (int32_t) md->sb.total_blocks) {
+            md->queue.rear = 0;     // irregular behavior in c
+        }
+
+        md->queue.q[md->queue.rear] = blk;
+        mark_dirty(&md->queue_dirty, md->queue.rear);
+        md->ends_dirty = 1;
+        mark_free(md, blk);
+    }
+}
+
+/* Takes a block from the front of the queue */
+block deQueue(meta_data *md) {
+    block blk;
+
+    if (isEmpty(md)) {
+        log_warn("No free blocks available\n");
+        return END_BLOCK;
+    } else {
+        blk = md->queue.q[md->queue.front];
+        if (md->queue.front == md->queue.rear) {
+            md->queue.front = -1;
+            md->queue.rear = -1;
+        } else {
+            md->queue.front = (md->queue.front + 1);                    // two lines work as mod as mod can have
+            if (md->queue.front >= (int32_t) md->sb.total_blocks) md->queue.front = 0;   // irregular behavior in c
+        }
+        md->ends_dirty = 1;
+        mark_used(md, blk);
+        return blk;
+    }
+}
+
+/* Returns the remaining available blocks. This used to be worked out from the
+ * front and rear pointers which gave the wrong answer for an empty queue and a
+ * queue holding one block, the bitmap keeps a running count instead */
+int64_t availableBlocks(meta_data *md) {
+    return (int64_t) __atomic_load_n(&md->free_count, __ATOMIC_RELAXED) + __atomic_load_n(&md->reclaim_blocks, __ATOMIC_RELAXED);
+}
+
+/* Displays if the queue is empty or the position of the first and last block currently in the queue */
+void display(meta_data *md) {
+    if (isEmpty(md)) printf("All blocks in use\n");
+    else {
+        printf("Next available block -> %d\n", md->queue.front);
+        printf("Last available block -> %d\n", md->queue.rear);
+        printf("Free blocks          -> %u\n", md->free_count);
+    }
+}
+
+/* Writes meta data to the slot being checkpointed, keeping a running checksum
+ * of it. A checkpoint gathers its writes into one batch. While a flush is
+ * running the write is added to the journal
+ * transaction instead. If the transaction outgrows the journal it is marked
+ * as over and the flush writes a checkpoint instead */
+static u_int8_t meta_write(meta_data *md, u_int64_t off, const void *buf, u_int32_t len) {
+    journal_record rec;
+    u_int8_t *end;
+
+    if (!md->logging) {
+        md->ckpt_crc = crc32c(md->ckpt_crc, buf, len);
+        if (md->ckpt_batch != NULL) return dev_batch_copy(md->ckpt_batch, md->ckpt_base + off, buf, len);
+        return dev_write(md->dev, md->ckpt_base + off, buf, len);
+    }
+
+    if (md->journal_over) return 1;
+    if (sizeof(journal_header) + md->journal_len + sizeof(journal_record) + (u_int64_t) len > md->sb.journal_size) {
+        md->journal_over = 1;
+        return 1;
+    }
+
+    rec.off = off;
+    rec.len = len;
+    rec.pad = 0;
+    end = md->journal + sizeof(journal_header) + md->journal_len;
+    memcpy(end, &rec, sizeof(journal_record));
+    memcpy(end + sizeof(journal_record), buf, len);
+    md->journal_len += sizeof(journal_record) + len;
+    return 1;
+}
+
+/* Writes count entries of a block table to the device starting at entry first.
+ * Entries are narrowed to the index size of the device on the way out */
+static u_int8_t store_table(meta_data *md, u_int64_t off, block *tbl, u_int32_t first, u_int32_t count) {
+    u_int16_t narrow[512];
+    u_int32_t n;
+
+    if (md->sb.index_size == sizeof(block))
+        return meta_write(md, off + (u_int64_t) first * sizeof(block), &tbl[first], count * sizeof(block));
+
+    off += (u_int64_t) first * sizeof(u_int16_t);
+    while (count > 0) {
+        n = count < 512 ? count : 512;
+        for (u_int32_t i = 0; i < n; i++) narrow[i] = (u_int16_t) tbl[first + i]; // FREE/END keep their low bits
+        if (!meta_write(md, off, narrow, n * sizeof(u_int16_t))) return 0;
+        off += n * sizeof(u_int16_t);
+        first += n;
+        count -= n;
+    }
+    return 1;
+}
+
+/* Reads a block table out of a slot image widening entries to 32 bits */
+static void load_table(meta_data *md, const u_int8_t *src, block *tbl, u_int32_t count) {
+    u_int16_t narrow;
+
+    if (md->sb.index_size == sizeof(block)) {
+        memcpy(tbl, src, (size_t) count * sizeof(block));
+        return;
+    }
+
+    for (u_int32_t i = 0; i < count; i++) {
+        memcpy(&narrow, src + (size_t) i * sizeof(u_int16_t), sizeof(u_int16_t));
+        if (narrow == (u_int16_t) FREE_BLOCK) tbl[i] = FREE_BLOCK;
+        else if (narrow == (u_int16_t) END_BLOCK) tbl[i] = END_BLOCK;
+        else tbl[i] = narrow;
+    }
+}
+
+/* Writes count block checksums starting at block first. They are copied out
+ * a piece at a time since writers change them without the allocator lock */
+static u_int8_t store_crcs(meta_data *md, u_int32_t first, u_int32_t count) {
+    u_int32_t snap[512];
+    u_int32_t n;
+
+    while (count > 0) {
+        n = count < 512 ? count : 512;
+        for (u_int32_t i = 0; i < n; i++) snap[i] = __atomic_load_n(&md->crcs[first + i], __ATOMIC_RELAXED);
+        if (!meta_write(md, md->sb.crc_start + (u_int64_t) first * sizeof(u_int32_t), snap, n * sizeof(u_int32_t))) return 0;
+        first += n;
+        count -= n;
+    }
+    return 1;
+}
+
+/* Copies every record of a journal transaction into an image of a slot.
+ * Returns 0 if a record does not fit in the slot */
+static u_int8_t journal_apply(meta_data *md, u_int8_t *image, const u_int8_t *body, u_int32_t len) {
+    journal_record rec;
+    u_int32_t pos = 0;
+
+    while (pos + sizeof(journal_record) <= len) {
+        memcpy(&rec, body + pos, sizeof(journal_record));
+        pos += sizeof(journal_record);
+        if (rec.len > len - pos || rec.off > md->sb.slot_size || rec.len > md->sb.slot_size - rec.off) return 0;
+        memcpy(image + rec.off, body + pos, rec.len);
+        pos += rec.len;
+    }
+    return 1;
+}
+
+/* Writes the whole of the meta data to the next slot in the ring. The tables
+ * are submitted together as one batch. The slot header goes last and holds a
+ * checksum of the rest, so a slot cut short by a crash is passed over at mount
+ * and the one before it used. The journal starts again from the beginning
+ * afterwards */
+static u_int8_t checkpoint(meta_data *md) {
+    slot_header hdr;
+    dev_batch batch;
+    dir_entry *snap;
+    int32_t ends[2];
+    u_int32_t slot;
+    u_int8_t ok;
+
+    slot = (md->cur_slot + 1) % md->sb.meta_slots;
+    md->ckpt_base = md->sb.slot_start + (u_int64_t) slot * md->sb.slot_size;
+    md->ckpt_crc = 0;
+
+    /* the tables are written in the order they sit in the slot so the
+     * checksum can be worked out as they go */
+    snap = malloc(md->sb.max_files * sizeof(dir_entry));
+    if (snap == NULL) return 0;
+    dev_batch_init(&batch);
+    md->ckpt_batch = &batch;
+    for (filename fn = 0; fn < md->sb.max_files; fn++) {
+        pthread_rwlock_rdlock(&md->locks[fn]);
+        snap[fn] = md->dir[fn];
+        pthread_rwlock_unlock(&md->locks[fn]);
+    }
+    ok = meta_write(md, md->sb.dir_start, snap, md->sb.max_files * sizeof(dir_entry));
+    free(snap);
+
+    pthread_mutex_lock(&md->alloc_lock);
+    ends[0] = md->queue.front;
+    ends[1] = md->queue.rear;
+    ok = ok && store_table(md, md->sb.fat_start, md->fat, 0, md->sb.total_blocks)
+            && meta_write(md, md->sb.queue_start, ends, sizeof(ends))
+            && store_table(md, md->sb.queue_start + sizeof(ends), md->queue.q, 0, md->sb.total_blocks);
+    pthread_mutex_unlock(&md->alloc_lock);
+    if (md->crcs != NULL) ok = ok && store_crcs(md, 0, md->sb.total_blocks);
+
+    /* the header must not reach the device before the tables it vouches for */
+    md->ckpt_batch = NULL;
+    ok = dev_batch_run(md->dev, &batch) && ok;
+    dev_batch_free(&batch);
+    if (!ok) return 0;
+
+    hdr.magic = SLOT_MAGIC;
+    hdr.seq = md->meta_seq + 1;
+    hdr.crc = md->ckpt_crc;
+    hdr.pad = 0;
+    if (!dev_write(md->dev, md->ckpt_base, &hdr, sizeof(slot_header)) || !dev_sync(md->dev)) return 0;
+
+    md->meta_seq = hdr.seq;
+    md->cur_slot = slot;
+    md->journal_head = 0;
+    stat_add(&md->stats.checkpoints, 1);
+    return 1;
+}
+
+/* Commits the transaction built up by meta_write by adding it to the end of
+ * the journal in one write. A torn write fails its checksum so a crash leaves
+ * either the old meta data or the whole transaction. When it does not fit in
+ * what is left of the journal a checkpoint is written instead */
+static u_int8_t journal_commit(meta_data *md) {
+    journal_header *hdr = (journal_header *) md->journal;
+    u_int32_t size;
+
+    if (md->journal_len == 0 && !md->journal_over) return 1;
+
+    size = sizeof(journal_header) + md->journal_len;
+    md->journal_len = 0;
+    if (md->journal_over || md->journal_head + size > md->sb.journal_size) {
+        md->journal_over = 0;
+        return checkpoint(md);
+    }
+
+    hdr->magic = JOURNAL_MAGIC;
+    hdr->seq = md->meta_seq + 1;
+    hdr->len = size - sizeof(journal_header);
+    hdr->crc = 0;
+    hdr->crc = crc32c(0, md->journal, size);
+
+    if (!dev_write(md->dev, md->sb.journal_start + md->journal_head, md->journal, size)) return 0;
+    if (!dev_sync(md->dev)) return 0;
+
+    md->meta_seq = hdr->seq;
+    md->journal_head += size;
+    stat_add(&md->stats.journal_commits, 1);
+    return 1;
+}
+
+/* Reads slot into image if its checksum is good */
+static u_int8_t read_slot(meta_data *md, u_int32_t slot, const slot_header *hdr, u_int8_t *image) {
+    u_int64_t base = md->sb.slot_start + (u_int64_t) slot * md->sb.slot_size;
+    u_int64_t len = md->sb.slot_size - sizeof(slot_header);
+
+    if (!dev_read(md->dev, base + sizeof(slot_header), image + sizeof(slot_header), len)) return 0;
+    return crc32c(0, image + sizeof(slot_header), len) == hdr->crc;
+}
+
+/* Loads the meta data at mount. Only the slot headers are scanned to find the
+ * newest slot, falling back to an older one if its checksum is bad. The
+ * transactions in the journal that follow it are then replayed in order, so
+ * the work done is bounded by the size of the journal */
+static u_int8_t load_meta(meta_data *md) {
+    journal_header *jh = (journal_header *) md->journal;
+    slot_header hdr, best;
+    u_int32_t limit = 0xFFFFFFFF;
+    u_int32_t found, replayed = 0;
+    u_int8_t *image;
+    int32_t ends[2];
+    u_int32_t crc;
+
+    image = malloc(md->sb.slot_size);
+    if (image == NULL) return 0;
+    memset(&best, 0, sizeof(slot_header));
+
+    for (;;) {
+        found = md->sb.meta_slots;
+        for (u_int32_t slot = 0; slot < md->sb.meta_slots; slot++) {
+            if (!dev_read(md->dev, md->sb.slot_start + (u_int64_t) slot * md->sb.slot_size, &hdr, sizeof(slot_header))) continue;
+            if (hdr.magic != SLOT_MAGIC || hdr.seq >= limit) continue;
+            if (found == md->sb.meta_slots || hdr.seq > best.seq) {
+                best = hdr;
+                found = slot;
+            }
+        }
+
+        if (found == md->sb.meta_slots) {
+            free(image);
+            return 0;
+        }
+        if (read_slot(md, found, &best, image)) break;
+
+        log_warn("Meta data slot damaged -> Slot: %u; Seq: %u\n", found, best.seq);
+        limit = best.seq;
+    }
+
+    md->cur_slot = found;
+    md->meta_seq = best.seq;
+    md->journal_head = 0;
+
+    /* replays transactions until one is missing, torn or from before the slot */
+    while (md->journal_head + sizeof(journal_header) <= md->sb.journal_size) {
+        if (!dev_read(md->dev, md->sb.journal_start + md->journal_head, jh, sizeof(journal_header))) break;
+        if (jh->magic != JOURNAL_MAGIC || jh->seq != md->meta_seq + 1) break;
+        if (jh->len > md->sb.journal_size - md->journal_head - sizeof(journal_header)) break;
+        if (!dev_read(md->dev, md->sb.journal_start + md->journal_head + sizeof(journal_header), md->journal + sizeof(journal_header), jh->len)) break;
+
+        crc = jh->crc;
+        jh->crc = 0;
+        if (crc32c(0, md->journal, sizeof(journal_header) + jh->len) != crc) break;
+        if (!journal_apply(md, image, md->journal + sizeof(journal_header), jh->len)) break;
+
+        md->meta_seq = jh->seq;
+        md->journal_head += sizeof(journal_header) + jh->len;
+        replayed++;
+    }
+    if (replayed) log_info("Replayed journal -> Transactions: %u; Seq: %u\n", replayed, md->meta_seq);
+
+    memcpy(md->dir, image + md->sb.dir_start, md->sb.max_files * sizeof(dir_entry));
+    load_table(md, image + md->sb.fat_start, md->fat, md->sb.total_blocks);
+    memcpy(ends, image + md->sb.queue_start, sizeof(ends));
+    load_table(md, image + md->sb.queue_start + sizeof(ends), md->queue.q, md->sb.total_blocks);
+    md->queue.front = ends[0];
+    md->queue.rear = ends[1];
+    if (md->crcs != NULL) memcpy(md->crcs, image + md->sb.crc_start, (size_t) md->sb.total_blocks * sizeof(u_int32_t));
+
+    free(image);
+    return 1;
+}
+
+/* steps a position on to the next slot of the circular queue */
+static int32_t queue_next(meta_data *md, int32_t pos) {
+    pos++;
+    if (pos == (int32_t) md->sb.total_blocks) pos = 0;
+    return pos;
+}
+
+/* sets up a dirty map covering entries table entries */
+static u_int8_t dirty_init(dirty_map *dm, u_int32_t entries, u_int8_t shift) {
+    dm->shift = shift;
+    dm->chunks = (entries >> shift) + 1;
+    dm->bits = calloc((dm->chunks + 63) / 64, sizeof(u_int64_t));
+    return dm->bits != NULL;
+}
+
+static void dirty_clear(dirty_map *dm) {
+    memset(dm->bits, 0, (dm->chunks + 63) / 64 * sizeof(u_int64_t));
+}
+
+/* Finds the next run of dirty chunks at or after *pos and clears it. The run is
+ * returned in entries, clamped to the size of the table. Returns 0 when there
+ * are no dirty chunks left */
+static u_int8_t next_dirty_run(dirty_map *dm, u_int32_t *pos, u_int32_t limit, u_int32_t *first, u_int32_t *count) {
+    u_int32_t c = *pos, end;
+    u_int64_t word;
+
+    /* skips clean words using the lowest set bit of the first non zero word */
+    while (c < dm->chunks) {
+        word = __atomic_load_n(&dm->bits[c / 64], __ATOMIC_RELAXED) >> (c % 64);
+        if (word) {
+            c += __builtin_ctzll(word);
+            break;
+        }
+        c = (c / 64 + 1) * 64;
+    }
+    if (c >= dm->chunks) return 0;
+
+    /* extends the run over neighbouring dirty chunks */
+    for (end = c; end < dm->chunks && (__atomic_load_n(&dm->bits[end / 64], __ATOMIC_RELAXED) >> (end % 64) & 1); end++)
+        __atomic_fetch_and(&dm->bits[end / 64], ~(1ULL << (end % 64)), __ATOMIC_ACQ_REL);
+    *pos = end;
+
+    *first = c << dm->shift;
+    if (*first >= limit) return 0;
+    *count = (end << dm->shift) - *first;
+    if (*first + *count > limit) *count = limit - *first;
+    return 1;
+}
+
+static void free_tables(meta_data *md) {
+    if (md->cache != NULL) {
+        cache_close(md->cache);
+        md->cache = NULL;
+    }
+    if (md->locks != NULL) {
+        for (filename fn = 0; fn < md->sb.max_files; fn++) pthread_rwlock_destroy(&md->locks[fn]);
+        pthread_mutex_destroy(&md->alloc_lock);
+        pthread_mutex_destroy(&md->open_lock);
+        pthread_mutex_destroy(&md->meta_lock);
+        pthread_mutex_destroy(&md->name_lock);
+        free(md->locks);
+        md->locks = NULL;
+    }
+    if (md->extents != NULL) {
+        for (filename fn = 0; fn < md->sb.max_files; fn++) {
+            free(md->extents[fn].ext);
+            free(md->extents[fn].index);
+        }
+    }
+    if (md->frames != NULL) {
+        for (filename fn = 0; fn < md->sb.max_files; fn++) free(md->frames[fn].pos);
+    }
+    free(md->extents);
+    free(md->frames);
+    free(md->opens);
+    free(md->journal);
+    md->journal = NULL;
+    free(md->free_bits);
+    md->extents = NULL;
+    md->frames = NULL;
+    md->opens = NULL;
+    md->free_bits = NULL;
+    free(md->dir);
+    free(md->fat);
+    free(md->queue.q);
+    free(md->dir_dirty.bits);
+    free(md->fat_dirty.bits);
+    free(md->queue_dirty.bits);
+    free(md->crcs);
+    free(md->crc_dirty.bits);
+    md->crcs = NULL;
+    md->crc_dirty.bits = NULL;
+    md->dir = NULL;
+    md->fat = NULL;
+    md->queue.q = NULL;
+    md->dir_dirty.bits = NULL;
+    md->fat_dirty.bits = NULL;
+    md->queue_dirty.bits = NULL;
+    free(md->reclaim);
+    md->reclaim = NULL;
+    md->reclaim_count = 0;
+    md->reclaim_cap = 0;
+    md->reclaim_blocks = 0;
+}
+
+/* Gives back what alloc_tables got before it failed. The locks are not set up
+ * yet so free_tables must not destroy them */
+static void alloc_failed(meta_data *md) {
+    free(md->locks);
+    md->locks = NULL;
+    free_tables(md);
+}
+
+/* allocates the in memory tables from the geometry in the super block */
+static u_int8_t alloc_tables(meta_data *md) {
+    md->dir = calloc(md->sb.max_files, sizeof(dir_entry));
+    md->fat = malloc((size_t) md->sb.total_blocks * sizeof(block));
+    md->queue.q = malloc((size_t) md->sb.total_blocks * sizeof(block));
+    md->extents = calloc(md->sb.max_files, sizeof(extent_map));
+    md->frames = calloc(md->sb.max_files, sizeof(frame_map));
+    md->opens = calloc(md->sb.max_files, sizeof(open_file));
+    md->free_bits = calloc(md->sb.total_blocks / 64 + 1, sizeof(u_int64_t));
+    md->free_count = 0;
+    md->locks = malloc(md->sb.max_files * sizeof(pthread_rwlock_t));
+    md->journal = malloc(md->sb.journal_size);
+    md->journal_len = 0;
+    md->crcs = NULL;
+    md->dir_dirty.bits = NULL;
+    md->fat_dirty.bits = NULL;
+    md->queue_dirty.bits = NULL;
+    md->crc_dirty.bits = NULL;
+    if (md->sb.features & FEAT_CRC) md->crcs = calloc(md->sb.total_blocks + 1, sizeof(u_int32_t));
+    md->verify = md->crcs != NULL;
+
+    md->cache = NULL;
+    md->journal_over = 0;
+    md->logging = 0;
+    md->queue_rebuilt = 0;
+    memset(&md->stats, 0, sizeof(fs_stats));
+
+    /* Set all handles to closed */
+    for (u_int32_t i = 0; i < MAX_HANDLES; i++) {
+        md->handles[i].mode = CLOSED_FILE;
+        md->handles[i].log = NULL;
+    }
+
+    if (md->dir == NULL || md->fat == NULL || md->queue.q == NULL || md->extents == NULL || md->frames == NULL || md->opens == NULL || md->free_bits == NULL || md->locks == NULL || md->journal == NULL
+        || !dirty_init(&md->dir_dirty, md->sb.max_files, 0)
+        || !dirty_init(&md->fat_dirty, md->sb.total_blocks, FAT_CHUNK_SHIFT)
+        || !dirty_init(&md->queue_dirty, md->sb.total_blocks, FAT_CHUNK_SHIFT)
+        || ((md->sb.features & FEAT_CRC) && (md->crcs == NULL || !dirty_init(&md->crc_dirty, md->sb.total_blocks, FAT_CHUNK_SHIFT)))) {
+        log_error("Out of memory for meta data -> Blocks: %u\n", md->sb.total_blocks);
+        alloc_failed(md);
+        return 0;
+    }
+
+    /* a mapped device is already held in memory, anything else gets a cache */
+    if (dev_map(md->dev, 0, 1) == NULL) {
+        md->cache = cache_open(md->dev, md->sb.data_start, md->sb.block_size, CACHE_BLOCKS);
+        if (md->cache == NULL) {
+            alloc_failed(md);
+            return 0;
+        }
+    }
+
+    for (filename fn = 0; fn < md->sb.max_files; fn++) pthread_rwlock_init(&md->locks[fn], NULL);
+    pthread_mutex_init(&md->alloc_lock, NULL);
+    pthread_mutex_init(&md->open_lock, NULL);
+    pthread_mutex_init(&md->meta_lock, NULL);
+    pthread_mutex_init(&md->name_lock, NULL);
+    md->root = NO_FILE;
+    md->next_entry = md->sb.max_files - 1;
+    return 1;
+}
+
+/* writes all of the meta data to the device, used when formatting */
+u_int8_t write_meta(meta_data *md) {
+    u_int8_t zero[sizeof(slot_header)];
+
+    dirty_clear(&md->dir_dirty);
+    dirty_clear(&md->fat_dirty);
+    dirty_clear(&md->queue_dirty);
+    if (md->crcs != NULL) dirty_clear(&md->crc_dirty);
+    md->ends_dirty = 0;
+    md->pending_ops = 0;
+    md->last_flush = time(NULL);
+
+    md->sb.crc = 0;
+    md->sb.crc = crc32c(0, &md->sb, sizeof(super_block));
+    if (!dev_write(md->dev, EEPROM_START, &md->sb, sizeof(super_block))) return 0;
+
+    /* clears anything an earlier format left behind so it can not be mistaken
+     * for a newer slot or a transaction to replay */
+    memset(zero, 0, sizeof(zero));
+    for (u_int32_t slot = 0; slot < md->sb.meta_slots; slot++) {
+        if (!dev_write(md->dev, md->sb.slot_start + (u_int64_t) slot * md->sb.slot_size, zero, sizeof(slot_header))) return 0;
+    }
+    if (!dev_write(md->dev, md->sb.journal_start, zero, sizeof(journal_header))) return 0;
+
+    md->meta_seq = 0;
+    md->cur_slot = md->sb.meta_slots - 1; // so the first checkpoint goes to slot 0
+    md->journal_head = 0;
+    md->logging = 0;
+    return checkpoint(md);
+}
+
+/* Frees up blocks used by file, every block from start to the end of the chain
+ * is marked free and added to the queue. Called with the allocator lock held.
+ * Returns the blocks freed */
+static u_int32_t free_chain(meta_data *md, block start) {
+    u_int32_t freed = 0;
+    block bl;
+    block next;
+
+    bl = start;
+
+    /* frees up blocks in chain and adds the to queue, a free block in the chain
+     * means it is broken or loops back on itself */
+    while (bl != END_BLOCK) {
+        if (bl >= md->sb.total_blocks || md->fat[bl] == FREE_BLOCK) {
+            log_error("Free block found in chain -> Block: %u\n", bl);
+            break;
+        }
+        next = md->fat[bl];
+        set_fat(md, bl, FREE_BLOCK);
+        enQueue(md, bl);
+        freed++;
+        bl = next;
+    }
+    return freed;
+}
+
+/* Hands a chain of blocks blocks over to be freed by reclaim_chains once the
+ * next flush of the meta data has committed the change that dropped it.
+ * Called with the allocator lock held */
+static void defer_chain(meta_data *md, block start, u_int32_t blocks) {
+    block *grown;
+    u_int32_t cap;
+
+    if (md->reclaim_count == md->reclaim_cap) {
+        cap = md->reclaim_cap ? md->reclaim_cap * 2 : 0x10;
+        grown = realloc(md->reclaim, cap * sizeof(block));
+        if (grown == NULL) {
+            /* freeing it now could hand it out before the file is gone on the
+             * device, it is left for fsck to find as lost blocks */
+            log_error("Out of memory for chains to free -> Block: %u\n", start);
+            return;
+        }
+        md->reclaim = grown;
+        md->reclaim_cap = cap;
+    }
+    md->reclaim[md->reclaim_count++] = start;
+    __atomic_store_n(&md->reclaim_blocks, md->reclaim_blocks + blocks, __ATOMIC_RELAXED);
+    stat_add(&md->stats.chains_deferred, 1);
+}
+
+/* Frees the count chains taken off the list of defer_chain in one go, in the
+ * order they were handed over so the queue keeps its wear levelling order.
+ * They held blocks blocks. Called with the allocator lock held, only by a
+ * flush once the directory without them is committed */
+static void reclaim_chains(meta_data *md, const block *chains, u_int32_t count, u_int32_t blocks) {
+    u_int64_t freed = 0;
+
+    for (u_int32_t i = 0; i < count; i++) freed += free_chain(md, chains[i]);
+    __atomic_store_n(&md->reclaim_blocks, md->reclaim_blocks - blocks, __ATOMIC_RELAXED);
+    stat_add(&md->stats.blocks_freed, freed);
+    stat_add(&md->stats.reclaims, 1);
+}
+
+/* Writes the parts of the meta data marked dirty as one journal transaction.
+ * Neighbouring dirty entries are written together */
+static u_int8_t write_changes(meta_data *md) {
+    u_int32_t pos, first, count;
+    dir_entry *snap;
+    int32_t ends[2];
+    u_int8_t ok = 1;
+
+    md->journal_len = 0;
+    md->journal_over = 0;
+    md->logging = 1;
+
+    /* directory entries are copied under their own lock so a half updated
+     * entry is never written out */
+    pos = 0;
+    while (next_dirty_run(&md->dir_dirty, &pos, md->sb.max_files, &first, &count)) {
+        snap = malloc(count * sizeof(dir_entry));
+        if (snap == NULL) {
+            ok = 0;
+            continue;
+        }
+        for (u_int32_t i = 0; i < count; i++) {
+            pthread_rwlock_rdlock(&md->locks[first + i]);
+            snap[i] = md->dir[first + i];
+            pthread_rwlock_unlock(&md->locks[first + i]);
+        }
+        ok &= meta_write(md, md->sb.dir_start + (u_int64_t) first * sizeof(dir_entry), snap, count * sizeof(dir_entry));
+        free(snap);
+    }
+
+    pos = 0;
+    while (md->crcs != NULL && next_dirty_run(&md->crc_dirty, &pos, md->sb.total_blocks, &first, &count))
+        ok &= store_crcs(md, first, count);
+
+    /* the fat and queue only change under the allocator lock */
+    pthread_mutex_lock(&md->alloc_lock);
+    pos = 0;
+    while (next_dirty_run(&md->fat_dirty, &pos, md->sb.total_blocks, &first, &count))
+        ok &= store_table(md, md->sb.fat_start, md->fat, first, count);
+
+    pos = 0;
+    while (next_dirty_run(&md->queue_dirty, &pos, md->sb.total_blocks, &first, &count))
+        ok &= store_table(md, md->sb.queue_start + sizeof(ends), md->queue.q, first, count);
+
+    if (md->ends_dirty) {
+        ends[0] = md->queue.front;
+        ends[1] = md->queue.rear;
+        ok &= meta_write(md, md->sb.queue_start, ends, sizeof(ends));
+        md->ends_dirty = 0;
+    }
+    pthread_mutex_unlock(&md->alloc_lock);
+
+    md->logging = 0;
+    return journal_commit(md) && ok;
+}
+
+/* Writes back only the parts of the meta data that changed since the last
+ * flush */
+static u_int8_t flush_meta(meta_data *md) {
+    u_int64_t start = stat_start();
+    u_int32_t count, blocks;
+    block *chains;
+    u_int8_t ok = 1;
+
+    /* file data goes out before the meta data that points at it */
+    if (md->cache != NULL && !cache_flush(md->cache)) ok = 0;
+
+    /* Chains freed so far are taken off the list. Their entries were changed
+     * before they were handed over, so the directory written next drops them.
+     * Until that is committed a crash brings the files back, so the chains go
+     * back to the allocator only after it is, in a transaction of their own */
+    pthread_mutex_lock(&md->alloc_lock);
+    chains = md->reclaim;
+    count = md->reclaim_count;
+    blocks = md->reclaim_blocks;
+    md->reclaim = NULL;
+    md->reclaim_count = 0;
+    md->reclaim_cap = 0;
+    pthread_mutex_unlock(&md->alloc_lock);
+
+    ok = write_changes(md) && ok;
+
+    if (count > 0) {
+        pthread_mutex_lock(&md->alloc_lock);
+        if (ok) {
+            reclaim_chains(md, chains, count, blocks);
+        } else {
+            /* left for the next flush, their blocks are counted already */
+            for (u_int32_t i = 0; i < count; i++) defer_chain(md, chains[i], 0);
+        }
+        pthread_mutex_unlock(&md->alloc_lock);
+        if (ok) ok = write_changes(md);
+    }
+    free(chains);
+
+    md->pending_ops = 0;
+    md->last_flush = time(NULL);
+    stat_done(&md->stats, OP_FLUSH, start);
+    return ok;
+}
+
+/* writes back every change made since the last flush */
+u_int8_t sync_meta(meta_data *md) {
+    u_int8_t ok;
+
+    pthread_mutex_lock(&md->meta_lock);
+    ok = flush_meta(md);
+    pthread_mutex_unlock(&md->meta_lock);
+    return ok;
+}
+
+/* Called at the end of every operation that changes the meta data. Flushes
+ * once enough operations have built up or enough time has passed */
+static u_int8_t commit_meta(meta_data *md) {
+    u_int8_t ok = 1;
+
+    pthread_mutex_lock(&md->meta_lock);
+    md->pending_ops++;
+
+    if (md->flush_ops && md->pending_ops >= md->flush_ops) ok = flush_meta(md);
+    else if (md->flush_secs && time(NULL) - md->last_flush >= (time_t) md->flush_secs) ok = flush_meta(md);
+    pthread_mutex_unlock(&md->meta_lock);
+    return ok;
+}
+
+/* sets how often changes to the meta data are written back, 1 op writes them
+ * on every close and delete, 0 for both leaves them until sync_fs */
+void set_flush_policy(meta_data *md, u_int32_t ops, u_int32_t secs) {
+    md->flush_ops = ops;
+    md->flush_secs = secs;
+}
+
+/* Keeps a checksum of every data block on devices formatted from now on, call
+ * before format_fs. Only the format decides, a mounted device keeps what it
+ * was formatted with */
+void set_checksums(meta_data *md, u_int8_t on) {
+    if (on) md->features |= FEAT_CRC;
+    else md->features &= ~FEAT_CRC;
+}
+
+/* Turns the check made by every read on or off, it is on after mounting a
+ * device with checksums. The scrubber checks blocks either way */
+void set_verify(meta_data *md, u_int8_t on) {
+    md->verify = on && md->crcs != NULL;
+}
+
+/* writes back everything that is pending and flushes the device */
+u_int8_t sync_fs(meta_data *md) {
+    if (!sync_meta(md)) return 0;
+    return dev_sync(md->dev);
+}
+
+/* Builds the free bitmap from the fat and checks the queue agrees with it.
+ * Every queue entry has to be a free block and every free block has to be in
+ * the queue once. If not the queue is rebuilt from the fat, which is what
+ * every chain is read from */
+static void check_free_map(meta_data *md) {
+    u_int64_t *queued;
+    u_int32_t listed = 0;
+    u_int8_t ok = 1;
+    int32_t pos;
+    block b;
+
+    memset(md->free_bits, 0, (md->sb.total_blocks / 64 + 1) * sizeof(u_int64_t));
+    md->free_count = 0;
+    for (b = 0; b < md->sb.total_blocks; b++) {
+        if (md->fat[b] == FREE_BLOCK) mark_free(md, b);
+    }
+
+    queued = calloc(md->sb.total_blocks / 64 + 1, sizeof(u_int64_t));
+    if (!isEmpty(md)) {
+        for (pos = md->queue.front; ; pos = queue_next(md, pos)) {
+            b = md->queue.q[pos];
+            if (b >= md->sb.total_blocks || !is_free(md, b) || (queued[b / 64] >> (b % 64) & 1)) {
+                ok = 0;
+                break;
+            }
+            queued[b / 64] |= 1ULL << (b % 64);
+            listed++;
+            if (pos == md->queue.rear || listed > md->sb.total_blocks) break;
+        }
+    }
+    free(queued);
+
+    if (ok && listed == md->free_count) return;
+
+    log_error("Free queue does not match fat -> Queued: %u; Free: %u\n", listed, md->free_count);
+    md->queue_rebuilt = 1;
+    log_warn("Rebuilding free queue\n");
+
+    md->queue.front = -1;
+    md->queue.rear = -1;
+    md->free_count = 0;
+    memset(md->free_bits, 0, (md->sb.total_blocks / 64 + 1) * sizeof(u_int64_t));
+    for (b = 0; b < md->sb.total_blocks; b++) {
+        if (md->fat[b] == FREE_BLOCK) enQueue(md, b);
+    }
+}
+
+/* works out where each table lives for a given number of blocks */
+static void layout(super_block *sb, u_int32_t total_blocks) {
+    u_int64_t end;
+
+    sb->total_blocks = total_blocks;
+    sb->dir_start = sizeof(slot_header);
+    sb->fat_start = sb->dir_start + (u_int64_t) sb->max_files * sizeof(dir_entry);
+    sb->queue_start = sb->fat_start + (u_int64_t) total_blocks * sb->index_size;
+    sb->slot_size = sb->queue_start + 2 * sizeof(int32_t) + (u_int64_t) total_blocks * sb->index_size;
+    sb->crc_start = 0;
+    if (sb->features & FEAT_CRC) {
+        sb->crc_start = sb->slot_size;
+        sb->slot_size += (u_int64_t) total_blocks * sizeof(u_int32_t);
+    }
+    sb->slot_start = EEPROM_START + sizeof(super_block);
+    sb->journal_start = sb->slot_start + sb->meta_slots * sb->slot_size;
+    end = sb->journal_start + sb->journal_size;
+    sb->data_start = (end + sb->block_size - 1) / sb->block_size * sb->block_size; // align to block size
+}
+
+/* Works out the super block for a device of size bytes. The number of blocks
+ * is the most that fits once the meta data has been laid out, it is returned */
+static u_int32_t plan(super_block *sb, u_int64_t size, u_int32_t block_size, u_int32_t max_files, u_int32_t features) {
+    u_int64_t fixed, blocks, estimate, per_block;
+
+    memset(sb, 0, sizeof(super_block));
+    sb->magic = FS_MAGIC;
+    sb->version = FS_VERSION;
+    sb->block_size = block_size;
+    sb->max_files = max_files;
+    sb->features = features;
+
+    /* upper estimate of the blocks that fit, each block also costs a fat and queue entry */
+    /* the journal gets a small share of the device */
+    sb->journal_size = size / 64 / sizeof(journal_record) * sizeof(journal_record);
+    if (sb->journal_size < MIN_JOURNAL) sb->journal_size = MIN_JOURNAL;
+    if (sb->journal_size > MAX_JOURNAL) sb->journal_size = MAX_JOURNAL;
+
+    /* every slot holds a copy of the directory, fat and queue */
+    sb->meta_slots = META_SLOTS;
+    fixed = EEPROM_START + sizeof(super_block) + sb->journal_size
+          + META_SLOTS * (sizeof(slot_header) + (u_int64_t) max_files * sizeof(dir_entry) + 2 * sizeof(int32_t));
+    per_block = block_size + META_SLOTS * 2 * sizeof(u_int16_t);
+    if (features & FEAT_CRC) per_block += META_SLOTS * sizeof(u_int32_t);
+    if (size <= fixed) blocks = 0;
+    else blocks = (size - fixed) / per_block;
+
+    sb->index_size = sizeof(u_int16_t);
+    if (blocks >= (u_int16_t) FREE_BLOCK) sb->index_size = sizeof(block);
+    if (blocks > MAX_BLOCKS) blocks = MAX_BLOCKS;
+
+    /* lay out with the estimate then take what is left for data. Fewer blocks
+     * can only shrink the tables so the second layout always fits, more than
+     * the estimate would grow them into the data */
+    layout(sb, blocks);
+    estimate = blocks;
+    if (sb->data_start >= size) blocks = 0;
+    else blocks = (size - sb->data_start) / block_size;
+    if (blocks > estimate) blocks = estimate;
+    layout(sb, blocks);
+
+    return blocks;
+}
+
+/* Returns a device size that formats to at least blocks data blocks, or 0 if
+ * that many blocks can not be addressed. Each try adds the blocks it fell
+ * short by, the meta data grows far slower than the data so this settles
+ * within a few tries */
+u_int64_t image_size(u_int32_t block_size, u_int32_t blocks, u_int32_t max_files, u_int32_t features) {
+    super_block sb;
+    u_int64_t size;
+    u_int32_t got;
+
+    if (blocks == 0 || blocks > MAX_BLOCKS) return 0;
+
+    size = (u_int64_t) blocks * block_size;
+    while ((got = plan(&sb, size, block_size, max_files, features)) < blocks) {
+        size += (u_int64_t) (blocks - got) * block_size;
+    }
+    return size;
+}
+
+/* Formats the device with the given geometry. The number of blocks is the
+ * most that fits on the device once the meta data has been laid out. Block
+ * checksums are kept if set_checksums was called first */
+u_int8_t format_fs(meta_data *md, block_dev *dev, u_int32_t block_size, u_int32_t max_files) {
+    super_block *sb = &md->sb;
+    filename fn;
+    block bl;
+
+    /* block size has to be a power of two so blocks line up with pages */
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1))) {
+        log_error("Invalid block size -> Block size: %u\n", block_size);
+        return 0;
+    }
+
+    if (plan(sb, dev->size, block_size, max_files, md->features) == 0) {
+        log_error("Device too small for file system -> Size: %llu\n", (unsigned long long) dev->size);
+        return 0;
+    }
+
+    md->dev = dev;
+    free_tables(md);
+    if (!alloc_tables(md)) return 0;
+
+    /* set pointers in queue */
+    md->queue.front = -1;
+    md->queue.rear = -1;
+
+    /* Set directory meta to blank */
+    for (fn = 0; fn < sb->max_files; fn++) {
+        md->dir[fn].startblock = FREE_BLOCK;
+        md->dir[fn].length = 0;
+        md->dir[fn].flags = 0;
+        md->dir[fn].parent = NO_FILE;
+        md->dir[fn].logical = 0;
+    }
+
+    /* Set File Allocation Tables to free and push all blocks to queue */
+    for (bl = 0; bl < sb->total_blocks; bl++) {
+        md->fat[bl] = FREE_BLOCK;
+        enQueue(md, bl);
+    }
+
+    log_info("Formatted -> Blocks: %u; Block size: %u; Files: %u; Checksums: %s\n", sb->total_blocks, sb->block_size, sb->max_files,
+             (sb->features & FEAT_CRC) ? crc32c_impl() : "off");
+
+    return write_meta(md);
+}
+
+u_int8_t init_fat(meta_data *md, block_dev *dev) {
+    super_block *sb = &md->sb;
+    filename fn;
+    u_int32_t crc;
+
+    log_debug("Directory entry size -> %ld\n", sizeof(dir_entry));
+    log_debug("Super block size     -> %ld\n", sizeof(super_block));
+
+    if (md->flush_ops == 0 && md->flush_secs == 0) set_flush_policy(md, DEFAULT_FLUSH_OPS, DEFAULT_FLUSH_SECS);
+
+    if (dev == NULL || dev->size < EEPROM_START + sizeof(super_block)) {
+        log_error("Device too small for file system\n");
+        return 0;
+    }
+
+    /* Load in super block */
+    dev_read(dev, EEPROM_START, sb, sizeof(super_block));
+
+    /* Only a device that has never been formatted is formatted here. One with
+     * the wrong version is left alone, it may still hold someones files */
+    if (sb->magic != FS_MAGIC) {
+
+        log_info("No file system found\n");
+        log_info("Formatting to file system -> %x\n", FS_VERSION);
+
+        if (!format_fs(md, dev, DEFAULT_BLOCK_SIZE, DEFAULT_MAX_FILES)) return 0;
+    } else if (sb->version != FS_VERSION) {
+        log_error("File system version %x not supported -> Expected: %x\n", sb->version, FS_VERSION);
+        return 0;
+    } else {
+        log_info("File System found v.%u\n", sb->version);
+
+        crc = sb->crc;
+        sb->crc = 0;
+        if (crc32c(0, sb, sizeof(super_block)) != crc) {
+            log_error("Super block damaged -> Crc: %x\n", crc);
+            return 0;
+        }
+        sb->crc = crc;
+        if (sb->features & ~FEAT_CRC) {
+            log_error("File system features not supported -> Features: %x\n", sb->features);
+            return 0;
+        }
+
+        /* checks the geometry fits on this device before trusting it */
+        if (BLOCK_ADDR(md, sb->total_blocks) > dev->size) {
+            log_error("Device smaller than file system -> Blocks: %u\n", sb->total_blocks);
+            return 0;
+        }
+
+        md->dev = dev;
+        if (!alloc_tables(md)) return 0;
+
+        /* Load in meta data */
+        if (!load_meta(md)) {
+            log_error("No readable meta data found\n");
+            return 0;
+        }
+        md->last_flush = time(NULL);
+
+        check_free_map(md);
+
+        for (fn = 0; fn < sb->max_files; fn++) {
+            if (md->dir[fn].flags & DE_ROOT) md->root = fn;
+
+            /* Print files that are currently in storage */
+            if (md->dir[fn].startblock != FREE_BLOCK)
+                log_debug("Found file -> %x; length -> %x\n", fn, md->dir[fn].length);
+        }
+    }
+    log_info("Mounted -> Free blocks: %u; Queue front: %d; Queue rear: %d\n", md->free_count, md->queue.front, md->queue.rear);
+    return 1;
+}
+
+/* flushes the device and releases it */
+void unmount(meta_data *md) {
+    if (md->dev == NULL) return;
+    stop_scrub(md);
+    sync_fs(md);
+    free_tables(md);
+    dev_close(md->dev);
+    md->dev = NULL;
+}
+
+/* checks to see if there are enough free blocks and returns number of blocks needed */
+u_int32_t scan_blocks(meta_data *md, u_int32_t file_size) {
+
+    u_int64_t as;           // available space
+    u_int64_t cap;          // total storage capacity
+    u_int32_t blks;         // number of blocks needed
+
+    cap = (u_int64_t) md->sb.total_blocks * md->sb.block_size;
+
+    /* checks to see if file_size exceeds total storage capacity */
+    if (file_size > cap) {
+        log_error("File is too big for storage device ->          File: %ubytes\n", file_size);
+        log_at(LOG_ERROR, "                                            Storage Space: %llubytes\n", (unsigned long long) cap);
+        return 0;
+    } else {
+        /* checks to see if file size exceeds available free space */
+        as = availableBlocks(md) * md->sb.block_size; // available space
+        if (file_size > as) {
+            log_error("Not enough block space ->        File: %ubytes\n", file_size);
+            log_at(LOG_ERROR, "                                Block Space: %llubytes\n", (unsigned long long) as);
+            return 0;
+        } else {
+            /* returns number of blocks needed */
+            blks = (file_size / md->sb.block_size + (file_size % md->sb.block_size != 0));
+            log_debug("Blocks needed for file -> No Blocks -> %u\n", blks);
+            return blks;
+        }
+    }
+}
+
+/* Frees the chain starting at start, which holds blocks blocks. The chain is
+ * only walked by the next flush of the meta data, until then its blocks count
+ * as free but are not handed out, see make_room */
+void free_blocks(meta_data *md, block start, u_int32_t blocks) {
+    pthread_mutex_lock(&md->alloc_lock);
+    defer_chain(md, start, blocks);
+    pthread_mutex_unlock(&md->alloc_lock);
+}
+
+/* Flushes the meta data if a write of bytes may need blocks that are only
+ * waiting for a flush to be freed, the allocator never hands them out before.
+ * Called with no file locked, as the flush takes their locks */
+static void make_room(meta_data *md, u_int64_t bytes) {
+    u_int64_t want = bytes / md->sb.block_size + 2; // a part block at each end
+
+    if (__atomic_load_n(&md->reclaim_blocks, __ATOMIC_RELAXED) > 0
+        && __atomic_load_n(&md->free_count, __ATOMIC_RELAXED) < want) sync_meta(md);
+}
+
+/* blocks the chain of a file takes, there is always one */
+static u_int32_t chain_blocks(meta_data *md, u_int32_t length) {
+    u_int32_t blocks = length / md->sb.block_size + (length % md->sb.block_size != 0);
+    return blocks ? blocks : 1;
+}
+
+/* Removes the blocks start to start + count - 1 from the queue. The rest of the
+ * queue keeps its order so wear levelling is not disturbed */
+static void queue_take(meta_data *md, block start, u_int32_t count) {
+    int32_t rd, wr;
+    u_int32_t i;
+    block b;
+
+    /* usual case, the run is sitting at the front of the queue in order */
+    for (i = 0, rd = md->queue.front; i < count; i++, rd = queue_next(md, rd)) {
+        if (md->queue.q[rd] != start + i) break;
+        if (rd == md->queue.rear && i + 1 < count) break;
+    }
+    if (i == count) {
+        for (i = 0; i < count; i++) deQueue(md);
+        return;
+    }
+
+    for (i = 0; i < count; i++) mark_used(md, start + i);
+
+    /* otherwise close up the gaps left by the run */
+    rd = wr = md->queue.front;
+    for (;;) {
+        b = md->queue.q[rd];
+        if (b < start || b >= start + count) {
+            if (wr != rd) {
+                md->queue.q[wr] = b;
+                mark_dirty(&md->queue_dirty, wr);
+            }
+            wr = queue_next(md, wr);
+        }
+        if (rd == md->queue.rear) break;
+        rd = queue_next(md, rd);
+    }
+
+    if (wr == md->queue.front) {
+        md->queue.front = -1;
+        md->queue.rear = -1;
+    } else {
+        md->queue.rear = (wr == 0 ? (int32_t) md->sb.total_blocks : wr) - 1;
+    }
+    md->ends_dirty = 1;
+}
+
+/* Counts the free blocks from start onwards, stopping at max. Whole words of
+ * the bitmap are skipped at a time using the lowest clear bit */
+u_int32_t free_run(meta_data *md, block start, u_int32_t max) {
+    u_int32_t run = 0;
+    u_int32_t span, ones;
+    u_int64_t word;
+    block b = start;
+
+    while (run < max && b < md->sb.total_blocks) {
+        word = md->free_bits[b / 64] >> (b % 64); // free blocks from b to the end of the word
+        span = 64 - b % 64;
+        ones = ~word == 0 ? 64 : __builtin_ctzll(~word);
+
+        /* whole rest of the word is free, carry on into the next one */
+        if (ones >= span) {
+            run += span;
+            b += span;
+            continue;
+        }
+        run += ones;
+        break;
+    }
+
+    if (start + run > md->sb.total_blocks) run = md->sb.total_blocks - start; // bits past the end are never set
+    return run < max ? run : max;
+}
+
+/* Finds the first run of at least want free blocks anywhere on the device,
+ * or the longest run if none is long enough. Returns 0 if nothing is free */
+u_int8_t find_free_run(meta_data *md, u_int32_t want, extent *ext) {
+    u_int32_t words = md->sb.total_blocks / 64 + 1;
+    u_int32_t w, run;
+    u_int64_t word;
+    block b;
+
+    ext->count = 0;
+    for (w = 0; w < words; w++) {
+        word = md->free_bits[w];
+        while (word) {
+            b = w * 64 + __builtin_ctzll(word); // first free block in this word
+            if (b >= md->sb.total_blocks) return ext->count > 0;
+
+            run = free_run(md, b, want);
+            if (run > ext->count) {
+                ext->start = b;
+                ext->count = run;
+                if (run == want) return 1;
+            }
+
+            /* carries on after the end of this run */
+            b += run;
+            if (b / 64 != w) {
+                w = b / 64 - 1;
+                break;
+            }
+            word = md->free_bits[w] & (~0ULL << (b % 64));
+        }
+    }
+    return ext->count > 0;
+}
+
+/* Hands out a run of up to want contiguous free blocks. Runs starting at the
+ * oldest entries of the queue are tried first so for runs of the same length
+ * the queue order decides. If none of them is long enough the bitmap is
+ * searched for a run that is. Returns 0 if there are no free blocks. Like the
+ * queue functions it expects the allocator lock to be held */
+u_int8_t alloc_extent(meta_data *md, u_int32_t want, extent *ext) {
+    int32_t pos;
+    u_int32_t run;
+    extent found;
+    block b;
+
+    if (isEmpty(md) || want == 0) return 0;
+
+    ext->start = END_BLOCK;
+    ext->count = 0;
+    pos = md->queue.front;
+
+    for (u_int32_t seen = 0; seen < ALLOC_WINDOW; seen++) {
+        b = md->queue.q[pos];
+
+        if (b < md->sb.total_blocks) {
+            /* counts the free blocks starting at b */
+            run = free_run(md, b, want);
+
+            if (run > ext->count) {
+                ext->start = b;
+                ext->count = run;
+            }
+            if (run == want) break;
+        }
+        if (pos == md->queue.rear) break;
+        pos = queue_next(md, pos);
+    }
+
+    /* a longer run elsewhere beats the queue order */
+    if (ext->count < want) {
+        stat_add(&md->stats.alloc_misses, 1);
+        if (find_free_run(md, want, &found) && found.count > ext->count) *ext = found;
+    } else {
+        stat_add(&md->stats.alloc_hits, 1);
+    }
+
+    if (ext->count == 0) {
+        log_warn("No free blocks available\n");
+        return 0;
+    }
+
+    queue_take(md, ext->start, ext->count);
+    stat_add(&md->stats.alloc_blocks, ext->count);
+    stat_add(&md->stats.alloc_extents, 1);
+    return 1;
+}
+
+/* Allocates count blocks as a fat chain ending in END_BLOCK, using as few runs
+ * of contiguous blocks as possible. Returns the first block of the chain or
+ * END_BLOCK if there was not enough space. The whole chain is taken under one
+ * hold of the allocator lock so writers only contend once per write */
+block alloc_chain(meta_data *md, u_int32_t count) {
+    block first = END_BLOCK;
+    block last = END_BLOCK;
+    extent ext;
+
+    pthread_mutex_lock(&md->alloc_lock);
+    while (count > 0) {
+        if (!alloc_extent(md, count, &ext)) {
+            /* gives back what was taken so far */
+            if (first != END_BLOCK) {
+                set_fat(md, last, END_BLOCK);
+                free_chain(md, first);
+            }
+            pthread_mutex_unlock(&md->alloc_lock);
+            return END_BLOCK;
+        }
+
+        for (u_int32_t i = 0; i < ext.count; i++) {
+            if (last == END_BLOCK) first = ext.start;
+            else set_fat(md, last, ext.start + i);
+            last = ext.start + i;
+        }
+        count -= ext.count;
+    }
+
+    if (last != END_BLOCK) set_fat(md, last, END_BLOCK);
+    pthread_mutex_unlock(&md->alloc_lock);
+    return first;
+}
+
+/* links blk on to next, the fat is only changed under the allocator lock */
+static void link_block(meta_data *md, block blk, block next) {
+    pthread_mutex_lock(&md->alloc_lock);
+    set_fat(md, blk, next);
+    pthread_mutex_unlock(&md->alloc_lock);
+}
+
+/* Adds the chain starting at blk to the end of an extent map, merging blocks
+ * that follow on from the previous one. Out of memory leaves the map invalid
+ * so it is built again the next time and returns 0 */
+static u_int8_t push_chain(meta_data *md, extent_map *em, block blk) {
+    u_int32_t steps = 0;
+    extent *ext;
+
+    while (blk < md->sb.total_blocks && steps++ < md->sb.total_blocks) {
+        if (em->count > 0 && em->ext[em->count - 1].start + em->ext[em->count - 1].count == blk) {
+            em->ext[em->count - 1].count++;
+        } else {
+            if (em->count == em->cap) {
+                ext = realloc(em->ext, (em->cap ? em->cap * 2 : 4) * sizeof(extent));
+                if (ext == NULL) {
+                    log_error("Out of memory for extents -> Extents: %u\n", em->count);
+                    em->valid = 0;
+                    return 0;
+                }
+                em->ext = ext;
+                em->cap = em->cap ? em->cap * 2 : 4;
+            }
+            em->ext[em->count].start = blk;
+            em->ext[em->count].count = 1;
+            em->count++;
+        }
+        em->blocks++;
+        blk = md->fat[blk];
+    }
+    return 1;
+}
+
+/* Returns the extents of a file, rebuilding them from the fat chain if the
+ * chain has changed since they were last worked out. NULL when out of memory */
+extent_map *get_extents(meta_data *md, filename file_name) {
+    extent_map *em = &md->extents[file_name];
+
+    if (em->valid) return em;
+
+    em->count = 0;
+    em->blocks = 0;
+    em->indexed = 0;
+    if (!push_chain(md, em, md->dir[file_name].startblock)) return NULL;
+
+    em->valid = 1;
+    return em;
+}
+
+/* Returns the extents of a file with the block index filled in. Only the
+ * blocks added since the index was last used are filled in, so after the first
+ * time this costs nothing until the file grows. Returns NULL if out of memory */
+static extent_map *get_index(meta_data *md, filename file_name) {
+    extent_map *em = get_extents(md, file_name);
+    u_int32_t first = 0;    // file block the extent starts at
+    u_int32_t e;
+    block *index;
+
+    if (em == NULL) return NULL;
+    if (em->indexed == em->blocks) return em;
+
+    if (em->blocks > em->index_cap) {
+        index = realloc(em->index, em->blocks * sizeof(block));
+        if (index == NULL) {
+            log_error("Out of memory for block index -> Filename: %u\n", file_name);
+            return NULL;
+        }
+        em->index = index;
+        em->index_cap = em->blocks;
+    }
+
+    /* skips the extents already in the index, the last of them may have grown */
+    for (e = 0; e < em->count && first + em->ext[e].count <= em->indexed; e++) first += em->ext[e].count;
+
+    for (; e < em->count; e++) {
+        for (u_int32_t i = em->indexed - first; i < em->ext[e].count; i++) em->index[first + i] = em->ext[e].start + i;
+        first += em->ext[e].count;
+        em->indexed = first;
+    }
+    return em;
+}
+
+/* Takes a free slot in the open file table for file_name. Any number of
+ * readers can share a file, writing or appending needs it to themselves */
+static file_handle *open_handle(meta_data *md, filename file_name, u_int8_t mode) {
+    file_handle *h = NULL;
+    open_file *of;
+    u_int32_t flags;
+
+    /* checks to see if file name is within total files allowed */
+    if (file_name >= md->sb.max_files) {
+        log_error("File name exceeds max file limit\n");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&md->open_lock);
+
+    /* checks to see if the file is open in a way that clashes */
+    of = &md->opens[file_name];
+    if (of->writer || (mode != READ && of->readers > 0)) {
+        pthread_mutex_unlock(&md->open_lock);
+        log_error("File all ready open -> Filename: %u\n", file_name);
+        return NULL;
+    }
+
+    for (u_int32_t i = 0; i < MAX_HANDLES; i++) {
+        if (md->handles[i].mode != CLOSED_FILE) continue;
+
+        h = &md->handles[i];
+        h->file_name = file_name;
+        h->mode = mode;
+        h->pos = 0; // sets the current file position to 0
+        h->log_len = 0;
+
+        if (mode == READ) of->readers++;
+        else of->writer = 1;
+        break;
+    }
+    pthread_mutex_unlock(&md->open_lock);
+
+    if (h == NULL) {
+        log_error("Too many open files -> Max: %u\n", MAX_HANDLES);
+        return NULL;
+    }
+
+    /* The flags are written under the lock of the entry, which can not be
+     * taken holding open_lock. Now the file is open nothing can free the entry
+     * or give it to a new file while they are looked at. A directory is only
+     * changed through the names in it */
+    pthread_rwlock_rdlock(&md->locks[file_name]);
+    flags = md->dir[file_name].flags;
+    pthread_rwlock_unlock(&md->locks[file_name]);
+
+    if (flags & DE_DIR) {
+        pthread_mutex_lock(&md->open_lock);
+        if (mode == READ) of->readers--;
+        else of->writer = 0;
+        h->mode = CLOSED_FILE;
+        pthread_mutex_unlock(&md->open_lock);
+        log_error("Cannot open a directory -> Filename: %u\n", file_name);
+        return NULL;
+    }
+    return h;
+}
+
+/* checks a handle is open in the given mode, a mode of 0 takes any */
+static u_int8_t check_handle(meta_data *md, file_handle *h, u_int8_t mode) {
+    if (h == NULL || h < md->handles || h >= md->handles + MAX_HANDLES || h->mode == CLOSED_FILE) {
+        log_error("Invalid file handle\n");
+        return 0;
+    }
+
+    if (mode != 0 && h->mode != mode) {
+        log_error("file is not open for %s -> Filename %u\n",
+               mode == READ ? "reading" : mode == WRITE ? "writing" : "appending", h->file_name);
+        return 0;
+    }
+    return 1;
+}
+
+/* Opens a file to be read. The extents and block index are worked out here
+ * while the file is locked, nothing can change them until the last reader
+ * closes so reads can share them without taking the lock for writing */
+file_handle *open_for_read(meta_data *md, filename file_name) {
+    u_int64_t start = stat_start();
+    file_handle *h;
+    extent_map *em;
+
+    h = open_handle(md, file_name, READ);
+    if (h == NULL) return NULL;
+
+    pthread_rwlock_wrlock(&md->locks[file_name]);
+    em = get_index(md, file_name);
+    pthread_rwlock_unlock(&md->locks[file_name]);
+
+    if (em == NULL) {
+        close_file(md, h);
+        return NULL;
+    }
+    stat_done(&md->stats, OP_OPEN, start);
+    return h;
+}
+
+/* Opens a file to append */
+file_handle *open_for_append(meta_data *md, filename file_name) {
+    u_int64_t start = stat_start();
+    file_handle *h;
+
+    /* checks to see if there are blocks available */
+    if (availableBlocks(md) == 0) {
+        log_error("out of storage space\n");
+        return NULL;
+    }
+
+    h = open_handle(md, file_name, APPEND);
+    if (h != NULL) stat_done(&md->stats, OP_OPEN, start);
+    return h;
+}
+
+/* opens a file for writing */
+file_handle *open_for_write(meta_data *md, filename file_name) {
+    u_int64_t start = stat_start();
+    file_handle *h;
+
+    h = open_handle(md, file_name, WRITE);
+    if (h == NULL) return NULL;
+
+    pthread_rwlock_wrlock(&md->locks[file_name]);
+
+    /* Checks to see if the start block is a FREE BLOCk if not then frees blocks in fat chain */
+    if (md->dir[file_name].startblock != FREE_BLOCK) {
+        log_info("Overwriting file -> Filename: %u\n", file_name);
+        free_blocks(md, md->dir[file_name].startblock, chain_blocks(md, md->dir[file_name].length));
+        md->dir[file_name].startblock = FREE_BLOCK;
+        md->extents[file_name].valid = 0;
+    }
+
+    /* a compressed file stays compressed */
+    md->dir[file_name].length = 0;
+    md->dir[file_name].logical = 0;
+    md->frames[file_name].valid = 0;
+    mark_dirty(&md->dir_dirty, file_name);
+    pthread_rwlock_unlock(&md->locks[file_name]);
+
+    stat_done(&md->stats, OP_OPEN, start);
+    return h;
+}
+
+/* Opens a file for writing without emptying it first, so it can be written
+ * anywhere and read back like a file open for reading */
+file_handle *open_for_update(meta_data *md, filename file_name) {
+    u_int64_t start = stat_start();
+    file_handle *h;
+
+    h = open_handle(md, file_name, WRITE);
+    if (h != NULL) stat_done(&md->stats, OP_OPEN, start);
+    return h;
+}
+
+/* Reads file data from device address addr, through the block cache if there
+ * is one. Given a batch the read is added to it and buf is filled when the
+ * batch runs */
+static u_int8_t data_read(meta_data *md, u_int64_t addr, void *buf, u_int64_t len, dev_batch *b) {
+    u_int64_t rel;
+
+    if (md->cache == NULL || addr < md->sb.data_start) {
+        if (b != NULL) return dev_batch_add(b, 0, addr, buf, len);
+        return dev_read(md->dev, addr, buf, len);
+    }
+
+    rel = addr - md->sb.data_start;
+    if (b != NULL) return cache_read_batch(md->cache, b, rel / md->sb.block_size, rel % md->sb.block_size, buf, len);
+    return cache_read(md->cache, rel / md->sb.block_size, rel % md->sb.block_size, buf, len);
+}
+
+/* Works out the checksum of what block blk holds now, which for a device that
+ * can not be mapped may be newer in the cache than on the device */
+static u_int8_t block_crc(meta_data *md, block blk, u_int32_t *crc) {
+    u_int8_t piece[0x400];
+    u_int64_t addr = BLOCK_ADDR(md, blk);
+    const void *p;
+    u_int32_t n;
+
+    p = dev_map(md->dev, addr, md->sb.block_size);
+    if (p != NULL) {
+        *crc = crc32c(0, p, md->sb.block_size);
+        return 1;
+    }
+
+    *crc = 0;
+    for (u_int32_t done = 0; done < md->sb.block_size; done += n) {
+        n = md->sb.block_size - done < sizeof(piece) ? md->sb.block_size - done : sizeof(piece);
+        if (!data_read(md, addr + done, piece, n, NULL)) return 0;
+        *crc = crc32c(*crc, piece, n);
+    }
+    return 1;
+}
+
+/* Every change to the checksum of a block goes through here so it gets
+ * written back. Blocks belong to the file that is locked for writing, the
+ * flush reads them without that lock */
+static void set_crc(meta_data *md, block blk, u_int32_t crc) {
+    __atomic_store_n(&md->crcs[blk], crc, __ATOMIC_RELAXED);
+    mark_dirty(&md->crc_dirty, blk);
+}
+
+/* Writes file data to device address addr, through the block cache if there
+ * is one. Given a batch the write is added to it, buf has to be left alone
+ * until the batch runs */
+static u_int8_t data_put(meta_data *md, u_int64_t addr, const void *buf, u_int64_t len, dev_batch *b) {
+    u_int64_t rel;
+
+    if (md->cache == NULL || addr < md->sb.data_start) {
+        if (b != NULL) return dev_batch_add(b, 1, addr, (void *) buf, len);
+        return dev_write(md->dev, addr, buf, len);
+    }
+
+    rel = addr - md->sb.data_start;
+    if (b != NULL) return cache_write_batch(md->cache, b, rel / md->sb.block_size, rel % md->sb.block_size, buf, len);
+    return cache_write(md->cache, rel / md->sb.block_size, rel % md->sb.block_size, buf, len);
+}
+
+/* Same as data_put, keeping the checksums of the blocks written up to date.
+ * Whole blocks are checksummed from buf and can wait for the batch. A block
+ * only partly written is checksummed from what it holds afterwards, so that
+ * part is written at once */
+static u_int8_t data_write(meta_data *md, u_int64_t addr, const void *buf, u_int64_t len, dev_batch *b) {
+    const u_int8_t *p = buf;
+    u_int32_t bs = md->sb.block_size;
+    u_int64_t rel, head, tail;
+    u_int32_t crc;
+
+    if (md->crcs == NULL || addr < md->sb.data_start) return data_put(md, addr, buf, len, b);
+
+    rel = addr - md->sb.data_start;
+    head = rel % bs ? bs - rel % bs : 0;
+    if (head > len) head = len;
+    tail = (len - head) % bs;
+
+    if (head > 0) {
+        if (!data_put(md, addr, p, head, NULL) || !block_crc(md, rel / bs, &crc)) return 0;
+        set_crc(md, rel / bs, crc);
+    }
+    if (len - head - tail > 0) {
+        if (!data_put(md, addr + head, p + head, len - head - tail, b)) return 0;
+        for (u_int64_t done = head; done < len - tail; done += bs) set_crc(md, (rel + done) / bs, crc32c(0, p + done, bs));
+    }
+    if (tail > 0) {
+        if (!data_put(md, addr + len - tail, p + len - tail, tail, NULL) || !block_crc(md, (rel + len - 1) / bs, &crc)) return 0;
+        set_crc(md, (rel + len - 1) / bs, crc);
+    }
+    return 1;
+}
+
+/* Writes size bytes of data into the chain starting at blk. Blocks that follow
+ * on from each other are written together straight from data, so each run
+ * of contiguous blocks is one io of the batch */
+static u_int8_t write_chain(meta_data *md, block blk, const char data[], u_int64_t size, dev_batch *b) {
+    u_int64_t done = 0;
+    u_int64_t n;
+    u_int32_t count;
+    block first;
+
+    while (done < size && blk < md->sb.total_blocks) {
+        first = blk;
+        count = 1;
+
+        /* extends the run while the next block in the chain is the next block on the device */
+        while ((u_int64_t) count * md->sb.block_size < size - done && md->fat[blk] == blk + 1) {
+            blk++;
+            count++;
+        }
+
+        n = (u_int64_t) count * md->sb.block_size;
+        if (n > size - done) n = size - done;
+
+        log_debug("Used blocks -> %u to %u\n", first, blk);
+        if (!data_write(md, BLOCK_ADDR(md, first), data + done, n, b)) return 0;
+
+        done += n;
+        blk = md->fat[blk];
+    }
+    return done == size;
+}
+
+/* returns the last block of a file, END_BLOCK if the extents can not be had */
+static block last_block(meta_data *md, filename file_name) {
+    extent_map *em = get_extents(md, file_name);
+
+    if (em == NULL || em->count == 0) return END_BLOCK;
+    return em->ext[em->count - 1].start + em->ext[em->count - 1].count - 1;
+}
+
+/* returns the bytes of data in a file, which for a compressed file is more
+ * than it takes on the device */
+static u_int32_t file_length(meta_data *md, filename file_name) {
+    if (md->dir[file_name].flags & DE_COMPRESSED) return md->dir[file_name].logical;
+    return md->dir[file_name].length;
+}
+
+/* Adds data to the end of a file. Any space left in the last block is filled
+ * first and the rest goes into newly allocated blocks one run at a time. The
+ * last block comes from the extents, which are added to rather than rebuilt,
+ * so this costs the same however long the file is. The data writes go into
+ * batch b. Called with the file locked for writing */
+static u_int8_t append_tail(meta_data *md, filename file_name, const char data[], u_int32_t size, dev_batch *b) {
+
+    u_int32_t blocks_needed;
+    u_int32_t used;         // bytes used in the last block
+    u_int32_t fill;         // bytes that go into the last block
+    dir_entry *de;
+    block tail;
+    block blk;
+
+    de = &md->dir[file_name];
+    if (size == 0) return 1;
+    if ((u_int64_t) de->length + size > 0xFFFFFFFF) {
+        log_error("File too long -> Filename %u\n", file_name);
+        return 0;
+    }
+
+    /* tops up the last block if the file does not end on a block boundary */
+    fill = 0;
+    tail = END_BLOCK;
+    if (de->startblock != FREE_BLOCK) {
+        tail = last_block(md, file_name);
+        if (tail == END_BLOCK) return 0;
+        used = de->length % md->sb.block_size;
+        if (used != 0) {
+            fill = md->sb.block_size - used;
+            if (fill > size) fill = size;
+            if (!data_write(md, BLOCK_ADDR(md, tail) + used, data, fill, b)) return 0;
+            de->length += fill;
+            mark_dirty(&md->dir_dirty, file_name);
+        }
+    }
+
+    /* the rest goes into new blocks */
+    if (size > fill) {
+        blocks_needed = scan_blocks(md, size - fill); // gets the number of blocks needed to write to the file
+        if (blocks_needed == 0) return 0; // if there are no blocks returns 0
+
+        blk = alloc_chain(md, blocks_needed); // gets the blocks as contiguous as possible
+        if (blk == END_BLOCK) return 0;
+
+        if (tail == END_BLOCK) de->startblock = blk; // sets file start block
+        else link_block(md, tail, blk);
+        if (md->extents[file_name].valid) push_chain(md, &md->extents[file_name], blk); // or left to be built again
+
+        if (!write_chain(md, blk, data + fill, size - fill, b)) return 0;
+        de->length += size - fill; // sets filename length
+        mark_dirty(&md->dir_dirty, file_name);
+    }
+    return 1;
+}
+
+/* Appends with a batch of its own, run before returning */
+static u_int8_t append_now(meta_data *md, filename file_name, const char data[], u_int32_t size) {
+    dev_batch b;
+    u_int8_t ok;
+
+    dev_batch_init(&b);
+    ok = append_tail(md, file_name, data, size, &b);
+    ok = dev_batch_run(md->dev, &b) && ok; // whatever was queued still has to be written
+    dev_batch_free(&b);
+    return ok;
+}
+
+/* Starts a walk over the part of a file from offset for up to len bytes that
+ * lies within the file. The block holding offset comes straight from the block
+ * index. Called with the file locked */
+static void span_start(span_iter *it, meta_data *md, filename file_name, u_int64_t offset, u_int64_t len) {
+    it->md = md;
+    it->file_name = file_name;
+    it->pos = offset;
+    it->end = offset;
+    it->blk = offset / md->sb.block_size;
+    it->skip = offset % md->sb.block_size;
+
+    if (offset >= md->dir[file_name].length) return;
+    if (get_index(md, file_name) == NULL) return;
+
+    if (len > md->dir[file_name].length - offset) len = md->dir[file_name].length - offset;
+    it->end = offset + len;
+}
+
+/* Starts walking the file from offset for up to len bytes without copying
+ * anything, see span_next */
+void span_begin(span_iter *it, meta_data *md, file_handle *h, u_int64_t offset, u_int64_t len) {
+    it->md = md;
+    it->file_name = 0;
+    it->pos = 0;
+    it->end = 0;
+
+    if (!check_handle(md, h, READ)) return;
+
+    /* the device holds the frames of a compressed file rather than its data */
+    if (md->dir[h->file_name].flags & DE_COMPRESSED) {
+        log_error("Cannot walk a compressed file in place -> Filename %u\n", h->file_name);
+        return;
+    }
+    span_start(it, md, h->file_name, offset, len);
+}
+
+/* Gives the next piece of the file that is contiguous on the device. data
+ * points straight into the device when it can be mapped and is NULL when it
+ * cannot, addr is always the device address. Returns 0 at the end. A device
+ * that can not be mapped has a block cache which may hold newer data than the
+ * device until the next flush, read_at goes through it */
+u_int8_t span_next(span_iter *it, span *sp) {
+    meta_data *md = it->md;
+    extent_map *em;
+    u_int64_t bytes;
+    u_int32_t count;
+    block first;
+
+    if (it->pos >= it->end) return 0;
+
+    em = &md->extents[it->file_name];
+    if (it->blk >= em->indexed) return 0;
+
+    /* carries on while the next block of the file is the next block on the device */
+    first = em->index[it->blk];
+    count = 1;
+    bytes = md->sb.block_size - it->skip;
+    while (bytes < it->end - it->pos && it->blk + count < em->indexed && em->index[it->blk + count] == first + count) {
+        count++;
+        bytes += md->sb.block_size;
+    }
+    if (bytes > it->end - it->pos) bytes = it->end - it->pos;
+
+    sp->addr = BLOCK_ADDR(md, first) + it->skip;
+    sp->len = bytes;
+    sp->data = dev_map(md->dev, sp->addr, sp->len);
+
+    it->pos += bytes;
+    it->blk += count;
+    it->skip = 0;
+    return 1;
+}
+
+/* Writes len bytes at offset into a file. What lies within the file is written
+ * over in place and the rest is appended. Writing past the end fills the gap
+ * with zeros. Every data write goes into one batch. Called with the file
+ * locked for writing */
+static u_int8_t write_inner(meta_data *md, filename file_name, u_int64_t offset, const char *data, u_int64_t len) {
+    u_int64_t done = 0;
+    u_int32_t n;
+    span_iter it;
+    span sp;
+    dev_batch b;
+    char *zero = NULL;
+    u_int8_t ok = 1;
+
+    if (offset + len > 0xFFFFFFFF) {
+        log_error("File too long -> Filename %u\n", file_name);
+        return 0;
+    }
+    dev_batch_init(&b);
+
+    /* fills any gap between the end of the file and offset, the same block of
+     * zeros is used for every write of the gap */
+    if (offset > md->dir[file_name].length) {
+        zero = calloc(1, md->sb.block_size);
+        if (zero == NULL) return 0;
+        while (ok && offset > md->dir[file_name].length) {
+            n = md->sb.block_size;
+            if (n > offset - md->dir[file_name].length) n = offset - md->dir[file_name].length;
+            ok = append_tail(md, file_name, zero, n, &b);
+        }
+    }
+
+    if (ok) {
+        span_start(&it, md, file_name, offset, len);
+        while (ok && span_next(&it, &sp)) {
+            ok = data_write(md, sp.addr, data + done, sp.len, &b);
+            done += sp.len;
+        }
+    }
+    if (ok && offset + done < md->dir[file_name].length && done < len) ok = 0; // the index could not be built
+    if (ok) ok = append_tail(md, file_name, data + done, len - done, &b);
+
+    ok = dev_batch_run(md->dev, &b) && ok;
+    dev_batch_free(&b);
+    free(zero);
+    return ok;
+}
+
+/* Moves the position of a handle open for reading or writing, whence is
+ * SEEK_SET, SEEK_CUR or SEEK_END as for fseek. The position may go past the
+ * end of the file, reads there return nothing and a write fills the gap with
+ * zeros. Returns the new position or -1 */
+int64_t seek_file(meta_data *md, file_handle *h, int64_t offset, int whence) {
+    int64_t base;
+
+    if (!check_handle(md, h, 0)) return -1;
+    if (h->mode == APPEND) {
+        log_error("Cannot seek a file open for appending -> Filename %u\n", h->file_name);
+        return -1;
+    }
+
+    switch (whence) {
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            base = h->pos;
+            break;
+        case SEEK_END:
+            pthread_rwlock_rdlock(&md->locks[h->file_name]);
+            base = file_length(md, h->file_name);
+            pthread_rwlock_unlock(&md->locks[h->file_name]);
+            break;
+        default:
+            log_error("Invalid seek origin -> Whence: %d\n", whence);
+            return -1;
+    }
+
+    if (base + offset < 0 || base + offset > 0xFFFFFFFF) {
+        log_error("Seek outside of file -> Offset: %lld\n", (long long) (base + offset));
+        return -1;
+    }
+
+    h->pos = base + offset;
+    return h->pos;
+}
+
+/* Brings the READ_AHEAD blocks that follow blk in its file into the cache,
+ * following the fat one run of contiguous blocks at a time */
+static void read_ahead(meta_data *md, block blk) {
+    u_int32_t left = READ_AHEAD;
+    u_int32_t count;
+    block first;
+
+    blk = md->fat[blk];
+    while (left > 0 && blk < md->sb.total_blocks) {
+        first = blk;
+        count = 1;
+        while (count < left && md->fat[blk] == blk + 1) {
+            blk++;
+            count++;
+        }
+        cache_prefetch(md->cache, first, count);
+        left -= count;
+        blk = md->fat[blk];
+    }
+}
+
+/* Checks each block that holds part of len bytes of a file read into buf
+ * from offset. Blocks read whole are checked from buf, the ones at either end
+ * from what the block holds. Returns 0 if any of them is not what was written */
+static u_int8_t verify_range(meta_data *md, filename file_name, u_int64_t offset, const void *buf, u_int64_t len) {
+    const u_int8_t *p = buf;
+    u_int32_t bs = md->sb.block_size;
+    u_int64_t rel, n;
+    u_int32_t crc, blocks = 0;
+    span_iter it;
+    span sp;
+    block blk;
+    u_int8_t ok = 1;
+
+    span_start(&it, md, file_name, offset, len);
+    while (span_next(&it, &sp)) {
+        rel = sp.addr - md->sb.data_start;
+        for (u_int64_t done = 0; done < sp.len; done += n) {
+            blk = (rel + done) / bs;
+            n = bs - (rel + done) % bs;
+            if (n > sp.len - done) n = sp.len - done;
+
+            if (n == bs) crc = crc32c(0, p + done, bs);
+            else if (!block_crc(md, blk, &crc)) return 0;
+            blocks++;
+
+            if (crc != __atomic_load_n(&md->crcs[blk], __ATOMIC_RELAXED)) {
+                log_error("Checksum mismatch -> Block: %u; Filename: %u\n", blk, file_name);
+                stat_add(&md->stats.crc_errors, 1);
+                ok = 0;
+            }
+        }
+        p += sp.len;
+    }
+    stat_add(&md->stats.blocks_verified, blocks);
+    return ok;
+}
+
+/* Reads up to len bytes of a file at offset with the file locked and its
+ * block index filled in. A read too large to be worth caching, over half the
+ * cache, is gathered into one batch and what is missing from the cache is
+ * read straight into buf. The blocks read are checked against their checksums
+ * when that is turned on. Returns the number of bytes read or -1 */
+static int64_t read_inner(meta_data *md, filename file_name, u_int64_t offset, void *buf, u_int64_t len) {
+    u_int64_t done = 0;
+    u_int64_t limit;
+    span_iter it;
+    span sp;
+    dev_batch b;
+    u_int8_t ok = 1;
+
+    limit = md->cache != NULL ? (u_int64_t) md->cache->count / 2 * md->sb.block_size : md->sb.block_size;
+    if (len <= limit) {
+        span_start(&it, md, file_name, offset, len);
+        while (span_next(&it, &sp)) {
+            if (!data_read(md, sp.addr, (char *) buf + done, sp.len, NULL)) return -1;
+            done += sp.len;
+        }
+    } else {
+        dev_batch_init(&b);
+        span_start(&it, md, file_name, offset, len);
+        while (ok && span_next(&it, &sp)) {
+            ok = data_read(md, sp.addr, (char *) buf + done, sp.len, &b);
+            done += sp.len;
+        }
+        ok = dev_batch_run(md->dev, &b) && ok;
+        dev_batch_free(&b);
+        if (!ok) return -1;
+    }
+
+    if (md->verify && done > 0 && !verify_range(md, file_name, offset, buf, done)) return -1;
+
+    /* the next read is likely to carry on from here */
+    if (md->cache != NULL && len <= limit && done > 0) read_ahead(md, (sp.addr + sp.len - 1 - md->sb.data_start) / md->sb.block_size);
+    return done;
+}
+
+/* ---------------------------------------------------------------------------
+ * Compressed files, see frame_header in main.h for how they are stored. The
+ * frames are read and written through read_inner and write_inner like any
+ * other file data, so the cache, batches and checksums work the same for them.
+ * ------------------------------------------------------------------------- */
+
+/* Packs len bytes of file data, 1 to FRAME_SIZE, into a frame at out, which
+ * has room for FRAME_MAX bytes. The data is stored as it is when packing does
+ * not make it smaller. Returns the bytes of the frame */
+u_int32_t pack_frame(const void *raw, u_int32_t len, void *out) {
+    u_int8_t *p = out;
+    frame_header hdr;
+    u_int32_t packed;
+
+    packed = lz_compress(raw, len, p + sizeof(hdr), len - 1);
+    if (packed == 0) {
+        memcpy(p + sizeof(hdr), raw, len);
+        packed = len;
+    }
+    hdr.raw_len = len;
+    hdr.packed_len = packed;
+    memcpy(p, &hdr, sizeof(hdr));
+    return sizeof(hdr) + packed;
+}
+
+/* makes room for count frames in a frame map, returns 0 if out of memory */
+static u_int8_t frame_room(frame_map *fm, u_int32_t count) {
+    u_int32_t cap = fm->cap ? fm->cap : 4;
+    u_int32_t *grown;
+
+    if (count <= fm->cap) return 1;
+    while (cap < count) cap *= 2;
+    grown = realloc(fm->pos, cap * sizeof(u_int32_t));
+    if (grown == NULL) return 0;
+    fm->pos = grown;
+    fm->cap = cap;
+    return 1;
+}
+
+/* Returns where each frame of a compressed file starts, finding them from the
+ * frame headers if the map is not up to date. Every frame but the last has to
+ * be full and they have to add up to the length of the file. Returns NULL if
+ * they do not. Called with the file locked for writing */
+static frame_map *get_frames(meta_data *md, filename file_name) {
+    frame_map *fm = &md->frames[file_name];
+    dir_entry *de = &md->dir[file_name];
+    u_int64_t pos = 0;
+    u_int64_t raw = 0;
+    frame_header hdr;
+
+    if (fm->valid) return fm;
+
+    fm->count = 0;
+    while (pos < de->length) {
+        if (read_inner(md, file_name, pos, &hdr, sizeof(hdr)) != sizeof(hdr)) break;
+        if (hdr.raw_len == 0 || hdr.raw_len > FRAME_SIZE || hdr.packed_len > hdr.raw_len
+            || raw != (u_int64_t) fm->count * FRAME_SIZE || pos + sizeof(hdr) + hdr.packed_len > de->length) break;
+
+        if (!frame_room(fm, fm->count + 1)) {
+            log_error("Out of memory for frame map -> Filename: %u\n", file_name);
+            return NULL;
+        }
+        fm->pos[fm->count++] = pos;
+        raw += hdr.raw_len;
+        pos += sizeof(hdr) + hdr.packed_len;
+    }
+
+    if (pos != de->length || raw != de->logical) {
+        log_error("Compressed file damaged -> Filename: %u\n", file_name);
+        return NULL;
+    }
+    fm->valid = 1;
+    return fm;
+}
+
+/* Takes the read lock of a file with its block index filled in, and for a
+ * compressed file its frame map made, so readers sharing the lock never have
+ * to change them. A file open for reading has them already, one open for
+ * writing may have grown since. Returns 0 with the lock held if they can not
+ * be made */
+static u_int8_t lock_read(meta_data *md, filename file_name) {
+    extent_map *em = &md->extents[file_name];
+    u_int8_t zip;
+    u_int8_t ok = 1;
+
+    pthread_rwlock_rdlock(&md->locks[file_name]);
+    zip = (md->dir[file_name].flags & DE_COMPRESSED) != 0;
+    while (ok && (!em->valid || em->indexed < em->blocks || (zip && !md->frames[file_name].valid))) {
+        pthread_rwlock_unlock(&md->locks[file_name]);
+        pthread_rwlock_wrlock(&md->locks[file_name]);
+        ok = get_index(md, file_name) != NULL && (!zip || get_frames(md, file_name) != NULL);
+        pthread_rwlock_unlock(&md->locks[file_name]);
+        pthread_rwlock_rdlock(&md->locks[file_name]);
+    }
+    return ok;
+}
+
+/* Reads up to len bytes of a compressed file at offset, unpacking each frame
+ * the read touches. Called with the file locked and its frame map made.
+ * Returns the number of bytes read or -1 */
+static int64_t zread(meta_data *md, filename file_name, u_int64_t offset, void *buf, u_int64_t len) {
+    frame_map *fm = &md->frames[file_name];
+    dir_entry *de = &md->dir[file_name];
+    u_int64_t done = 0;
+    u_int64_t skip, n;
+    u_int32_t size;
+    frame_header hdr;
+    u_int8_t *frame, *raw;
+    const u_int8_t *src;
+
+    if (offset >= de->logical || len == 0) return 0;
+    if (len > de->logical - offset) len = de->logical - offset;
+
+    frame = malloc(FRAME_MAX + FRAME_SIZE);
+    if (frame == NULL) {
+        log_error("Out of memory for compressed read -> Filename: %u\n", file_name);
+        return -1;
+    }
+    raw = frame + FRAME_MAX;
+
+    for (u_int32_t f = offset / FRAME_SIZE; done < len && f < fm->count; f++) {
+        size = (f + 1 < fm->count ? fm->pos[f + 1] : de->length) - fm->pos[f];
+        if (read_inner(md, file_name, fm->pos[f], frame, size) != size) break;
+        memcpy(&hdr, frame, sizeof(hdr));
+
+        src = frame + sizeof(hdr);
+        if (hdr.packed_len != hdr.raw_len) {
+            if (!lz_decompress(src, hdr.packed_len, raw, hdr.raw_len)) {
+                log_error("Compressed file damaged -> Filename: %u; Frame: %u\n", file_name, f);
+                break;
+            }
+            src = raw;
+        }
+
+        skip = offset + done - (u_int64_t) f * FRAME_SIZE;
+        n = hdr.raw_len - skip;
+        if (n > len - done) n = len - done;
+        memcpy((char *) buf + done, src + skip, n);
+        done += n;
+    }
+    free(frame);
+    return done == len ? (int64_t) done : -1;
+}
+
+/* Cuts the data of a file down to len bytes as stored, giving back the blocks
+ * after the one holding the last of them. Called with the file locked for
+ * writing */
+static u_int8_t trim_file(meta_data *md, filename file_name, u_int32_t len) {
+    dir_entry *de = &md->dir[file_name];
+    u_int32_t keep = len / md->sb.block_size + (len % md->sb.block_size != 0);
+    extent_map *em;
+    block last;
+    block next;
+
+    if (len >= de->length) return 1;
+
+    if (keep == 0) {
+        free_blocks(md, de->startblock, chain_blocks(md, de->length));
+        de->startblock = FREE_BLOCK;
+    } else {
+        em = get_index(md, file_name);
+        if (em == NULL) return 0;
+        last = em->index[keep - 1];
+
+        pthread_mutex_lock(&md->alloc_lock);
+        next = md->fat[last];
+        if (next != END_BLOCK) {
+            set_fat(md, last, END_BLOCK);
+            defer_chain(md, next, chain_blocks(md, de->length) - keep);
+        }
+        pthread_mutex_unlock(&md->alloc_lock);
+    }
+
+    md->extents[file_name].valid = 0;
+    de->length = len;
+    mark_dirty(&md->dir_dirty, file_name);
+    return 1;
+}
+
+/* Writes len bytes at offset into a compressed file. The frames from the one
+ * holding offset, or the end of the file if that comes first, to the one
+ * holding the last byte written are unpacked, written over and packed again.
+ * When they pack to the size they had the frames after them are left where
+ * they are, otherwise those are moved along as they are and the file is cut
+ * if it got shorter. Called with the file locked for writing */
+static u_int8_t zwrite(meta_data *md, filename file_name, u_int64_t offset, const char *data, u_int64_t len) {
+    dir_entry *de = &md->dir[file_name];
+    u_int32_t bs = md->sb.block_size;
+    u_int64_t end = offset + len;
+    u_int64_t logical, first, raw_end, old_end;
+    u_int64_t base, tail, moved, stored, size;
+    u_int32_t f, last, count;
+    u_int32_t *pos;
+    u_int8_t *raw, *out;
+    frame_map *fm;
+    u_int8_t same;
+    u_int8_t ok;
+
+    if (len == 0) return 1;
+    if (end > 0xFFFFFFFF) {
+        log_error("File too long -> Filename %u\n", file_name);
+        return 0;
+    }
+    fm = get_frames(md, file_name);
+    if (fm == NULL) return 0;
+
+    /* the frames written to, anything between the end of the file and offset
+     * is zeros and goes in with them */
+    logical = de->logical;
+    first = (offset < logical ? offset : logical) / FRAME_SIZE;
+    last = (end - 1) / FRAME_SIZE;
+    raw_end = (u_int64_t) (last + 1) * FRAME_SIZE;
+    if (raw_end > (end > logical ? end : logical)) raw_end = end > logical ? end : logical;
+    old_end = logical < raw_end ? logical : raw_end;
+
+    base = first < fm->count ? fm->pos[first] : de->length;
+    tail = last + 1 < fm->count ? fm->pos[last + 1] : de->length;
+    moved = de->length - tail;
+    count = last + 1 > fm->count ? last + 1 : fm->count;
+
+    raw = calloc(1, raw_end - first * FRAME_SIZE);
+    out = malloc((last + 1 - first) * FRAME_MAX + moved);
+    pos = malloc((last + 1 - first) * sizeof(u_int32_t));
+    ok = raw != NULL && out != NULL && pos != NULL;
+    if (!ok) log_error("Out of memory for compressed write -> Filename: %u\n", file_name);
+
+    if (ok && old_end > first * FRAME_SIZE) {
+        ok = zread(md, file_name, first * FRAME_SIZE, raw, old_end - first * FRAME_SIZE) == (int64_t) (old_end - first * FRAME_SIZE);
+    }
+
+    stored = 0;
+    if (ok) {
+        memcpy(raw + (offset - first * FRAME_SIZE), data, len);
+        for (f = first; f <= last; f++) {
+            size = raw_end - (u_int64_t) f * FRAME_SIZE;
+            if (size > FRAME_SIZE) size = FRAME_SIZE;
+            pos[f - first] = base + stored;
+            stored += pack_frame(raw + (u_int64_t) (f - first) * FRAME_SIZE, size, out + stored);
+        }
+        stat_add(&md->stats.zip_in, raw_end - first * FRAME_SIZE);
+        stat_add(&md->stats.zip_out, stored);
+    }
+
+    /* frames packing to the size they had are written over in place, otherwise
+     * the ones after follow them and it all has to fit before anything is
+     * written over */
+    same = stored == tail - base;
+    if (ok && !same) {
+        if (base + stored + moved > 0xFFFFFFFF) {
+            log_error("File too long -> Filename %u\n", file_name);
+            ok = 0;
+        }
+        if (ok && moved > 0) ok = read_inner(md, file_name, tail, out + stored, moved) == (int64_t) moved;
+        size = (base + stored + moved + bs - 1) / bs;
+        if (ok && size > (de->length + bs - 1) / bs) ok = scan_blocks(md, (size - (de->length + bs - 1) / bs) * bs) != 0;
+    }
+
+    if (ok) {
+        fm->valid = 0;  // only right again once everything is written
+        ok = write_inner(md, file_name, base, (char *) out, same ? stored : stored + moved);
+        if (ok && !same) ok = trim_file(md, file_name, base + stored + moved);
+    }
+
+    if (ok) {
+        de->logical = end > logical ? end : logical;
+        mark_dirty(&md->dir_dirty, file_name);
+
+        /* moves the frames after along, a map that can not grow is made again
+         * from the headers the next time it is needed */
+        if (frame_room(fm, count)) {
+            for (f = last + 1; f < fm->count; f++) fm->pos[f] += stored - (tail - base);
+            memcpy(fm->pos + first, pos, (last + 1 - first) * sizeof(u_int32_t));
+            fm->count = count;
+            fm->valid = 1;
+        }
+    }
+
+    free(raw);
+    free(out);
+    free(pos);
+    return ok;
+}
+
+/* Cuts a compressed file down to len bytes of file data. The frames after the
+ * one holding the new end are dropped and that one is packed again with what
+ * it keeps. Called with the file locked for writing */
+static u_int8_t ztrim(meta_data *md, filename file_name, u_int64_t len) {
+    dir_entry *de = &md->dir[file_name];
+    u_int32_t f = len / FRAME_SIZE;
+    u_int32_t part = len % FRAME_SIZE;
+    u_int8_t *keep = NULL;
+    frame_map *fm;
+    u_int8_t ok = 1;
+
+    fm = get_frames(md, file_name);
+    if (fm == NULL) return 0;
+    if (len >= de->logical) return 1;
+
+    if (part > 0) {
+        keep = malloc(part);
+        if (keep == NULL) log_error("Out of memory for compressed write -> Filename: %u\n", file_name);
+        ok = keep != NULL && zread(md, file_name, (u_int64_t) f * FRAME_SIZE, keep, part) == part;
+    }
+
+    if (ok) ok = trim_file(md, file_name, fm->pos[f]);
+    if (ok) {
+        fm->count = f;
+        de->logical = (u_int64_t) f * FRAME_SIZE;
+        mark_dirty(&md->dir_dirty, file_name);
+        if (part > 0) ok = zwrite(md, file_name, de->logical, (char *) keep, part);
+    }
+    free(keep);
+    return ok;
+}
+
+/* Turns compression on or off for a file open for writing or appending. Only
+ * an empty file can be changed, as it is straight after open_for_write */
+u_int8_t set_compressed(meta_data *md, file_handle *h, u_int8_t on) {
+    dir_entry *de;
+    u_int8_t ok = 1;
+
+    if (!check_handle(md, h, 0)) return 0;
+    if (h->mode == READ) {
+        log_error("file is not open for writing -> Filename %u\n", h->file_name);
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&md->locks[h->file_name]);
+    de = &md->dir[h->file_name];
+    if (de->length > 0 || h->log_len > 0) {
+        log_error("Cannot change compression of a file holding data -> Filename %u\n", h->file_name);
+        ok = 0;
+    } else {
+        if (on) de->flags |= DE_COMPRESSED;
+        else de->flags &= ~DE_COMPRESSED;
+        de->logical = 0;
+        md->frames[h->file_name].valid = 0;
+        mark_dirty(&md->dir_dirty, h->file_name);
+    }
+    pthread_rwlock_unlock(&md->locks[h->file_name]);
+
+    /* log_append gathers a block for a plain file and a frame for a compressed one */
+    if (ok) {
+        free(h->log);
+        h->log = NULL;
+    }
+    return ok;
+}
+
+/* writes to any kind of file, called with it locked for writing */
+static u_int8_t write_data(meta_data *md, filename file_name, u_int64_t offset, const char *data, u_int64_t len) {
+    if (md->dir[file_name].flags & DE_COMPRESSED) return zwrite(md, file_name, offset, data, len);
+    return write_inner(md, file_name, offset, data, len);
+}
+
+/* appends to any kind of file, called with it locked for writing */
+static u_int8_t append_data(meta_data *md, filename file_name, const char data[], u_int32_t size) {
+    if (md->dir[file_name].flags & DE_COMPRESSED) return zwrite(md, file_name, md->dir[file_name].logical, data, size);
+    return append_now(md, file_name, data, size);
+}
+
+/* Writes data to a file at the current position, repeated calls carry on where
+ * the last one stopped */
+u_int8_t write_file(meta_data *md, file_handle *h, char data[], u_int32_t size) {
+    u_int64_t start = stat_start();
+    u_int8_t ok;
+
+    /* checks to see if file is open for writing */
+    if (!check_handle(md, h, WRITE)) return 0;
+
+    make_room(md, size);
+    pthread_rwlock_wrlock(&md->locks[h->file_name]);
+    ok = write_data(md, h->file_name, h->pos, data, size);
+    if (ok) h->pos += size;
+    pthread_rwlock_unlock(&md->locks[h->file_name]);
+
+    if (ok) stat_add(&md->stats.bytes_written, size);
+    stat_done(&md->stats, OP_WRITE, start);
+    return ok;
+}
+
+/* Writes len bytes of buf at offset in a file open for writing without moving
+ * the position of the handle. Returns the number of bytes written or -1 */
+int64_t write_at(meta_data *md, file_handle *h, u_int64_t offset, const void *buf, u_int64_t len) {
+    u_int64_t start = stat_start();
+    u_int8_t ok;
+
+    if (!check_handle(md, h, WRITE)) return -1;
+
+    /* the handle is the only writer, so the length can not change under it */
+    make_room(md, offset + len > file_length(md, h->file_name) ? offset + len - file_length(md, h->file_name) : len);
+    pthread_rwlock_wrlock(&md->locks[h->file_name]);
+    ok = write_data(md, h->file_name, offset, buf, len);
+    pthread_rwlock_unlock(&md->locks[h->file_name]);
+
+    if (ok) stat_add(&md->stats.bytes_written, len);
+    stat_done(&md->stats, OP_WRITE, start);
+    return ok ? (int64_t) len : -1;
+}
+
+/* Sets the length of a file open for writing. A file made longer reads as
+ * zeros past its old end. One made shorter keeps its chain up to the block
+ * holding the new end, the blocks after are freed with the next flush of the
+ * meta data, like those of a deleted file */
+u_int8_t truncate_file(meta_data *md, file_handle *h, u_int64_t len) {
+    u_int64_t start = stat_start();
     filename fn;
-    u_int8_t bl;
+    u_int8_t ok;
+
+    if (!check_handle(md, h, WRITE)) return 0;
+    if (len > 0xFFFFFFFF) {
+        log_error("File too long -> Filename %u\n", h->file_name);
+        return 0;
+    }
 
-    printf("Directory entry size -> %ld\n", sizeof(dir_entry));
-    printf("Meta Data size       -> %ld\n", sizeof(meta_data));
+    fn = h->file_name;
+    if (len > file_length(md, fn)) make_room(md, len - file_length(md, fn));
+    pthread_rwlock_wrlock(&md->locks[fn]);
+    if (len > file_length(md, fn)) ok = write_data(md, fn, len - 1, "", 1);
+    else if (md->dir[fn].flags & DE_COMPRESSED) ok = ztrim(md, fn, len);
+    else ok = trim_file(md, fn, len);
+    pthread_rwlock_unlock(&md->locks[fn]);
 
-    f = fopen(PATH, "rb+");
+    stat_done(&md->stats, OP_WRITE, start);
+    return ok;
+}
 
-    /* Load in meta data and set pointer to start of file*/
-    fread(md, sizeof(meta_data), 1, f);
-    fseek(f, 0, SEEK_SET);
+/* Reads up to len bytes of a file starting at offset into buf. Each extent is
+ * copied straight from the device in one go. A file open for writing can be
+ * read back too. Returns the number of bytes read, 0 at the end of the file
+ * or -1 on error */
+int64_t read_at(meta_data *md, file_handle *h, u_int64_t offset, void *buf, u_int64_t len) {
+    u_int64_t start = stat_start();
+    int64_t done;
+
+    if (!check_handle(md, h, 0)) return -1;
+    if (h->mode == APPEND) {
+        log_error("file is not open for reading -> Filename %u\n", h->file_name);
+        return -1;
+    }
 
-    /* Check to see if storage is in correct format */
-    if (FS_VERSION != md->version) {
+    if (!lock_read(md, h->file_name)) done = -1;
+    else if (md->dir[h->file_name].flags & DE_COMPRESSED) done = zread(md, h->file_name, offset, buf, len);
+    else done = read_inner(md, h->file_name, offset, buf, len);
+    pthread_rwlock_unlock(&md->locks[h->file_name]);
 
-        /* set pointers in queue */
-        md->queue.front = -1;
-        md->queue.rear = -1;
+    if (done > 0) stat_add(&md->stats.bytes_read, done);
+    stat_done(&md->stats, OP_READ, start);
+    return done;
+}
 
-        printf("Invalid file system %x not recognised\n", md->version);
-        printf("Reformatting to correct file system -> %x\n", FS_VERSION);
+/* Same as read_at but fills each buffer in iov in turn */
+int64_t read_vec(meta_data *md, file_handle *h, u_int64_t offset, const io_vec *iov, u_int32_t iovcnt) {
+    u_int64_t done = 0;
+    int64_t n;
 
-        /* Initialise blank filesystems metadata */
-        md->version = FS_VERSION;
+    for (u_int32_t i = 0; i < iovcnt; i++) {
+        n = read_at(md, h, offset + done, iov[i].base, iov[i].len);
+        if (n < 0) return done ? (int64_t) done : -1;
+        done += n;
+        if ((u_int64_t) n < iov[i].len) break; // end of file
+    }
+    return done;
+}
 
-        /* Set directory meta to blank */
-        for (fn = 0; fn < MAX_FILES; fn++) {
-            md->dir[fn].startblock = FREE_BLOCK;
-            md->dir[fn].length = 0;
-            md->dir[fn].currpos = 0;
-            md->dir[fn].status = CLOSED_FILE;
-        }
+/* reads the next size bytes of a file into data from the position of the
+ * handle. Returns the number of bytes read, 0 at the end of the file */
+u_int32_t read_file(meta_data *md, file_handle *h, char data[], u_int32_t size) {
+    int64_t n;
 
-        /* Set File Allocation Tables to free and push all blocks to queue */
-        for (bl = 0; bl < TOTAL_BLOCKS; bl++) {
-            md->fat[bl] = FREE_BLOCK;
-            enQueue(md, bl);
-        }
+    n = read_at(md, h, h->pos, data, size);
+    if (n <= 0) return 0;
 
-        fwrite(md, sizeof(meta_data), 1, f);
-    } else {
-        printf("File System found v.%u\n", md->version);
+    h->pos += n;
+    return n;
+}
 
-        /* Set all files to closed */
-        for (fn = 0; fn < MAX_FILES; fn++) {
-            md->dir[fn].currpos = 0;
-            md->dir[fn].status = CLOSED_FILE;
+/* appends data to the end of the file */
+u_int8_t append_file(meta_data *md, file_handle *h, char data[], u_int32_t size) {
+    u_int64_t start = stat_start();
+    u_int8_t ok;
 
-            /* Print files that are currently in storage */
-            if (md->dir[fn].startblock != FREE_BLOCK)
-                printf("Found file -> %x; length -> %x\n", fn, md->dir[fn].length);
-        }
-    }
-    display(md);
-    fclose(f);
-}
+    /* checks to see if file is open for appending */
+    if (!check_handle(md, h, APPEND)) return 0;
 
-/* checks to see if there are enough free blocks and returns number of blocks needed */
-u_int8_t scan_blocks(meta_data *md, u_int16_t file_size) {
+    make_room(md, size);
+    pthread_rwlock_wrlock(&md->locks[h->file_name]);
+    ok = append_data(md, h->file_name, data, size);
+    pthread_rwlock_unlock(&md->locks[h->file_name]);
 
-    u_int16_t as;           // available space
-    u_int8_t blks;          // number of blocks needed
+    if (ok) stat_add(&md->stats.bytes_written, size);
+    stat_done(&md->stats, OP_APPEND, start);
+    return ok;
+}
 
-    /* checks to see if file_size exceeds total storage capacity */
-    if (file_size > EEPROM_LEN) {
-        printf("ERROR File is too big for storage device ->          File: %dbytes\n", file_size);
-        printf("                                            Storage Space: %dbytes\n", EEPROM_LEN);
-        return 0;
-    } else {
-        /* checks to see if file size exceeds available free space */
-        as = availableBlocks(md) * BLOCK_SIZE; // available space
-        if (file_size > as) {
-            printf("ERROR Not enough block space ->        File: %dbytes\n", file_size);
-            printf("                                Block Space: %dbytes\n", as);
+/* Appends data through a buffer of one block kept with the handle. Short
+ * appends are gathered until they reach the end of the last block of the file
+ * and then written together, so a log made of many small records costs one
+ * device write per block rather than one per record. Whole blocks are written
+ * straight from data. What is left in the buffer is written by log_flush or
+ * when the handle is closed. A compressed file gathers a frame rather than a
+ * block, so each frame is packed once */
+u_int8_t log_append(meta_data *md, file_handle *h, const char data[], u_int32_t size) {
+    u_int64_t start = stat_start();
+    u_int32_t total = size;
+    u_int32_t room;         // bytes to the end of the block the file has reached
+    u_int32_t unit;         // bytes gathered before a write, a block or a frame
+    u_int32_t n;
+    filename file_name;
+    u_int8_t ok = 1;
+
+    if (!check_handle(md, h, APPEND)) return 0;
+
+    /* set_compressed frees the buffer so it can only change while there is none */
+    unit = md->dir[h->file_name].flags & DE_COMPRESSED ? FRAME_SIZE : md->sb.block_size;
+    if (h->log == NULL) {
+        h->log = malloc(unit);
+        h->log_len = 0;
+        if (h->log == NULL) {
+            log_error("Out of memory for log buffer\n");
             return 0;
-        } else {
-            /* returns number of blocks needed */
-            blks = (file_size / BLOCK_SIZE + (file_size % BLOCK_SIZE != 0));
-            printf("Blocks needed for file -> No Blocks -> %d\n", blks);
-            return blks;
         }
     }
-}
 
-/* Frees up blocks used by file */
-void free_blocks(meta_data *md, u_int8_t start) {
-    u_int8_t bl;
-    u_int8_t next;
+    file_name = h->file_name;
+    make_room(md, h->log_len + size);
+    pthread_rwlock_wrlock(&md->locks[file_name]);
+    while (ok && size > 0) {
+        room = unit - (file_length(md, file_name) + h->log_len) % unit;
 
-    if (md->fat[start] == FREE_BLOCK) printf("ERROR Free block found in chain -> Block: %d\n", start);
+        if (h->log_len == 0 && size >= room) {
+            /* up to the end of the last block and any whole blocks after it */
+            n = room + (size - room) / unit * unit;
+            ok = append_data(md, file_name, data, n);
+        } else {
+            n = size < room ? size : room;
+            memcpy(h->log + h->log_len, data, n);
+            h->log_len += n;
+            if (n == room) {
+                ok = append_data(md, file_name, h->log, h->log_len);
+                h->log_len = 0;
+            }
+        }
+        data += n;
+        size -= n;
+    }
+    pthread_rwlock_unlock(&md->locks[file_name]);
 
-    bl = md->fat[start];
+    if (ok) stat_add(&md->stats.bytes_written, total);
+    stat_done(&md->stats, OP_APPEND, start);
+    return ok;
+}
 
-    /* frees up blocks in chain and adds the to queue */
+/* writes out anything log_append is holding */
+u_int8_t log_flush(meta_data *md, file_handle *h) {
+    u_int8_t ok = 1;
 
-    do {
-        if (bl == FREE_BLOCK) {
-            printf("ERROR Free block found in chain -> Block: %d\n", bl);
-            break;
-        }
-        if (bl == END_BLOCK) {
-            enQueue(md, bl);
-            break;
-        }
-        else {
-            next = md->fat[bl];
-            md->fat[bl] = FREE_BLOCK;
-            bl = next;
-            enQueue(md, bl);
-        }
-    } while (bl != END_BLOCK);
+    if (!check_handle(md, h, APPEND)) return 0;
+    if (h->log_len == 0) return 1;
 
+    make_room(md, h->log_len);
+    pthread_rwlock_wrlock(&md->locks[h->file_name]);
+    ok = append_data(md, h->file_name, h->log, h->log_len);
+    h->log_len = 0;
+    pthread_rwlock_unlock(&md->locks[h->file_name]);
+    return ok;
 }
 
-/* Opens a file to be read */
-FILE *open_for_read(meta_data *md, u_int8_t file_name) {
+/* closes a file, the handle can not be used after this even when 0 is returned
+ * because what log_append gathered or the meta data could not be written */
+u_int8_t close_file(meta_data *md, file_handle *h) {
+    u_int64_t start = stat_start();
+    open_file *of;
+    u_int8_t ok = 1;
 
-    FILE *f;
-
-    /* Checks to see if file is closed */
-    if (md->dir[file_name].status != CLOSED_FILE) {
-        printf("ERROR File all ready open -> Filename: %d\n", file_name);
+    if (h == NULL || h < md->handles || h >= md->handles + MAX_HANDLES || h->mode == CLOSED_FILE) {
+        log_error("Cannot close file as it is all ready closed\n");
         return 0;
     }
 
-    md->dir[file_name].currpos = 0; // sets the current file position to 0
-    md->dir[file_name].status = READ; // sets the current file status to read
+    /* anything still gathered by log_append goes out first */
+    if (h->log != NULL) {
+        ok = log_flush(md, h);
+        free(h->log);
+        h->log = NULL;
+    }
 
-    f = fopen(PATH, "rb");
+    pthread_mutex_lock(&md->open_lock);
+    of = &md->opens[h->file_name];
+    if (h->mode == READ) of->readers--;
+    else of->writer = 0;
 
-    fseek(f, 0, SEEK_SET);
+    h->mode = CLOSED_FILE; // frees the slot in the open file table
+    pthread_mutex_unlock(&md->open_lock);
 
-    return f;
-}
+    /* simulates writing to EEPROM, batched with other changes */
+    ok = commit_meta(md) && ok;
 
-/* Opens a file to append */
-FILE *open_for_append(meta_data *md, u_int8_t file_name) {
+    stat_done(&md->stats, OP_CLOSE, start);
+    return ok;
+}
 
-    FILE *f;
+/* Lets go of an entry held as if open for writing. Entries are held this way
+ * while their lock is taken, as that can not be done holding open_lock */
+static void release_entry(meta_data *md, filename file_name) {
+    pthread_mutex_lock(&md->open_lock);
+    md->opens[file_name].writer = 0;
+    pthread_mutex_unlock(&md->open_lock);
+}
 
-    /* Checks to see if the file is closed */
-    if (md->dir[file_name].status != CLOSED_FILE) {
-        printf("ERROR File all ready open -> Filename: %d\n", file_name);
-        return 0;
+/* Gives back the blocks of a held file and clears its entry so it can be used
+ * again */
+static void free_entry(meta_data *md, filename file_name) {
+    pthread_rwlock_wrlock(&md->locks[file_name]);
+    if (md->dir[file_name].startblock != FREE_BLOCK) {
+        free_blocks(md, md->dir[file_name].startblock, chain_blocks(md, md->dir[file_name].length));
     }
+    md->extents[file_name].valid = 0;
+    md->frames[file_name].valid = 0;
 
-    /* checks to see if there are blocks available */
-    if (isEmpty(md)) {
-        printf("ERROR out of storage space\n");
-        return 0;
-    } else {
-        md->dir[file_name].currpos = 0; // Sets current file pointer to 0
-        md->dir[file_name].status = APPEND; // Sets current file status to APPEND
-        f = fopen(PATH, "rb+");
-        fseek(f, 0, SEEK_SET);
-        return f;
-    }
+    /* initialise directory*/
+    md->dir[file_name].startblock = FREE_BLOCK;
+    md->dir[file_name].length = 0;
+    md->dir[file_name].flags = 0;
+    md->dir[file_name].parent = NO_FILE;
+    md->dir[file_name].logical = 0;
+    mark_dirty(&md->dir_dirty, file_name);
+    pthread_rwlock_unlock(&md->locks[file_name]);
+
+    release_entry(md, file_name);
 }
 
-/* opens a file for writing */
-FILE *open_for_write(meta_data *md, u_int8_t file_name) {
+/* deletes a file */
+u_int8_t delete_file(meta_data *md, filename file_name) {
+    u_int64_t t = stat_start();
+    block start;
 
-    FILE *f;
+    if (file_name >= md->sb.max_files) {
+        log_error("File name exceeds max file limit\n");
+        return 0;
+    }
 
-    /* checks to see if file name is within total files allowed */
-    if (file_name >= MAX_FILES) {
-        printf("ERROR File name exceeds max file limit\n");
+    /* holding the open table stops the file being opened while it goes */
+    pthread_mutex_lock(&md->open_lock);
+    if (md->opens[file_name].readers > 0 || md->opens[file_name].writer) {
+        pthread_mutex_unlock(&md->open_lock);
+        log_error("cannot delete as file is open -> Filename: %u\n", file_name);
         return 0;
     }
 
-    /* checks to see if file is open */
-    if (md->dir[file_name].status != CLOSED_FILE) {
-        printf("ERROR File all ready open -> Filename: %d\n", file_name);
+    /* the name would be left pointing at nothing */
+    if (md->dir[file_name].flags & DE_NAMED) {
+        pthread_mutex_unlock(&md->open_lock);
+        log_error("cannot delete a file with a name, use remove_path -> Filename: %u\n", file_name);
         return 0;
     }
-    /* Checks to see if the start block is a FREE BLOCk if not then frees blocks in fat chain */
-    else if (md->dir[file_name].startblock != FREE_BLOCK) {
-        printf("Overwriting file -> Filename: %d\n", file_name);
-        free_blocks(md, md->dir[file_name].startblock);
+
+    /* nobody has the file open so nothing is changing it */
+    start = md->dir[file_name].startblock;
+    if (start == FREE_BLOCK) {
+        pthread_mutex_unlock(&md->open_lock);
+        log_error("cannot delete as file does not exist -> Filename: %u\n", file_name);
+        return 0;
     }
+    md->opens[file_name].writer = 1;
+    pthread_mutex_unlock(&md->open_lock);
 
-    md->dir[file_name].length = 0;
+    free_entry(md, file_name);
 
-    if (isEmpty(md)) {
-        printf("ERROR out of storage space\n");
-        return 0;
-    } else {
-        md->dir[file_name].currpos = 0;
-        md->dir[file_name].status = WRITE;
-        f = fopen(PATH, "rb+");
-        fseek(f, 0, SEEK_SET);
+    /* simulates writing to EEPROM, batched with other changes */
+    commit_meta(md);
+
+    log_info("File deleted -> Filename: %u\n", file_name);
+
+    stat_done(&md->stats, OP_DELETE, t);
+    return 1;
+}
 
-        return f;
+/* ---------------------------------------------------------------------------
+ * Names and directories, see dir_header in main.h for how a directory is laid
+ * out. Adding or removing a name holds name_lock so only one happens at a
+ * time, looking a name up only takes the lock of the directory. Locks are
+ * taken from a directory down to the files in it and the open file table is
+ * only locked after the lock of a directory, never before.
+ * ------------------------------------------------------------------------- */
+
+/* FNV-1a hash of a name */
+static u_int32_t name_hash(const char *name, u_int32_t len) {
+    u_int32_t hash = 2166136261u;
+
+    for (u_int32_t i = 0; i < len; i++) {
+        hash ^= (u_int8_t) name[i];
+        hash *= 16777619u;
     }
+    return hash;
 }
 
-/* writes data to a file */
-u_int8_t write(meta_data *md, u_int8_t file_name, char data[], u_int16_t size, FILE *f) {
+/* offset of a record in a directory */
+static u_int64_t rec_off(u_int32_t slot) {
+    return sizeof(dir_header) + (u_int64_t) slot * sizeof(dir_record);
+}
 
-    u_int8_t blocks_needed;
-    u_int16_t pointer;
-    u_int8_t blk;
-    u_int8_t next;
-    int8_t buffs;
+/* 1 if a record holds a name, one whose length is past NAME_LEN is damaged
+ * and is passed over like a free one */
+static u_int8_t rec_named(const dir_record *rec) {
+    return (rec->type == REC_FILE || rec->type == REC_DIR) && rec->name_len <= NAME_LEN;
+}
 
-    /* checks to see if file name is valid and does not exceed max number of files */
-    if (file_name >= MAX_FILES) {
-        printf("ERROR File name exceeds max file limit\n");
-        return 0;
+/* Takes the read lock of a file with its block index filled in, so readers
+ * sharing the lock never have to change it */
+static void lock_indexed(meta_data *md, filename fn) {
+    extent_map *em = &md->extents[fn];
+    u_int8_t ok;
+
+    pthread_rwlock_rdlock(&md->locks[fn]);
+    while (!em->valid || em->indexed < em->blocks) {
+        pthread_rwlock_unlock(&md->locks[fn]);
+        pthread_rwlock_wrlock(&md->locks[fn]);
+        ok = get_index(md, fn) != NULL;
+        pthread_rwlock_unlock(&md->locks[fn]);
+        pthread_rwlock_rdlock(&md->locks[fn]);
+        if (!ok) break;
     }
+}
 
-    /* checks to see if file is open for writing */
-    if (md->dir[file_name].status != WRITE) {
-        printf("ERROR file is not open for writing -> Filename %d\n", file_name);
+/* reads the header of a directory, which is locked */
+static u_int8_t read_header(meta_data *md, filename dir, dir_header *hdr) {
+    if (read_inner(md, dir, 0, hdr, sizeof(dir_header)) != sizeof(dir_header)
+        || hdr->magic != DIR_MAGIC || hdr->slots == 0 || (hdr->slots & (hdr->slots - 1)) != 0) {
+        log_error("Directory damaged -> Filename: %u\n", dir);
         return 0;
     }
+    return 1;
+}
 
-    md->dir[file_name].length = size; // sets filename length
-    blocks_needed = scan_blocks(md, md->dir[file_name].length); // gets the number of blocks needed to write to the file
-    if (blocks_needed == 0) return 0; // if there are no blocks returns 0
-    else {
-        blk = deQueue(md); // gets next available block from queue
-        md->dir[file_name].startblock = blk; // sets file start block
-
-        // loops through the number of blocks needed and writes data to file
-        for (int i = 0; i < blocks_needed; i++) {
-
-            pointer = EEPROM_START + sizeof(meta_data) + blk * BLOCK_SIZE; // sets the pointer to the block position
-
-            printf("Used block -> %d\n", blk);
-            printf("At memory address -> %x\n", pointer);
-            fseek(f, pointer, SEEK_SET);
-
-            /* writes to the file in stages of BUFFER SIZE */
-            buffs = ((size- 1)/BUFFER_SIZE)+1;
-            for (int j = 0; j < buffs; j++) {
-                char buff[BUFFER_SIZE];
-                if (size >= BUFFER_SIZE) {
-                    for (u_int8_t k = 0; k < BUFFER_SIZE; k++) {
-                        buff[k] = data[(j)*BUFFER_SIZE + k]; //
-                    }
-                    size -= 8;
-                    md->dir[blk].currpos += BUFFER_SIZE;
-                    fwrite(&buff, BUFFER_SIZE, 1, f);
-
-                } else {
-                    for (u_int8_t k = 0 ; k < size ; k++) {
-                        buff[k] = data[(j)*BUFFER_SIZE + k];
-                    }
-                    md->dir[blk].currpos += size;
-                    fwrite(&buff, size, 1, f);
-                }
-            }
-            /* if the file needs more than one block then grab the next block available else set fat to END BLOCK*/
-            if (i < blocks_needed -1) {
-                next = deQueue(md);
-                md->fat[blk] = next; // sets the block in the fat chain to the next available block
-                blk = next;
-            } else {
-                md->fat[blk] = END_BLOCK;
-                return 1;
-            }
+static u_int8_t write_header(meta_data *md, filename dir, const dir_header *hdr) {
+    return write_inner(md, dir, 0, (const char *) hdr, sizeof(dir_header));
+}
+
+/* Looks for a name in a locked directory. Returns 1 and fills in rec if it is
+ * there. *slot is set to the record holding the name, or if it is not there to
+ * the record it should go in (NO_FILE if the table could not be read) */
+static u_int8_t dir_find(meta_data *md, filename dir, const dir_header *hdr, const char *name, u_int32_t len,
+                         u_int32_t *slot, dir_record *rec) {
+    u_int32_t hash = name_hash(name, len);
+    u_int32_t free_slot = NO_FILE;
+    u_int32_t pos;
+
+    for (u_int32_t i = 0; i < hdr->slots; i++) {
+        pos = (hash + i) & (hdr->slots - 1);
+        if (read_inner(md, dir, rec_off(pos), rec, sizeof(dir_record)) != sizeof(dir_record)) break;
+
+        if (rec->type == REC_FREE) {
+            *slot = free_slot != NO_FILE ? free_slot : pos;
+            return 0;
+        }
+        if (rec->type == REC_DELETED) {
+            if (free_slot == NO_FILE) free_slot = pos;
+        } else if (rec_named(rec) && rec->hash == hash && rec->name_len == len
+                   && memcmp(rec->name, name, len) == 0) {
+            *slot = pos;
+            return 1;
         }
     }
+    *slot = free_slot;
     return 0;
 }
 
-/* reads a file from storage and prints contents to terminal*/
-u_int8_t read(meta_data *md, u_int8_t file_name, FILE *f, char *data[]) {
+/* Writes a table of slots records holding the count records in recs to the
+ * start of a directory and sets *hdr to match. Called with the directory
+ * locked for writing */
+static u_int8_t dir_build(meta_data *md, filename dir, const dir_record *recs, u_int32_t count, u_int32_t slots,
+                          dir_header *hdr) {
+    u_int64_t size = rec_off(slots);
+    dir_record *table;
+    u_int8_t *image;
+    u_int32_t pos;
+    u_int8_t ok;
+
+    image = calloc(1, size);
+    if (image == NULL) {
+        log_error("Out of memory for directory -> Filename: %u\n", dir);
+        return 0;
+    }
+
+    memset(hdr, 0, sizeof(dir_header));
+    hdr->magic = DIR_MAGIC;
+    hdr->slots = slots;
+    hdr->used = count;
+    memcpy(image, hdr, sizeof(dir_header));
+
+    table = (dir_record *) (image + sizeof(dir_header));
+    for (u_int32_t i = 0; i < count; i++) {
+        pos = recs[i].hash & (slots - 1);
+        while (table[pos].type != REC_FREE) pos = (pos + 1) & (slots - 1);
+        table[pos] = recs[i];
+    }
 
-    u_int16_t char_cnt;
-    u_int16_t pointer;
-    u_int8_t blk;
-    u_int8_t next;
+    ok = write_inner(md, dir, 0, (const char *) image, size);
+    free(image);
+    return ok;
+}
 
-    /* checks to see if file name is valid and does not exceed max number of files */
-    if (file_name >= MAX_FILES) {
-        printf("ERROR File name exceeds max file limit\n");
+/* Builds the table of a directory again without its deleted records, doubling
+ * it until it is no more than half full with more names in it */
+static u_int8_t dir_grow(meta_data *md, filename dir, dir_header *hdr, u_int32_t more) {
+    u_int64_t size = (u_int64_t) hdr->slots * sizeof(dir_record);
+    u_int32_t slots = hdr->slots;
+    u_int32_t count = 0;
+    dir_record *recs;
+    u_int8_t ok;
+
+    recs = malloc(size);
+    if (recs == NULL) {
+        log_error("Out of memory for directory -> Filename: %u\n", dir);
+        return 0;
+    }
+    if (read_inner(md, dir, rec_off(0), recs, size) != (int64_t) size) {
+        free(recs);
         return 0;
     }
 
-    /* checks to see if file is open for reading */
-    if (md->dir[file_name].status != READ) {
-        printf("ERROR file is not open for reading -> Filename %d\n", file_name);
+    /* keeps the names, dropping free, deleted and damaged records */
+    for (u_int32_t i = 0; i < hdr->slots; i++) {
+        if (rec_named(&recs[i])) recs[count++] = recs[i];
+    }
+
+    /* the names are counted rather than trusting the header, see rebuild_dir */
+    while ((u_int64_t) (count + more) * 2 > slots) slots *= 2;
+
+    ok = dir_build(md, dir, recs, count, slots, hdr);
+    free(recs);
+    return ok;
+}
+
+/* Adds a name for file_name to a directory locked for writing */
+static u_int8_t dir_add(meta_data *md, filename dir, const char *name, u_int32_t len, filename file_name, u_int8_t type) {
+    dir_header hdr;
+    dir_record rec;
+    u_int32_t slot;
+
+    if (!read_header(md, dir, &hdr)) return 0;
+    if (dir_find(md, dir, &hdr, name, len, &slot, &rec)) {
+        log_error("Name all ready exists -> Name: %.*s\n", (int) len, name);
         return 0;
     }
 
-    blk = md->dir[file_name].startblock;
-    pointer = EEPROM_START + sizeof(meta_data) + BLOCK_SIZE*blk;
+    /* deleted records count as used, they make the probes longer all the same */
+    if ((u_int64_t) (hdr.used + hdr.deleted + 1) * 4 > (u_int64_t) hdr.slots * 3) {
+        if (!dir_grow(md, dir, &hdr, 1)) return 0;
+        dir_find(md, dir, &hdr, name, len, &slot, &rec);
+    }
+    if (slot == NO_FILE) return 0;
+
+    /* a deleted record is taken over */
+    if (read_inner(md, dir, rec_off(slot), &rec, sizeof(dir_record)) != sizeof(dir_record)) return 0;
+    if (rec.type == REC_DELETED) hdr.deleted--;
 
-    fseek(f, pointer, SEEK_SET);
+    memset(&rec, 0, sizeof(dir_record));
+    rec.hash = name_hash(name, len);
+    rec.file_name = file_name;
+    rec.type = type;
+    rec.name_len = len;
+    memcpy(rec.name, name, len);
 
-    /* loop to read file contents */
-    while (md->dir[file_name].currpos < md->dir[file_name].length) {
+    hdr.used++;
+    return write_inner(md, dir, rec_off(slot), (const char *) &rec, sizeof(dir_record)) && write_header(md, dir, &hdr);
+}
 
-        /* determines the size of data to read based on how much is left to read of the file*/
-        if (md->dir[file_name].length - md->dir[file_name].currpos > BLOCK_SIZE) {
-            char_cnt = BLOCK_SIZE;
-        } else {
-            char_cnt = md->dir[file_name].length - md->dir[file_name].currpos;
-        }
+/* Marks the record in slot of a directory locked for writing as deleted */
+static u_int8_t dir_del(meta_data *md, filename dir, dir_header *hdr, u_int32_t slot) {
+    dir_record rec;
+
+    memset(&rec, 0, sizeof(dir_record));
+    rec.type = REC_DELETED;
+
+    hdr->used--;
+    hdr->deleted++;
+    return write_inner(md, dir, rec_off(slot), (const char *) &rec, sizeof(dir_record)) && write_header(md, dir, hdr);
+}
+
+/* Looks a name up in a directory. Returns 1 and fills in rec if it is there */
+static u_int8_t lookup(meta_data *md, filename dir, const char *name, u_int32_t len, dir_record *rec) {
+    dir_header hdr;
+    u_int32_t slot;
+    u_int8_t found = 0;
 
-        char buff[char_cnt]; // array used to read contents
+    lock_indexed(md, dir);
+    if (read_header(md, dir, &hdr)) found = dir_find(md, dir, &hdr, name, len, &slot, rec);
+    pthread_rwlock_unlock(&md->locks[dir]);
+    return found;
+}
+
+/* Takes an unused entry for a new file or directory, looking down from where
+ * the last search stopped so named files fill the table from the top. A
+ * parent of NO_FILE makes the entry its own parent. The entry is returned
+ * held, see release_entry. Returns NO_FILE if every entry is in use */
+static filename alloc_entry(meta_data *md, u_int32_t flags, filename parent) {
+    filename fn = NO_FILE;
+    filename cand;
+
+    pthread_mutex_lock(&md->open_lock);
+    for (u_int32_t i = 0; i < md->sb.max_files; i++) {
+        cand = md->next_entry;
+        md->next_entry = cand == 0 ? md->sb.max_files - 1 : cand - 1;
+
+        /* nobody has it open so nothing is changing it */
+        if (md->opens[cand].readers > 0 || md->opens[cand].writer) continue;
+        if (md->dir[cand].flags != 0 || md->dir[cand].startblock != FREE_BLOCK) continue;
+
+        md->opens[cand].writer = 1;
+        fn = cand;
+        break;
+    }
+    pthread_mutex_unlock(&md->open_lock);
+
+    if (fn == NO_FILE) {
+        log_error("No free directory entries -> Max: %u\n", md->sb.max_files);
+        return NO_FILE;
+    }
+
+    pthread_rwlock_wrlock(&md->locks[fn]);
+    md->dir[fn].length = 0;
+    md->dir[fn].flags = flags;
+    md->dir[fn].parent = parent == NO_FILE ? fn : parent;
+    md->dir[fn].logical = 0;
+    mark_dirty(&md->dir_dirty, fn);
+    pthread_rwlock_unlock(&md->locks[fn]);
+    return fn;
+}
+
+/* Makes an empty file or directory called name in dir. Returns its entry or
+ * NO_FILE. Called with name_lock held */
+static filename create_name(meta_data *md, filename dir, const char *name, u_int32_t len, u_int8_t type) {
+    dir_header hdr;
+    filename fn;
+    u_int8_t ok = 1;
+
+    fn = alloc_entry(md, DE_NAMED | (type == REC_DIR ? DE_DIR : 0), dir);
+    if (fn == NO_FILE) return NO_FILE;
+
+    if (type == REC_DIR) {
+        pthread_rwlock_wrlock(&md->locks[fn]);
+        ok = dir_build(md, fn, NULL, 0, DIR_INIT_SLOTS, &hdr);
+        pthread_rwlock_unlock(&md->locks[fn]);
+    }
+
+    if (ok) {
+        pthread_rwlock_wrlock(&md->locks[dir]);
+        ok = dir_add(md, dir, name, len, fn, type);
+        pthread_rwlock_unlock(&md->locks[dir]);
+    }
+
+    if (!ok) {
+        free_entry(md, fn);
+        return NO_FILE;
+    }
+    release_entry(md, fn);
+    return fn;
+}
 
-        /* reads data and prints it to terminal based on current position in file */
-        if (md->dir[file_name].currpos < md->dir[file_name].length) {
+/* Finds the root directory, making it the first time a path is used */
+static u_int8_t get_root(meta_data *md, filename *root) {
+    dir_header hdr;
+    filename fn;
+    u_int8_t ok;
 
-            fread(&buff, char_cnt, 1, f);
-            md->dir[file_name].currpos += BLOCK_SIZE;
-            printf("\nFile contents ->");
-            for (int i = 0 ; i < char_cnt ; i ++) printf("%c", buff[i]);
-            printf("\n");
+    fn = __atomic_load_n(&md->root, __ATOMIC_ACQUIRE);
+    if (fn != NO_FILE) {
+        *root = fn;
+        return 1;
+    }
 
-            /* if the current block is not the last block get the next block to read from */
-            if (md->fat[blk] != END_BLOCK) {
-                next = md->fat[blk];
-                blk = next;
-                pointer = EEPROM_START + sizeof(meta_data) + BLOCK_SIZE*blk;
-                fseek(f, pointer, SEEK_SET);
+    pthread_mutex_lock(&md->name_lock);
+    fn = md->root;
+    if (fn == NO_FILE) {
+        fn = alloc_entry(md, DE_NAMED | DE_DIR | DE_ROOT, NO_FILE);
+        if (fn != NO_FILE) {
+            pthread_rwlock_wrlock(&md->locks[fn]);
+            ok = dir_build(md, fn, NULL, 0, DIR_INIT_SLOTS, &hdr);
+            pthread_rwlock_unlock(&md->locks[fn]);
+
+            if (ok) {
+                release_entry(md, fn);
+                __atomic_store_n(&md->root, fn, __ATOMIC_RELEASE);
             } else {
-                return 1;
+                free_entry(md, fn);
+                fn = NO_FILE;
             }
         }
     }
-    return 0;
+    pthread_mutex_unlock(&md->name_lock);
+
+    *root = fn;
+    return fn != NO_FILE;
 }
 
-/* appends data to the end of the file */
-u_int8_t append(meta_data *md, u_int8_t file_name, char data[], u_int16_t size, FILE *f){
+/* Splits the next name off the front of path. Returns its length, 0 when
+ * there are no names left */
+static u_int32_t next_name(const char **path, const char **name) {
+    while (**path == '/') (*path)++;
+    *name = *path;
+    while (**path != '\0' && **path != '/') (*path)++;
+    return *path - *name;
+}
 
-    u_int8_t no_blks;
-    u_int8_t remaining;
-    u_int16_t pointer;
-    u_int8_t blk;
-    u_int8_t next;
+/* Follows a path down to the directory holding its last name. Sets *dir to
+ * that directory and *name and *len to the last name. *len is 0 when the path
+ * names a directory itself, like "/" or "a/..". Paths always start at the
+ * root whether or not they start with a '/' */
+static u_int8_t walk(meta_data *md, const char *path, filename *dir, const char **name, u_int32_t *len) {
+    const char *full = path;
+    const char *rest;
+    const char *nm;
+    dir_record rec;
+    filename cur;
+    u_int32_t n;
+
+    if (!get_root(md, &cur)) return 0;
+
+    n = next_name(&path, &nm);
+    while (n > 0) {
+        if (n > NAME_LEN) {
+            log_error("Name too long -> Name: %.*s; Max: %u\n", (int) n, nm, NAME_LEN);
+            return 0;
+        }
 
-    /* checks to see if file name is valid and does not exceed max number of files */
-    if (file_name >= MAX_FILES) {
-        printf("ERROR File name exceeds max file limit\n");
-        return 0;
+        /* stops before the last name unless it is . or .. */
+        rest = path;
+        while (*rest == '/') rest++;
+        if (*rest == '\0' && !(n == 1 && nm[0] == '.') && !(n == 2 && nm[0] == '.' && nm[1] == '.')) {
+            *dir = cur;
+            *name = nm;
+            *len = n;
+            return 1;
+        }
+
+        if (n == 2 && nm[0] == '.' && nm[1] == '.') {
+            cur = md->dir[cur].parent;
+        } else if (n != 1 || nm[0] != '.') {
+            if (!lookup(md, cur, nm, n, &rec)) {
+                log_error("No such directory -> Path: %s\n", full);
+                return 0;
+            }
+            if (rec.type != REC_DIR) {
+                log_error("Not a directory -> Path: %s\n", full);
+                return 0;
+            }
+            cur = rec.file_name;
+        }
+        n = next_name(&path, &nm);
     }
 
-    fseek(f, 0 , SEEK_SET);
+    *dir = cur;
+    *name = NULL;
+    *len = 0;
+    return 1;
+}
 
-    /* checks to see if file is open for reading */
-    if (md->dir[file_name].status != APPEND) {
-        printf("ERROR file is not open for appending -> Filename %d\n", file_name);
-        return 0;
-    }
+/* Sets *out to the entry a path names */
+u_int8_t resolve_path(meta_data *md, const char *path, filename *out) {
+    const char *name;
+    dir_record rec;
+    filename dir;
+    u_int32_t len;
 
-    /* checks to see if there is enough space left to append to file */
-    if (md->dir[file_name].length + size >= EEPROM_LEN) {
-        printf("ERROR nor enough space to append file");
+    if (!walk(md, path, &dir, &name, &len)) return 0;
+    if (len == 0) {
+        *out = dir;
+        return 1;
+    }
+    if (!lookup(md, dir, name, len, &rec)) {
+        log_error("No such file or directory -> Path: %s\n", path);
         return 0;
     }
+    *out = rec.file_name;
+    return 1;
+}
+
+/* Finds out the entry, length and kind of what a path names */
+u_int8_t stat_path(meta_data *md, const char *path, file_stat *st) {
+    filename fn;
+
+    if (!resolve_path(md, path, &fn)) return 0;
+
+    pthread_rwlock_rdlock(&md->locks[fn]);
+    st->file_name = fn;
+    st->length = file_length(md, fn);
+    st->stored = md->dir[fn].length;
+    st->is_dir = (md->dir[fn].flags & DE_DIR) != 0;
+    pthread_rwlock_unlock(&md->locks[fn]);
+    return 1;
+}
+
+/* makes a new empty directory, the directories above it must exist */
+u_int8_t make_dir(meta_data *md, const char *path) {
+    const char *name;
+    filename dir;
+    u_int32_t len;
+    u_int8_t ok;
+
+    if (!get_root(md, &dir)) return 0;
 
-    /* determines the number of blocks needed to write to the file */
-    no_blks = (md->dir[file_name].length / BLOCK_SIZE + (md->dir[file_name].length % BLOCK_SIZE != 0));
+    pthread_mutex_lock(&md->name_lock);
+    ok = walk(md, path, &dir, &name, &len);
+    if (ok && len == 0) {
+        log_error("Directory all ready exists -> Path: %s\n", path);
+        ok = 0;
+    }
+    if (ok) ok = create_name(md, dir, name, len, REC_DIR) != NO_FILE;
+    pthread_mutex_unlock(&md->name_lock);
 
-    if (no_blks == 0) no_blks = 1;
-    remaining = no_blks * BLOCK_SIZE - md->dir[file_name].length;
+    if (ok) commit_meta(md);
+    return ok;
+}
 
-    /* gets a block if it the start block is free */
-    if (md->dir[file_name].startblock == FREE_BLOCK) {
-        md->dir[file_name].startblock = deQueue(md);
-        md->fat[file_name] = END_BLOCK;
+/* Opens a file by name in mode READ, WRITE, APPEND or UPDATE, like the
+ * open_for_ functions. Opening for writing or appending makes the file if it
+ * is not there. The lock of the directory is held while the file is opened so
+ * the name can not be removed in between */
+file_handle *open_path(meta_data *md, const char *path, u_int8_t mode) {
+    file_handle *h = NULL;
+    const char *name;
+    dir_header hdr;
+    dir_record rec;
+    filename dir;
+    u_int32_t slot;
+    u_int32_t len;
+    u_int8_t found;
+
+    if (mode != READ && mode != WRITE && mode != APPEND && mode != UPDATE) {
+        log_error("Invalid open mode -> Mode: %x\n", mode);
+        return NULL;
     }
+    if (!walk(md, path, &dir, &name, &len)) return NULL;
+    if (len == 0) {
+        log_error("Cannot open a directory -> Path: %s\n", path);
+        return NULL;
+    }
+
+    for (u_int32_t pass = 0; pass < 2; pass++) {
+        lock_indexed(md, dir);
+        found = read_header(md, dir, &hdr) && dir_find(md, dir, &hdr, name, len, &slot, &rec);
+        if (found) {
+            if (rec.type == REC_DIR) log_error("Cannot open a directory -> Path: %s\n", path);
+            else if (mode == READ) h = open_for_read(md, rec.file_name);
+            else if (mode == WRITE) h = open_for_write(md, rec.file_name);
+            else if (mode == UPDATE) h = open_for_update(md, rec.file_name);
+            else h = open_for_append(md, rec.file_name);
+        }
+        pthread_rwlock_unlock(&md->locks[dir]);
 
-    blk = md->dir[file_name].startblock;
+        if (found || mode == READ) break;
 
-    /* cycles through blocks to find the last block */
-    while (md->fat[blk] != END_BLOCK) {
-        next = md->fat[blk];
-        blk = next;
+        /* makes the file and opens it on the next pass */
+        pthread_mutex_lock(&md->name_lock);
+        if (!lookup(md, dir, name, len, &rec) && create_name(md, dir, name, len, REC_FILE) == NO_FILE) pass = 2;
+        pthread_mutex_unlock(&md->name_lock);
     }
 
-    /* sets a pointer to the current block */
-    pointer = sizeof(meta_data) + (blk*BLOCK_SIZE) + (BLOCK_SIZE - remaining);
-    fseek(f, pointer, SEEK_SET);
+    if (h == NULL && !found && mode == READ) log_error("No such file -> Path: %s\n", path);
+    return h;
+}
 
-    /* writes to end of file if size to write is less than remaining block space */
-    if (size <= remaining) {
-        fwrite(data, size, 1, f);
-        md->dir[file_name].length += size;
-        return 1;
+/* Removes a file or an empty directory. A file that is open can not be
+ * removed */
+u_int8_t remove_path(meta_data *md, const char *path) {
+    const char *name;
+    dir_header hdr;
+    dir_header sub;
+    dir_record rec;
+    filename dir;
+    u_int32_t slot;
+    u_int32_t len;
+    u_int8_t ok;
+
+    if (!get_root(md, &dir)) return 0;
+
+    pthread_mutex_lock(&md->name_lock);
+    ok = walk(md, path, &dir, &name, &len);
+    if (ok && len == 0) {
+        log_error("Cannot remove -> Path: %s\n", path);
+        ok = 0;
+    }
+    if (!ok) {
+        pthread_mutex_unlock(&md->name_lock);
+        return 0;
+    }
 
-        /* otherwise writes to the rest of the block and cysles on to next block as needed */
-    } else {
-        char buff[remaining];
-        char left[size - remaining];
+    pthread_rwlock_wrlock(&md->locks[dir]);
+    ok = read_header(md, dir, &hdr) && dir_find(md, dir, &hdr, name, len, &slot, &rec);
+    if (!ok) log_error("No such file or directory -> Path: %s\n", path);
+
+    /* a directory has to be empty first */
+    if (ok && rec.type == REC_DIR) {
+        lock_indexed(md, rec.file_name);
+        ok = read_header(md, rec.file_name, &sub);
+        pthread_rwlock_unlock(&md->locks[rec.file_name]);
+        if (ok && sub.used > 0) {
+            log_error("Directory not empty -> Path: %s\n", path);
+            ok = 0;
+        }
+    }
 
-        /* determines the size needed to append to the file and sets up array */
-        for (int i = 0; i < size; i++) {
-            if (i < remaining) buff[i] = data[i];
-            else left[i - remaining] = data[i];
+    if (ok) {
+        pthread_mutex_lock(&md->open_lock);
+        if (md->opens[rec.file_name].readers > 0 || md->opens[rec.file_name].writer) {
+            log_error("cannot remove as file is open -> Path: %s\n", path);
+            ok = 0;
+        } else {
+            md->opens[rec.file_name].writer = 1;
         }
+        pthread_mutex_unlock(&md->open_lock);
+    }
+    if (ok) free_entry(md, rec.file_name);
+
+    if (ok) ok = dir_del(md, dir, &hdr, slot);
+    pthread_rwlock_unlock(&md->locks[dir]);
+    pthread_mutex_unlock(&md->name_lock);
 
+    if (ok) commit_meta(md);
+    return ok;
+}
+
+/* Reads the header of a directory, 0 if it is damaged. Used by fsck, a
+ * directory can not be opened to read it */
+u_int8_t stat_dir(meta_data *md, filename dir, dir_header *hdr) {
+    u_int8_t ok;
+
+    if (dir >= md->sb.max_files) {
+        log_error("File name exceeds max file limit\n");
+        return 0;
+    }
 
-        fwrite(&buff, remaining, 1, f);
-        md->dir[file_name].length += remaining; // adds to the file length
+    lock_indexed(md, dir);
+    ok = read_header(md, dir, hdr) && rec_off(hdr->slots) <= md->dir[dir].length;
+    pthread_rwlock_unlock(&md->locks[dir]);
+    return ok;
+}
 
-        /* gets the next block needed to write to and sets appends fat */
-        next = deQueue(md);
-        md->fat[blk] = next;
-        blk = next;
+/* Removes the record in slot of a directory whatever it names, for fsck to
+ * drop names that point at nothing. read_dir leaves *pos one past the record
+ * it returned */
+u_int8_t drop_name(meta_data *md, filename dir, u_int32_t slot) {
+    dir_header hdr;
+    dir_record rec;
+    u_int8_t ok = 0;
+
+    pthread_rwlock_wrlock(&md->locks[dir]);
+    if (read_header(md, dir, &hdr) && slot < hdr.slots
+        && read_inner(md, dir, rec_off(slot), &rec, sizeof(dir_record)) == sizeof(dir_record)
+        && (rec.type == REC_FILE || rec.type == REC_DIR)) {
+        ok = dir_del(md, dir, &hdr, slot);
+    }
+    pthread_rwlock_unlock(&md->locks[dir]);
+    return ok;
+}
 
-        /* gets the number of blocks needed to finish appending the file */
-        no_blks = scan_blocks(md, size - remaining);
+/* Builds the table of a directory again from the records in it, which puts
+ * the counts in its header right and drops deleted records and those with a
+ * damaged name. Used by fsck */
+u_int8_t rebuild_dir(meta_data *md, filename dir) {
+    dir_header hdr;
+    u_int8_t ok;
+
+    pthread_rwlock_wrlock(&md->locks[dir]);
+    ok = read_header(md, dir, &hdr) && dir_grow(md, dir, &hdr, 1);
+    pthread_rwlock_unlock(&md->locks[dir]);
+    return ok;
+}
 
-        size -= remaining;
+/* Grows the table of a directory so names more names can be added without it
+ * growing again. A tool filling a new image calls it before adding the names
+ * so the table is written once, in one piece */
+u_int8_t reserve_dir(meta_data *md, filename dir, u_int32_t names) {
+    dir_header hdr;
+    u_int8_t ok;
 
-        /* loops through no of needed blocks */
-        for (int i = 0; i < no_blks; i++) {
+    if (dir >= md->sb.max_files || !(md->dir[dir].flags & DE_DIR)) {
+        log_error("Not a directory -> Filename: %u\n", dir);
+        return 0;
+    }
 
-            pointer = EEPROM_START + sizeof(meta_data) + blk * BLOCK_SIZE - 3;
-            printf("Used block -> %d\n", blk);
-            printf("At memory address -> %x\n", pointer);
-            fseek(f, pointer , SEEK_SET);
+    pthread_rwlock_wrlock(&md->locks[dir]);
+    ok = read_header(md, dir, &hdr);
+    if (ok && (u_int64_t) (hdr.used + hdr.deleted + names) * 4 > (u_int64_t) hdr.slots * 3) ok = dir_grow(md, dir, &hdr, names);
+    pthread_rwlock_unlock(&md->locks[dir]);
+    return ok;
+}
 
-            /* if the size left needed is less than the block size write to it and return */
-            if (size <= BLOCK_SIZE) {
-                char buffer[size];
-                for (int j = 0; j < size; j++) buffer[j] = left[(i * BLOCK_SIZE) + j];
+/* bytes the table of a directory holding names takes once reserved */
+u_int64_t dir_size(u_int32_t names) {
+    u_int64_t slots = DIR_INIT_SLOTS;
 
-                fwrite(&buffer, size, 1, f);
-                md->dir[file_name].length += size;
-                md->fat[blk] = END_BLOCK;
+    if ((u_int64_t) names * 4 > slots * 3) {
+        while ((u_int64_t) names * 2 > slots) slots *= 2;
+    }
+    return rec_off(slots);
+}
 
-                return 1;
+/* Gives the names in a directory one at a time. Start with *pos at 0, each
+ * call moves it on. Returns 0 when there are no more */
+u_int8_t read_dir(meta_data *md, filename dir, u_int32_t *pos, dir_item *item) {
+    dir_header hdr;
+    dir_record rec;
+    u_int8_t found = 0;
 
+    if (dir >= md->sb.max_files) {
+        log_error("File name exceeds max file limit\n");
+        return 0;
+    }
+
+    lock_indexed(md, dir);
+    if (!(md->dir[dir].flags & DE_DIR)) {
+        log_error("Not a directory -> Filename: %u\n", dir);
+    } else if (read_header(md, dir, &hdr)) {
+        while (!found && *pos < hdr.slots) {
+            if (read_inner(md, dir, rec_off(*pos), &rec, sizeof(dir_record)) != sizeof(dir_record)) break;
+            (*pos)++;
+            if (rec.type != REC_FILE && rec.type != REC_DIR) continue;
+            if (!rec_named(&rec)) {
+                log_warn("Damaged name in directory -> Filename: %u; Slot: %u; Length: %u\n", dir, *pos - 1,
+                         rec.name_len);
+                continue;
             }
-            /* else write to it and grab the next block and continue */
-            else {
-                char buffer[BLOCK_SIZE];
-                for (int j = 0 ; j < BLOCK_SIZE ; j ++) buffer[j] = left[(i * BLOCK_SIZE) + j];
-
-                fwrite(&buffer, BLOCK_SIZE, 1, f);
-                md->dir[file_name].length += BLOCK_SIZE;
-                size -= BLOCK_SIZE;
-
-                next = deQueue(md);
-                md->fat[blk] = next;
-                blk = next;
-                printf("%s", buffer);
-            }
+
+            memcpy(item->name, rec.name, rec.name_len);
+            item->name[rec.name_len] = '\0';
+            item->file_name = rec.file_name;
+            item->is_dir = rec.type == REC_DIR;
+            found = 1;
         }
     }
+    pthread_rwlock_unlock(&md->locks[dir]);
+    return found;
 }
 
-/* closes a file*/
-u_int8_t close_file(meta_data *md, int8_t file_name, FILE *f) {
+/* the background scrubber of a mounted file system, see start_scrub */
+struct scrubber {
+    meta_data *md;
+    pthread_t thread;
+    pthread_mutex_t lock;           // guards stop and the waits
+    pthread_cond_t wake;            // signalled when the scrubber has to stop
+    u_int32_t rate;                 // blocks checked a second, 0 for as fast as it can
+    u_int8_t stop;                  // set when the scrubber has to stop
+};
+
+/* Waits for ns nanoseconds unless the scrubber is told to stop first. Returns
+ * 0 when it has to stop */
+static u_int8_t scrub_wait(scrubber *s, u_int64_t ns) {
+    struct timespec until;
+    u_int8_t go;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ns / 1000000000ULL;
+    until.tv_nsec += ns % 1000000000ULL;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    while (!s->stop && pthread_cond_timedwait(&s->wake, &s->lock, &until) == 0);
+    go = !s->stop;
+    pthread_mutex_unlock(&s->lock);
+    return go;
+}
 
-    if (file_name >= MAX_FILES) {
-        printf("ERROR File name exceeds max file limit\n");
-        return 0;
+/* Checks every block of a file against its checksum, SCRUB_CHUNK blocks at a
+ * time with the file locked for reading so writers only wait for one chunk.
+ * Each chunk is read as one batch into buf, through the cache where there is
+ * one as it may hold newer data than the device. Returns 0 if the scrubber
+ * was told to stop or a read failed */
+static u_int8_t scrub_file(meta_data *md, filename file_name, u_int8_t *buf, u_int32_t *bad, scrubber *s) {
+    u_int32_t bs = md->sb.block_size;
+    u_int32_t blocks, n, run;
+    extent_map *em;
+    dev_batch b;
+    u_int8_t ok = 1;
+
+    for (u_int32_t first = 0; ok; first += n) {
+        lock_indexed(md, file_name);
+        em = &md->extents[file_name];
+        blocks = ((u_int64_t) md->dir[file_name].length + bs - 1) / bs;
+        if (md->dir[file_name].startblock == FREE_BLOCK || blocks > em->indexed) blocks = em->indexed;
+        if (first >= blocks) {
+            pthread_rwlock_unlock(&md->locks[file_name]);
+            break;
+        }
+        n = blocks - first < SCRUB_CHUNK ? blocks - first : SCRUB_CHUNK;
+
+        dev_batch_init(&b);
+        for (u_int32_t i = 0; ok && i < n; i += run) {
+            for (run = 1; i + run < n && em->index[first + i + run] == em->index[first + i] + run; run++);
+            ok = data_read(md, BLOCK_ADDR(md, em->index[first + i]), buf + (u_int64_t) i * bs, (u_int64_t) run * bs, &b);
+        }
+        ok = dev_batch_run(md->dev, &b) && ok;
+        dev_batch_free(&b);
+
+        for (u_int32_t i = 0; ok && i < n; i++) {
+            if (crc32c(0, buf + (u_int64_t) i * bs, bs) == __atomic_load_n(&md->crcs[em->index[first + i]], __ATOMIC_RELAXED)) continue;
+            log_error("Checksum mismatch -> Block: %u; Filename: %u\n", em->index[first + i], file_name);
+            stat_add(&md->stats.crc_errors, 1);
+            (*bad)++;
+        }
+        pthread_rwlock_unlock(&md->locks[file_name]);
+        if (!ok) log_error("Scrub read failed -> Filename: %u\n", file_name);
+
+        stat_add(&md->stats.blocks_scrubbed, n);
+        if (s != NULL && s->rate > 0 && !scrub_wait(s, (u_int64_t) n * 1000000000ULL / s->rate)) return 0;
+        if (s != NULL && __atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)) return 0;
     }
+    return ok;
+}
 
-    if (md->dir[file_name].startblock == FREE_BLOCK) {
-        printf("ERROR Cannot close file as it doesnt exist -> File name: %d\n", file_name);
-        return 0;
-    } else if (md->dir[file_name].status == CLOSED_FILE) {
-        printf("ERROR Cannot close file as it is all ready closed -> File name: %d\n", file_name);
+/* Checks every block of every file once. Returns 0 if the pass was cut short */
+static u_int8_t scrub_pass(meta_data *md, u_int32_t *bad, scrubber *s) {
+    u_int8_t *buf;
+    u_int8_t ok = 1;
+
+    buf = malloc((size_t) SCRUB_CHUNK * md->sb.block_size);
+    if (buf == NULL) {
+        log_error("Out of memory for scrubbing -> Block size: %u\n", md->sb.block_size);
         return 0;
     }
+    for (filename fn = 0; ok && fn < md->sb.max_files; fn++) ok = scrub_file(md, fn, buf, bad, s);
+    free(buf);
+    return ok;
+}
+
+static void *scrub_main(void *arg) {
+    scrubber *s = arg;
+    u_int32_t bad;
 
-    md->dir[file_name].status = CLOSED_FILE;
+    do {
+        bad = 0;
+        if (scrub_pass(s->md, &bad, s)) log_info("Scrub pass done -> Bad blocks: %u\n", bad);
+    } while (scrub_wait(s, SCRUB_PAUSE * 1000000000ULL));
+    return NULL;
+}
 
-    /* simulates writing to EEPROM */
-    fseek(f, 0, SEEK_SET);
-    fwrite(md, sizeof(meta_data), 1, f);
-    fclose(f);
+/* Starts checking every block of every file against its checksum in the
+ * background, pass after pass, at no more than blocks_per_sec blocks a
+ * second or as fast as it can for 0. A bad block is logged and counted in
+ * the statistics. unmount stops it */
+u_int8_t start_scrub(meta_data *md, u_int32_t blocks_per_sec) {
+    scrubber *s;
 
+    if (md->crcs == NULL) {
+        log_error("File system has no checksums to scrub\n");
+        return 0;
+    }
+    if (md->scrub != NULL) return 1;
+
+    s = calloc(1, sizeof(scrubber));
+    if (s == NULL) return 0;
+    s->md = md;
+    s->rate = blocks_per_sec;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    if (pthread_create(&s->thread, NULL, scrub_main, s) != 0) {
+        log_error("Cannot start scrubber\n");
+        pthread_cond_destroy(&s->wake);
+        pthread_mutex_destroy(&s->lock);
+        free(s);
+        return 0;
+    }
+    md->scrub = s;
     return 1;
 }
 
-/* deletes a file */
-u_int8_t delete(meta_data *md, u_int8_t file_name) {
-    FILE *f;
-    u_int8_t start;
-    start = md->dir[file_name].startblock;
+/* stops the scrubber if it is running and waits for it */
+void stop_scrub(meta_data *md) {
+    scrubber *s = md->scrub;
+
+    if (s == NULL) return;
+    pthread_mutex_lock(&s->lock);
+    __atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_join(s->thread, NULL);
+    pthread_cond_destroy(&s->wake);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+    md->scrub = NULL;
+}
 
-    if (start == FREE_BLOCK) {
-        printf("ERROR cannot delete as file does not exist -> Filename: %d\n", file_name);
+/* Checks every block of every file against its checksum once, bad is set to
+ * the number that do not match. Returns 0 if the device has no checksums or
+ * a read failed */
+u_int8_t scrub_fs(meta_data *md, u_int32_t *bad) {
+    *bad = 0;
+    if (md->crcs == NULL) {
+        log_error("File system has no checksums to scrub\n");
         return 0;
     }
-    free_blocks(md, start);
+    return scrub_pass(md, bad, NULL);
+}
 
-    /* initialise directory*/
-    md->dir[file_name].startblock = FREE_BLOCK;
-    md->dir[file_name].length = 0;
-    md->dir[file_name].currpos = 0;
-    md->dir[file_name].status = CLOSED_FILE;
+/* Takes a snapshot of the statistics of a mounted file system, adding the
+ * counters kept by the device and the block cache */
+void get_stats(meta_data *md, fs_stats *out) {
+    stats_copy(out, &md->stats);
+
+    out->dev_reads = __atomic_load_n(&md->dev->reads, __ATOMIC_RELAXED);
+    out->dev_read_bytes = __atomic_load_n(&md->dev->read_bytes, __ATOMIC_RELAXED);
+    out->dev_writes = __atomic_load_n(&md->dev->writes, __ATOMIC_RELAXED);
+    out->dev_write_bytes = __atomic_load_n(&md->dev->write_bytes, __ATOMIC_RELAXED);
+    out->dev_syncs = __atomic_load_n(&md->dev->syncs, __ATOMIC_RELAXED);
+    out->dev_batches = __atomic_load_n(&md->dev->batches, __ATOMIC_RELAXED);
+
+    out->cache_hits = 0;
+    out->cache_misses = 0;
+    if (md->cache != NULL) cache_counts(md->cache, &out->cache_hits, &out->cache_misses);
+}
 
+/* prints the statistics to f */
+void dump_stats(meta_data *md, FILE *f) {
+    fs_stats *s = malloc(sizeof(fs_stats));
 
-    /* simulates writing to EEPROM */
-    f = fopen(PATH, "rb+");
-    fwrite(md, sizeof(meta_data), 1, f);
-    fclose(f);
+    if (s == NULL) return;
+    get_stats(md, s);
+    stats_print(s, f);
+    free(s);
+}
 
-    printf("File deleted -> Filename: %d", file_name);
+/* parts of the meta data as dump_wear lists them */
+static const char *wear_parts[] = {"Super block", "Slot headers", "Directory", "Fat", "Queue", "Checksums", "Journal"};
+
+/* which of wear_parts a device offset below data_start is in */
+static u_int32_t wear_part(meta_data *md, u_int64_t off) {
+    u_int64_t in;
+
+    if (off < md->sb.slot_start) return 0;
+    if (off >= md->sb.journal_start) return 6;
+    in = (off - md->sb.slot_start) % md->sb.slot_size;
+    if (in < md->sb.dir_start) return 1;
+    if (in < md->sb.fat_start) return 2;
+    if (in < md->sb.queue_start) return 3;
+    if (md->sb.crc_start == 0 || in < md->sb.crc_start) return 4;
+    return 5;
+}
 
-    return 1;
+/* Draws count values as rows of shades, each character standing for the
+ * largest of the values it covers. most gets the darkest shade */
+static void draw_heat(FILE *f, const char *label, const u_int32_t *v, u_int64_t count, u_int64_t most) {
+    static const char shades[] = " .:-=+*#%@";
+    u_int64_t cells = count < WEAR_COLUMNS * WEAR_ROWS ? count : WEAR_COLUMNS * WEAR_ROWS;
+    u_int64_t per = cells ? (count + cells - 1) / cells : 1;
+    u_int64_t top, end;
+    char row[WEAR_COLUMNS + 1];
+    u_int32_t col = 0;
+
+    fprintf(f, "%s -> Per character: %llu; Most: %llu\n", label, (unsigned long long) per, (unsigned long long) most);
+    for (u_int64_t start = 0; start < count; start += per) {
+        top = 0;
+        end = start + per < count ? start + per : count;
+        for (u_int64_t i = start; i < end; i++) {
+            if (v[i] > top) top = v[i];
+        }
+        row[col++] = top ? shades[1 + (top - 1) * (sizeof(shades) - 2) / most] : shades[0];
+        if (col == WEAR_COLUMNS || end == count) {
+            row[col] = '\0';
+            fprintf(f, "  %10llu |%s|\n", (unsigned long long) (start - (col - 1) * per), row);
+            col = 0;
+        }
+    }
+}
+
+/* most writes to a byte of each data block, NULL when out of memory */
+static u_int32_t *block_wear(meta_data *md, const u_int32_t *wear) {
+    u_int32_t *most = calloc(md->sb.total_blocks, sizeof(u_int32_t));
+    const u_int32_t *w;
+
+    if (most == NULL) return NULL;
+    for (block blk = 0; blk < md->sb.total_blocks; blk++) {
+        w = wear + BLOCK_ADDR(md, blk);
+        for (u_int32_t i = 0; i < md->sb.block_size; i++) {
+            if (w[i] > most[blk]) most[blk] = w[i];
+        }
+    }
+    return most;
+}
+
+/* Prints the time and wear of a simulated EEPROM, see eeprom_dev_open. The
+ * meta data is summed up by part and drawn byte by byte, the data blocks are
+ * drawn by their most written byte and the most written blocks listed */
+void dump_wear(meta_data *md, FILE *f) {
+    const u_int32_t *wear = eeprom_wear(md->dev);
+    u_int64_t bytes[7] = {0}, total[7] = {0}, most[7] = {0};
+    u_int64_t meta_most = 0, block_most = 0;
+    u_int32_t *blocks;
+    u_int32_t part;
+    block hot[WEAR_TOP];
+    u_int32_t hot_count = 0;
+    u_int32_t at;
+    eeprom_stats st;
+
+    if (wear == NULL || !eeprom_get_stats(md->dev, &st)) {
+        log_error("Device is not a simulated EEPROM\n");
+        return;
+    }
+
+    fprintf(f, "EEPROM -> Time: %.3f s; Write cycles: %llu; Erases: %llu; Cells written: %llu; Bytes read: %llu\n",
+            st.sim_ns / 1e9, (unsigned long long) st.write_cycles, (unsigned long long) st.erases,
+            (unsigned long long) st.cell_writes, (unsigned long long) st.bytes_read);
+    fprintf(f, "Wear -> Most: %llu; Endurance: %u; Cells past it: %llu\n", (unsigned long long) st.max_wear,
+            eeprom_get_model(md->dev)->endurance, (unsigned long long) st.worn_cells);
+
+    for (u_int64_t off = 0; off < md->sb.data_start; off++) {
+        part = wear_part(md, off);
+        bytes[part]++;
+        total[part] += wear[off];
+        if (wear[off] > most[part]) most[part] = wear[off];
+        if (wear[off] > meta_most) meta_most = wear[off];
+    }
+    for (part = 0; part < 7; part++) {
+        if (bytes[part] == 0) continue;
+        fprintf(f, "  %-12s -> Bytes: %llu; Most: %llu; Mean: %.1f\n", wear_parts[part], (unsigned long long) bytes[part],
+                (unsigned long long) most[part], (double) total[part] / bytes[part]);
+    }
+    draw_heat(f, "Meta data wear", wear, md->sb.data_start, meta_most);
+
+    blocks = block_wear(md, wear);
+    if (blocks == NULL) return;
+    for (block blk = 0; blk < md->sb.total_blocks; blk++) {
+        if (blocks[blk] > block_most) block_most = blocks[blk];
+    }
+    draw_heat(f, "Block wear", blocks, md->sb.total_blocks, block_most);
+
+    /* the most written blocks, kept in order from the top */
+    for (block blk = 0; blk < md->sb.total_blocks; blk++) {
+        at = hot_count < WEAR_TOP ? hot_count++ : WEAR_TOP;
+        while (at > 0 && blocks[hot[at - 1]] < blocks[blk]) {
+            if (at < WEAR_TOP) hot[at] = hot[at - 1];
+            at--;
+        }
+        if (at < WEAR_TOP) hot[at] = blk;
+    }
+    fprintf(f, "Most written blocks ->");
+    for (u_int32_t i = 0; i < hot_count && blocks[hot[i]] > 0; i++) fprintf(f, " %u (%u)", hot[i], blocks[hot[i]]);
+    fprintf(f, "\n");
+    free(blocks);
+}
+
+/* Writes the wear of a simulated EEPROM as CSV, a line for every byte of the
+ * meta data and one for every data block with its most written byte */
+u_int8_t save_wear(meta_data *md, FILE *f) {
+    const u_int32_t *wear = eeprom_wear(md->dev);
+    u_int32_t *blocks;
+
+    if (wear == NULL) {
+        log_error("Device is not a simulated EEPROM\n");
+        return 0;
+    }
+    blocks = block_wear(md, wear);
+    if (blocks == NULL) return 0;
+
+    fprintf(f, "kind,index,part,writes\n");
+    for (u_int64_t off = 0; off < md->sb.data_start; off++) {
+        fprintf(f, "meta,%llu,%s,%u\n", (unsigned long long) off, wear_parts[wear_part(md, off)], wear[off]);
+    }
+    for (block blk = 0; blk < md->sb.total_blocks; blk++) fprintf(f, "block,%u,Data,%u\n", blk, blocks[blk]);
+    free(blocks);
+    return !ferror(f);
 }
 
-int main() {
-    FILE *file;
-    init_fat(&meta, file);
+/* left out when the file system is built into another program, see bench.c */
+#ifndef MINIFAT_LIB
+int main(int argc, char *argv[]) {
+    block_dev *dev;
+
+    /* maps the image once, every operation after this works on the mapping.
+     * The geometry comes from the super block so any size of image can be used */
+    dev = mmap_dev_open(argc > 1 ? argv[1] : PATH, DEFAULT_IMAGE_LEN);
+    if (!init_fat(&meta, dev)) return 1;
+    display(&meta);
 
-//    printf("Free blocks -> %d\n", availableBlocks(&meta));
+//    printf("Free blocks -> %lld\n", (long long) availableBlocks(&meta));
 //    printf("head-> %d; tail -> %d\n", meta.queue.front, meta.queue.rear);
 //    char data[] = "HELLO WORLD!!!";
 //
+//    file_handle *file;
+//
 //    file = open_for_write(&meta, 0);
-//    write(&meta, 0, data, sizeof(data), file);
-//    close_file(&meta, 0, file);
+//    write_file(&meta, file, data, sizeof(data));
+//    close_file(&meta, file);
 //
 //    file = open_for_read(&meta, 0);
 //    char data2[meta.dir->length];
-//    read(&meta, 0, file, data2);
-//    close_file(&meta, 0, file);
+//    read_file(&meta, file, data2, sizeof(data2));
+//    printf("File contents -> %.*s\n", (int) sizeof(data2), data2);
+//    close_file(&meta, file);
 //
 //
 //    file = open_for_append(&meta, 0);
 //    char data3[] = "abcdefghijklmnopqrstuvwxyz123456789abcdefghijklmnopqrstuvwxyz123456789abcdefghijklmnopqrstuvwxyz123456789";
-//    append(&meta, 0, data3, sizeof(data3), file);
-//    close_file(&meta, 0, file);
+//    append_file(&meta, file, data3, sizeof(data3));
+//    close_file(&meta, file);
 
+    unmount(&meta);
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -1,148 +1,435 @@
-#define MAX_FILES       0x000A      // 10
-#define EEPROM_LEN      0x0A00      // 2560 bytes
+#define DEFAULT_MAX_FILES   0x000A      // 10
+#define DEFAULT_BLOCK_SIZE  0x0040      // 64 bytes
+#define DEFAULT_IMAGE_LEN   0x0A90      // 2704 bytes, size given to a new image
 #define EEPROM_START    0x0000      // start at address 0
-#define BLOCK_SIZE      0x0040      // 64 bytes
-#define BUFFER_SIZE     0x0008      // 8 byte buffer size -- should be set to factor of BLOCK_SIZE
 
-#define TOTAL_BLOCKS    EEPROM_LEN/BLOCK_SIZE   // 40 total number of available blocks
-#define FS_VERSION      MAX_FILES + EEPROM_LEN + EEPROM_START + BLOCK_SIZE // automatically reformat if changes to file structure are made
+#define FS_MAGIC        0x5446464D  // "MFFT" marks a formatted device
+#define FS_VERSION      0x0008      // init_fat refuses another version, it only formats a device without FS_MAGIC
+
+#define DEFAULT_FLUSH_OPS   0x0010      // flush the meta data every 16 operations
+#define DEFAULT_FLUSH_SECS  1           // or once a second, whichever comes first
+#define FAT_CHUNK_SHIFT     6           // fat and queue entries are tracked dirty in chunks of 64
+#define ALLOC_WINDOW        0x0020      // queue entries looked at when searching for a contiguous run
+#define MAX_HANDLES         0x0040      // files that can be open at the same time
+#define CACHE_BLOCKS        0x0040      // blocks cached when the device can not be mapped
+#define READ_AHEAD          0x0008      // blocks read ahead along a file
+#define NAME_LEN            0x0036      // 54 bytes, longest name in a directory
+#define DIR_INIT_SLOTS      0x0010      // records in the hash table of a new directory
+#define SCRUB_CHUNK         0x0040      // blocks the scrubber reads with the file locked
+#define SCRUB_PAUSE         1           // seconds the scrubber rests between passes
+#define FRAME_SIZE          0x1000      // bytes of file data packed together in a compressed file
+#define WEAR_COLUMNS        0x0040      // characters in a row of the wear drawn by dump_wear
+#define WEAR_ROWS           0x0010      // rows drawn at most, each character covers more when there is more
+#define WEAR_TOP            0x0008      // most written blocks listed by dump_wear
+
+#define JOURNAL_MAGIC   0x4C4E524A  // "JRNL" marks a committed journal transaction
+#define SLOT_MAGIC      0x544F4C53  // "SLOT" marks a meta data slot
+#define DIR_MAGIC       0x53524944  // "DIRS" starts the hash table of a directory
+#define META_SLOTS      4           // copies of the meta data written in turn
+#define MIN_JOURNAL     0x0100      // 256 bytes
+#define MAX_JOURNAL     0x100000    // 1M bytes
+
+#define FEAT_CRC        0x01        // a CRC32C is kept for every data block
+
+#define MIN_BLOCK_SIZE  0x0010      // 16 bytes
+#define MAX_BLOCK_SIZE  0x10000     // 64k bytes
 
 #define PATH            "/home/max/Documents/Semester2/ComputerSystems2/Labs/Lab4/test.img" // change to path name of you "test.img"
 
-#define FREE_BLOCK      0xFE        // entry for free block
-#define END_BLOCK       0xFF        // entry for end block
-#define CLOSED_FILE     0xFF        // sets current position if file is unopened
+#define FREE_BLOCK      0xFFFFFFFE  // entry for free block
+#define END_BLOCK       0xFFFFFFFF  // entry for end block
+#define MAX_BLOCKS      0xFFFFFFFD  // block numbers above this are reserved for the entries above
+#define CLOSED_FILE     0xFF        // handle is not in use
 #define READ            0xFD        // open for reading
 #define WRITE           0xFC        // open for writing
 #define APPEND          0xFB        // open for appending
+#define UPDATE          0xFA        // open_path only, open for writing keeping what the file holds
+#define NO_FILE         0xFFFFFFFF  // no directory entry
+
+#define DE_NAMED        0x01        // entry belongs to a file or directory with a name
+#define DE_DIR          0x02        // entry holds a directory
+#define DE_ROOT         0x04        // entry holds the root directory
+#define DE_COMPRESSED   0x08        // file data is kept in compressed frames
+
+#define REC_FREE        0x00        // hash table record never used
+#define REC_FILE        0x01        // record names a file
+#define REC_DIR         0x02        // record names a directory
+#define REC_DELETED     0x03        // record was used, probing carries on past it
+
+typedef u_int32_t block;
+typedef u_int32_t filename;
+
+/* The geometry of the file system is chosen when the device is formatted and
+ * stored in the super block at the start of the device. Everything else is
+ * sized from it when the device is mounted.
+ *
+ * Device layout
+ *   super block | slot[meta_slots] | journal | data blocks
+ *   slot = slot header | dir[max_files] | fat[total_blocks] | queue | crc[total_blocks]
+ *
+ * The fat and the queue store block numbers using index_size bytes each. Small
+ * devices with fewer than 0xFFFE blocks use 16 bit indices, larger ones 32 bit.
+ * The data blocks start on a block_size boundary.
+ *
+ * Changes to the directory, fat and queue are added to the journal as one
+ * transaction per flush. When the journal is full the whole of the meta data
+ * is written to the next slot and the journal starts again, so each slot is
+ * only written once every meta_slots checkpoints. At mount the newest slot
+ * with a good checksum is loaded and the journal replayed on top of it.
+ *
+ * The crc table is only there when the device was formatted with FEAT_CRC. It
+ * holds a CRC32C of every data block, updated as blocks are written and
+ * written back with the rest of the meta data. Reads check the blocks they
+ * touch against it and a scrubber can check every block of every file in the
+ * background. The super block has a checksum of its own either way.
+ */
+typedef struct super {
+    u_int32_t magic;                // FS_MAGIC
+    u_int16_t version;              // FS_VERSION
+    u_int8_t index_size;            // bytes per block index on the device (2 or 4)
+    u_int8_t meta_slots;            // slots in the meta data ring
+    u_int32_t block_size;           // bytes per block
+    u_int32_t total_blocks;         // number of data blocks
+    u_int32_t max_files;            // number of directory entries
+    u_int32_t journal_size;         // bytes in the journal
+    u_int64_t slot_start;           // device offset of the first slot
+    u_int64_t slot_size;            // bytes per slot
+    u_int64_t dir_start;            // offset of the directory within a slot
+    u_int64_t fat_start;            // offset of the fat within a slot
+    u_int64_t queue_start;          // offset of the queue within a slot
+    u_int64_t journal_start;        // device offset of the journal
+    u_int64_t data_start;           // device offset of block 0
+    u_int64_t crc_start;            // offset of the crc table within a slot, 0 without FEAT_CRC
+    u_int32_t features;             // FEAT_ bits
+    u_int32_t crc;                  // CRC32C of the super block, taken with crc set to 0
+} super_block;
 
-typedef u_int8_t block;
-typedef u_int8_t filename;
+/* starts each slot, crc covers the rest of the slot */
+typedef struct slot_header {
+    u_int32_t magic;                // SLOT_MAGIC
+    u_int32_t seq;                  // higher is newer
+    u_int32_t crc;                  // CRC32C of the slot after the header
+    u_int32_t pad;
+} slot_header;
+
+/* A journal transaction is a header followed by records, each record is a
+ * copy of some meta data and where it goes in a slot */
+typedef struct journal_header {
+    u_int32_t magic;                // JOURNAL_MAGIC when the journal holds a transaction
+    u_int32_t seq;                  // one more than the slot or transaction before it
+    u_int32_t len;                  // bytes of records after the header
+    u_int32_t crc;                  // CRC32C of header and records, taken with crc set to 0
+} journal_header;
+
+typedef struct journal_record {
+    u_int64_t off;                  // slot offset the data belongs at
+    u_int32_t len;                  // bytes of data following the record
+    u_int32_t pad;
+} journal_record;
 
 typedef struct entry {
     block startblock;               // contains the start block of the file
-    u_int8_t status;                // contains status flags
-    u_int16_t length;               // contains the file length
-    u_int16_t currpos;              // contains the current pos
+    u_int32_t length;               // contains the file length, as stored on the device
+    u_int32_t flags;                // DE_ bits, 0 for a file only known by its number
+    filename parent;                // directory holding the name of the file
+    u_int32_t logical;              // bytes of file data in a compressed file, 0 otherwise
 } dir_entry;
 
+/* A compressed file is stored as frames one after another, each holding
+ * FRAME_SIZE bytes of the file except the last, which holds what is left.
+ * A frame is a header followed by the data packed with lz_compress, or the
+ * data as it is when packing does not make it smaller. length in the entry
+ * counts the frames as stored and logical the file data in them, so the
+ * chain is checked the same way for every file.
+ *
+ * Reading decodes the frames the read touches. Writing packs again from the
+ * first frame the write touches, frames after the ones written are moved
+ * along as they are when the stored size changes */
+typedef struct frame_header {
+    u_int16_t raw_len;              // bytes of file data in the frame
+    u_int16_t packed_len;           // bytes stored after the header, raw_len when not packed
+} frame_header;
+
+#define FRAME_MAX   (sizeof(frame_header) + FRAME_SIZE) // largest a frame can be stored
+
+/* where each frame of a compressed file starts, only kept in memory */
+typedef struct frame_map {
+    u_int32_t *pos;                 // stored offset of each frame
+    u_int32_t count;                // frames in the file
+    u_int32_t cap;                  // frames allocated in pos
+    u_int8_t valid;                 // 0 when the map needs rebuilding from the headers
+} frame_map;
+
+/* Files can also be reached by name. A directory is a file holding a hash
+ * table of the names in it. The table starts with a dir_header followed by
+ * slots records, slots is a power of two. A name is looked for at its hash
+ * and the records after it until a free one. The table is rebuilt twice the
+ * size when more than three quarters of it is used, counting deleted records.
+ *
+ * The root directory is made the first time a path is used and takes the
+ * highest free entry, so files that are only used by number keep the low
+ * numbers. Both kinds live in the same table of entries */
+typedef struct dir_header {
+    u_int32_t magic;                // DIR_MAGIC
+    u_int32_t slots;                // records in the table
+    u_int32_t used;                 // records naming a file or directory
+    u_int32_t deleted;              // records marked REC_DELETED
+    u_int8_t pad[48];               // same size as a record
+} dir_header;
+
+typedef struct dir_record {
+    u_int32_t hash;                 // hash of the name
+    filename file_name;             // entry of the file
+    u_int8_t type;                  // REC_ value
+    u_int8_t name_len;              // bytes in name
+    char name[NAME_LEN];            // not terminated
+} dir_record;
+
+/* a name found by read_dir */
+typedef struct dir_item {
+    char name[NAME_LEN + 1];        // terminated
+    filename file_name;             // entry of the file
+    u_int8_t is_dir;                // 1 for a directory
+} dir_item;
+
+/* what stat_path finds out about a path */
+typedef struct file_stat {
+    filename file_name;             // entry of the file
+    u_int32_t length;               // bytes in the file
+    u_int32_t stored;               // bytes it takes on the device, less than length when compressed
+    u_int8_t is_dir;                // 1 for a directory
+} file_stat;
+
+/* An open file. Every open gets its own handle so the position and mode
+ * belong to the caller rather than to the file */
+typedef struct file_handle {
+    filename file_name;             // file the handle refers to
+    u_int8_t mode;                  // READ, WRITE, APPEND or CLOSED_FILE when the slot is free
+    u_int64_t pos;                  // current position in the file
+    char *log;                      // data gathered by log_append, NULL until it is used
+    u_int32_t log_len;              // bytes in log
+} file_handle;
+
+/* how a file is open at the moment, only kept in memory. Any number of
+ * readers or a single writer */
+typedef struct open_file {
+    u_int32_t readers;              // read handles open on the file
+    u_int8_t writer;                // 1 when open for writing or appending
+} open_file;
+
 typedef struct circ_queue {
-    block q[TOTAL_BLOCKS];          // contains free blocks in circular array
-    int8_t front;                   // points to front
-    int8_t rear;                    // points to rear
+    block *q;                       // contains free blocks in circular array
+    int32_t front;                  // points to front
+    int32_t rear;                   // points to rear
 } queue;
 
+/* a run of contiguous blocks */
+typedef struct extent {
+    block start;                    // first block of the run
+    u_int32_t count;                // number of blocks in the run
+} extent;
+
+/* The extents making up a file, in file order. Built from the fat chain the
+ * first time they are needed and thrown away whenever the chain changes.
+ *
+ * index lists the block number of every block of the file so the block
+ * holding any offset is found without a search. It is filled in from the
+ * extents when a read or positioned write needs it and only the blocks
+ * added since are filled in after an append */
+typedef struct extent_map {
+    extent *ext;                    // runs of blocks
+    u_int32_t count;                // runs in use
+    u_int32_t cap;                  // runs allocated
+    u_int32_t blocks;               // blocks in all the runs
+    block *index;                   // block number of each block of the file
+    u_int32_t indexed;              // blocks filled in in index
+    u_int32_t index_cap;            // blocks allocated in index
+    u_int8_t valid;                 // 0 when the map needs rebuilding from the fat
+} extent_map;
+
+/* a buffer for read_vec */
+typedef struct io_vec {
+    void *base;                     // where to put the data
+    u_int64_t len;                  // how much of it to fill
+} io_vec;
+
+/* a piece of a file that is contiguous on the device */
+typedef struct span {
+    const void *data;               // the data in place, NULL if the device cannot be mapped
+    u_int64_t addr;                 // device address of the data
+    u_int64_t len;                  // bytes in the span
+} span;
+
+/* Records which parts of a table changed since the last flush. Each bit covers
+ * a chunk of 1 << shift entries so neighbouring changes share a write */
+typedef struct dirty_map {
+    u_int64_t *bits;                // one bit per chunk
+    u_int32_t chunks;               // number of chunks in the table
+    u_int8_t shift;                 // entries per chunk as a power of two
+} dirty_map;
+
+typedef struct scrubber scrubber;
+
+/* in memory copy of the meta data for a mounted device. Changes are made here
+ * and written back to the device in batches, see sync_meta */
 typedef struct meta {
-    u_int16_t version;              // used to check the file system for initialization
-    dir_entry dir[MAX_FILES];       // point to entry point in fat for block start
-    u_int8_t fat[TOTAL_BLOCKS];     // links block together for file las block ends in EOF
-    queue queue;                    // implement circular queue with length of MAX BLOCKS
+    super_block sb;                 // geometry read from the device
+    block_dev *dev;                 // device the file system is mounted on
+    block_cache *cache;             // data block cache, NULL when the device is mapped
+    dir_entry *dir;                 // point to entry point in fat for block start
+    block *fat;                     // links block together for file las block ends in EOF
+    queue queue;                    // implement circular queue with length of total blocks
+    extent_map *extents;            // one per directory entry, only kept in memory
+    frame_map *frames;              // one per directory entry, used by compressed files
+    open_file *opens;               // one per directory entry, only kept in memory
+    file_handle handles[MAX_HANDLES]; // open file table
+    pthread_rwlock_t *locks;        // one per directory entry, guards the entry and its extents
+    pthread_mutex_t open_lock;      // guards the open file table
+    pthread_mutex_t alloc_lock;     // guards the fat, queue and free bitmap
+    pthread_mutex_t meta_lock;      // held while the meta data is written back
+    pthread_mutex_t name_lock;      // held while a name is added or removed
+    filename root;                  // entry of the root directory, NO_FILE until a path is used
+    filename next_entry;            // where the search for a free entry starts
+    u_int64_t *free_bits;           // one bit per block, set when the block is free
+    u_int32_t free_count;           // number of bits set in free_bits
+    block *reclaim;                 // first blocks of chains to free once the next flush commits, see free_blocks
+    u_int32_t reclaim_count;        // chains in reclaim
+    u_int32_t reclaim_cap;          // chains reclaim has room for
+    u_int32_t reclaim_blocks;       // blocks in them, counted by availableBlocks
+
+    dirty_map dir_dirty;            // directory entries changed since the last flush
+    dirty_map fat_dirty;            // fat entries changed since the last flush
+    dirty_map queue_dirty;          // queue slots changed since the last flush
+    dirty_map crc_dirty;            // block checksums changed since the last flush
+    u_int8_t ends_dirty;            // queue front or rear changed since the last flush
+    u_int32_t pending_ops;          // operations since the last flush
+    u_int32_t flush_ops;            // flush after this many operations, 0 waits for sync_fs
+    u_int32_t flush_secs;           // flush after this many seconds, 0 disables the timer
+    u_int8_t *journal;              // transaction being built, journal_size bytes
+    u_int32_t journal_len;          // bytes of records in it
+    u_int32_t journal_head;         // where the next transaction goes in the journal
+    u_int8_t journal_over;          // set when the transaction outgrew the journal
+    u_int8_t logging;               // meta data writes go to the journal when set
+    u_int32_t meta_seq;             // sequence number of the last slot or transaction written
+    u_int32_t cur_slot;             // slot of the last checkpoint
+    u_int8_t queue_rebuilt;         // the free queue did not match the fat at mount
+    u_int64_t ckpt_base;            // device offset of the slot being written
+    u_int32_t ckpt_crc;             // running checksum of the slot being written
+    dev_batch *ckpt_batch;          // writes of the checkpoint being built, NULL otherwise
+    u_int32_t *crcs;                // checksum of each data block, NULL without FEAT_CRC
+    u_int32_t features;             // FEAT_ bits the next format_fs turns on, see set_checksums
+    u_int8_t verify;                // reads check the blocks they touch against crcs
+    scrubber *scrub;                // background scrubber, NULL when it is not running
+    time_t last_flush;              // time of the last flush
+    fs_stats stats;                 // counters and latencies since mount, see get_stats
 } meta_data;
 
-/* functions used for circular array */
-int8_t isEmpty(meta_data *md);
-int8_t isFull(meta_data *md);
-void enQueue(meta_data *md, u_int8_t blk);
-int8_t deQueue(meta_data *md);
-signed short availableBlocks(meta_data *md);
-void display(meta_data *md);
+/* position of a walk over a file with span_next */
+typedef struct span_iter {
+    meta_data *md;
+    filename file_name;
+    u_int64_t pos;                  // file offset of the next span
+    u_int64_t end;                  // file offset the walk stops at
+    u_int32_t blk;                  // block of the file holding pos
+    u_int32_t skip;                 // bytes into that block
+} span_iter;
 
-/* functions used for manipulating storage */
-void init_fat(meta_data *md, FILE *f);
-u_int8_t scan_blocks(meta_data *md, u_int16_t file_size);
-void free_blocks(meta_data *md, u_int8_t start_pos);
-FILE *open_for_read(meta_data *md, u_int8_t file_name);
-FILE *open_for_write(meta_data *md, u_int8_t file_name);
-FILE *open_for_append(meta_data *md, u_int8_t file_name);
-u_int8_t read(meta_data *md, u_int8_t file_name, FILE *f, char *data[]);
-u_int8_t write(meta_data *md, u_int8_t file_name, char data[], u_int16_t size, FILE *f);
-u_int8_t append(meta_data *md, u_int8_t file_name,char data[], u_int16_t size, FILE *f);
-u_int8_t close_file(meta_data *md, int8_t file_name, FILE *f);
-u_int8_t delete(meta_data *md, u_int8_t file_name);
-
-/* The following are used functions used to create a circular
- * queue. This was done to add some level of wear leveling to
- * the device. the idea hear is that the first blocks of memory
- * freed for use are to be the last blocks used in storage.
- *
- * However, this only solves the problem of block wear levelling.
- * and does not solve the issue of the wear leveling associated
- * to writing the meta data to the same location.
- *
- * This issue will be left as a task to whoever looks at this code
- * and wants to modify it.
-*/
-
-/* Checks to see if the queue is empty. An empty queue implies all free blocks are in use */
-int8_t isEmpty(meta_data *md) {
-    if (md->queue.front == -1) return -1;
-    return 0;
-}
+/* returns the device address of a block */
+#define BLOCK_ADDR(md, blk) ((md)->sb.data_start + (u_int64_t) (blk) * (md)->sb.block_size)
 
-/* Checks to see if the queue is full. A full queue implies all blocks are free */
-int8_t isFull(meta_data *md) {
-    if ((md->queue.front == md->queue.rear + 1) || (md->queue.front == 0 && md->queue.rear == TOTAL_BLOCKS - 1)) {
-        return 1;
-    }
-    return 0;
+/* marks a table entry as changed. Entries belonging to different files share
+ * a word so the bit is set atomically */
+static inline void mark_dirty(dirty_map *dm, u_int32_t entry) {
+    u_int32_t chunk = entry >> dm->shift;
+    __atomic_fetch_or(&dm->bits[chunk / 64], 1ULL << (chunk % 64), __ATOMIC_ACQ_REL);
 }
 
-/* Adds a block to the rear of the queue, this helps for wear levelling */
-void enQueue(meta_data *md, u_int8_t blk) {
-
-    if (isFull(md)) {
-        printf("Cannot free more blocks as all blocks are free\n");
-    } else {
-        if (md->queue.front == -1) md->queue.front = 0;
-
-        md->queue.rear = (md->queue.rear + 1);                      // two lines work as mod as mod can have
-        if (md->queue.rear == TOTAL_BLOCKS) {
-            md->queue.rear = 0;     // irregular behavior in c
-        }
+/* The free bitmap mirrors the queue. A block is in the queue exactly when
+ * its bit is set, the bitmap just answers "is it free" and "how many are
+ * free" without walking the queue */
+static inline u_int8_t is_free(meta_data *md, block blk) {
+    return (md->free_bits[blk / 64] >> (blk % 64)) & 1;
+}
 
-        md->queue.q[md->queue.rear] = blk;
-    }
+static inline void mark_free(meta_data *md, block blk) {
+    if (blk >= md->sb.total_blocks || is_free(md, blk)) return;
+    md->free_bits[blk / 64] |= 1ULL << (blk % 64);
+    __atomic_fetch_add(&md->free_count, 1, __ATOMIC_RELAXED); // read without the allocator lock
 }
 
-/* Takes a block from the front of the queue */
-int8_t deQueue(meta_data *md) {
-    int8_t block;
-
-    if (isEmpty(md)) {
-        printf("No free blocks available\n");
-        return (-1);
-    } else {
-        block = md->queue.q[md->queue.front];
-        if (md->queue.front == md->queue.rear) {
-            md->queue.front = -1;
-            md->queue.rear = -1;
-        } else {
-            md->queue.front = (md->queue.front + 1);                    // two lines work as mod as mod can have
-            if (md->queue.front >= TOTAL_BLOCKS) md->queue.front = 0;   // irregular behavior in c
-        }
-        return block;
-    }
+static inline void mark_used(meta_data *md, block blk) {
+    if (blk >= md->sb.total_blocks || !is_free(md, blk)) return;
+    md->free_bits[blk / 64] &= ~(1ULL << (blk % 64));
+    __atomic_fetch_sub(&md->free_count, 1, __ATOMIC_RELAXED);
 }
 
-/* Calculates the remaining available blocks based on the circular queue front and rear pointers*/
-signed short availableBlocks(meta_data *md) {
-    short signed int head = md->queue.front;
-    short signed int tail = md->queue.rear;
-
-    if (head==-1 || tail==-1) {
-        printf("TRUE");
-        return TOTAL_BLOCKS;
-    }
-    else if ((head-tail)<0) return (tail-head) + 1;
-    else return TOTAL_BLOCKS - (head-tail) + 1;
+/* every change to the fat goes through here so it gets written back */
+static inline void set_fat(meta_data *md, block blk, block next) {
+    md->fat[blk] = next;
+    mark_dirty(&md->fat_dirty, blk);
 }
 
-/* Displays if the queue is empty or the position of the first and last block currently in the queue */
-void display(meta_data *md) {
-    int8_t i;
-    if (isEmpty(md)) printf("All blocks in use\n");
-    else {
-        printf("Next available block -> %d\n", md->queue.front);
-        printf("Last available block -> %d\n", md->queue.rear);
-    }
-}
\ No newline at end of file
+/* functions used for circular array, callers hold alloc_lock */
+int8_t isEmpty(meta_data *md);
+int8_t isFull(meta_data *md);
+void enQueue(meta_data *md, block blk);
+block deQueue(meta_data *md);
+int64_t availableBlocks(meta_data *md);
+void display(meta_data *md);
+
+/* functions used for manipulating storage */
+u_int8_t format_fs(meta_data *md, block_dev *dev, u_int32_t block_size, u_int32_t max_files);
+u_int64_t image_size(u_int32_t block_size, u_int32_t blocks, u_int32_t max_files, u_int32_t features);
+u_int8_t init_fat(meta_data *md, block_dev *dev);
+u_int8_t write_meta(meta_data *md);
+u_int8_t sync_meta(meta_data *md);
+u_int8_t sync_fs(meta_data *md);
+void set_flush_policy(meta_data *md, u_int32_t ops, u_int32_t secs);
+void set_checksums(meta_data *md, u_int8_t on);
+void set_verify(meta_data *md, u_int8_t on);
+u_int8_t start_scrub(meta_data *md, u_int32_t blocks_per_sec);
+void stop_scrub(meta_data *md);
+u_int8_t scrub_fs(meta_data *md, u_int32_t *bad);
+void unmount(meta_data *md);
+u_int32_t scan_blocks(meta_data *md, u_int32_t file_size);
+void free_blocks(meta_data *md, block start_pos, u_int32_t blocks);
+u_int32_t free_run(meta_data *md, block start, u_int32_t max);
+u_int8_t find_free_run(meta_data *md, u_int32_t want, extent *ext);
+u_int8_t alloc_extent(meta_data *md, u_int32_t want, extent *ext);
+block alloc_chain(meta_data *md, u_int32_t count);
+extent_map *get_extents(meta_data *md, filename file_name);
+file_handle *open_for_read(meta_data *md, filename file_name);
+file_handle *open_for_write(meta_data *md, filename file_name);
+file_handle *open_for_append(meta_data *md, filename file_name);
+file_handle *open_for_update(meta_data *md, filename file_name);
+u_int32_t read_file(meta_data *md, file_handle *h, char data[], u_int32_t size);
+int64_t read_at(meta_data *md, file_handle *h, u_int64_t offset, void *buf, u_int64_t len);
+int64_t read_vec(meta_data *md, file_handle *h, u_int64_t offset, const io_vec *iov, u_int32_t iovcnt);
+void span_begin(span_iter *it, meta_data *md, file_handle *h, u_int64_t offset, u_int64_t len);
+u_int8_t span_next(span_iter *it, span *sp);
+u_int8_t write_file(meta_data *md, file_handle *h, char data[], u_int32_t size);
+int64_t write_at(meta_data *md, file_handle *h, u_int64_t offset, const void *buf, u_int64_t len);
+int64_t seek_file(meta_data *md, file_handle *h, int64_t offset, int whence);
+u_int8_t truncate_file(meta_data *md, file_handle *h, u_int64_t len);
+u_int8_t append_file(meta_data *md, file_handle *h, char data[], u_int32_t size);
+u_int8_t log_append(meta_data *md, file_handle *h, const char data[], u_int32_t size);
+u_int8_t log_flush(meta_data *md, file_handle *h);
+u_int8_t set_compressed(meta_data *md, file_handle *h, u_int8_t on);
+u_int32_t pack_frame(const void *raw, u_int32_t len, void *out);
+u_int8_t close_file(meta_data *md, file_handle *h);
+u_int8_t delete_file(meta_data *md, filename file_name);
+u_int8_t resolve_path(meta_data *md, const char *path, filename *out);
+u_int8_t stat_path(meta_data *md, const char *path, file_stat *st);
+u_int8_t make_dir(meta_data *md, const char *path);
+file_handle *open_path(meta_data *md, const char *path, u_int8_t mode);
+u_int8_t remove_path(meta_data *md, const char *path);
+u_int8_t read_dir(meta_data *md, filename dir, u_int32_t *pos, dir_item *item);
+u_int8_t stat_dir(meta_data *md, filename dir, dir_header *hdr);
+u_int8_t drop_name(meta_data *md, filename dir, u_int32_t slot);
+u_int8_t rebuild_dir(meta_data *md, filename dir);
+u_int8_t reserve_dir(meta_data *md, filename dir, u_int32_t names);
+u_int64_t dir_size(u_int32_t names);
+void get_stats(meta_data *md, fs_stats *out);
+void dump_stats(meta_data *md, FILE *f);
+void dump_wear(meta_data *md, FILE *f);
+u_int8_t save_wear(meta_data *md, FILE *f);
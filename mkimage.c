@@ -0,0 +1,449 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "device.h"
+#include "cache.h"
+#include "log.h"
+#include "stats.h"
+#include "main.h"
+
+/* Builds an image from a directory on the host in one pass. The tree is
+ * scanned first so the size of every file and directory is known, then a
+ * fresh image is formatted and filled
+ *
+ *   directories  made in breadth first order, each table sized for all of
+ *                its names at once so it is written once and never grows
+ *   files        copied in the same order, one after another, so each file
+ *                is one run of blocks following on from the one before
+ *
+ * The fat, directory and free queue are only kept in memory while the image
+ * is filled and are written once at the end with a single checkpoint. With
+ * the image mapped the data goes out as large sequential writes when the
+ * mapping is flushed. Names are sorted so the same tree always gives the same
+ * image.
+ *
+ * Without -s the image is made just large enough for the tree and the spare
+ * space asked for with -x. With -c the image keeps a checksum of every block,
+ * worked out as the files are copied in. With -z every file is compressed,
+ * each is packed once while scanning so the image can be sized to fit.
+ *
+ * Build with main.c compiled as a library, see the README
+ *   gcc -O2 -DMINIFAT_LIB -o mkimage mkimage.c main.c device.c aio.c cache.c crc.c lz.c stats.c -lpthread
+ */
+
+#define MKIMAGE_BLOCK   0x0200      // block size unless -b is given
+#define COPY_CHUNK      0x100000    // bytes copied from a host file at a time
+
+/* a file or directory found on the host */
+typedef struct node {
+    char *host;                     // path on the host
+    char *path;                     // path in the image
+    u_int64_t size;                 // bytes in a file
+    u_int64_t stored;               // bytes it takes in the image
+    u_int32_t names;                // names in a directory
+    u_int8_t dir;
+} node;
+
+typedef struct tree {
+    node *nodes;                    // root first, then breadth first
+    u_int32_t count;
+    u_int32_t cap;
+    u_int32_t files;
+    u_int32_t dirs;                 // including the root
+    u_int64_t bytes;                // bytes in all the files
+    u_int64_t stored;               // bytes they take in the image
+} tree;
+
+static u_int8_t verbose = 0;
+static u_int8_t compress = 0;       // -z, files are stored compressed
+
+static double seconds(void) {
+    return stat_start() / 1e9;
+}
+
+static int by_name(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* joins a directory path and a name */
+static char *join(const char *dir, const char *name) {
+    size_t len = strlen(dir);
+    char *path;
+
+    path = malloc(len + strlen(name) + 2);
+    if (path == NULL) return NULL;
+    if (len > 0 && dir[len - 1] == '/') sprintf(path, "%s%s", dir, name);
+    else sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+static u_int8_t add_node(tree *t, char *host, char *path, u_int64_t size, u_int8_t dir) {
+    node *nodes;
+
+    if (host == NULL || path == NULL) {
+        free(host);
+        free(path);
+        printf("ERROR Out of memory\n");
+        return 0;
+    }
+    if (t->count == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 0x40;
+        nodes = realloc(t->nodes, t->cap * sizeof(node));
+        if (nodes == NULL) {
+            printf("ERROR Out of memory\n");
+            return 0;
+        }
+        t->nodes = nodes;
+    }
+
+    memset(&t->nodes[t->count], 0, sizeof(node));
+    t->nodes[t->count].host = host;
+    t->nodes[t->count].path = path;
+    t->nodes[t->count].size = size;
+    t->nodes[t->count].stored = size;
+    t->nodes[t->count].dir = dir;
+    t->count++;
+
+    if (dir) t->dirs++;
+    else t->files++;
+    t->bytes += size;
+    return 1;
+}
+
+/* Adds the names in directory i of the tree in sorted order. Anything that is
+ * not a plain file or a directory is left out */
+static u_int8_t scan_dir(tree *t, u_int32_t i) {
+    struct dirent *ent;
+    struct stat st;
+    char **names = NULL;
+    u_int32_t count = 0, cap = 0;
+    char *host, *path;
+    u_int8_t ok = 1;
+    char **grown;
+    DIR *d;
+
+    d = opendir(t->nodes[i].host);
+    if (d == NULL) {
+        printf("ERROR Cannot read directory -> Path: %s\n", t->nodes[i].host);
+        return 0;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 0x10;
+            grown = realloc(names, cap * sizeof(char *));
+            if (grown == NULL) {
+                ok = 0;
+                break;
+            }
+            names = grown;
+        }
+        names[count] = strdup(ent->d_name);
+        if (names[count] == NULL) {
+            ok = 0;
+            break;
+        }
+        count++;
+    }
+    closedir(d);
+    if (!ok) printf("ERROR Out of memory\n");
+
+    qsort(names, count, sizeof(char *), by_name);
+    for (u_int32_t k = 0; ok && k < count; k++) {
+        if (strlen(names[k]) > NAME_LEN) {
+            printf("ERROR Name too long -> Path: %s/%s; Limit: %u\n", t->nodes[i].host, names[k], NAME_LEN);
+            ok = 0;
+            break;
+        }
+
+        host = join(t->nodes[i].host, names[k]);
+        if (host == NULL || lstat(host, &st) < 0) {
+            printf("ERROR Cannot stat -> Path: %s/%s\n", t->nodes[i].host, names[k]);
+            free(host);
+            ok = 0;
+            break;
+        }
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            printf("WARN Skipped, not a file or directory -> Path: %s\n", host);
+            free(host);
+            continue;
+        }
+        if (S_ISREG(st.st_mode) && (u_int64_t) st.st_size > 0xFFFFFFFF) {
+            printf("ERROR File too long -> Path: %s\n", host);
+            free(host);
+            ok = 0;
+            break;
+        }
+
+        path = join(t->nodes[i].path, names[k]);
+        ok = add_node(t, host, path, S_ISREG(st.st_mode) ? st.st_size : 0, S_ISDIR(st.st_mode));
+        if (ok) t->nodes[i].names++;
+    }
+
+    for (u_int32_t k = 0; k < count; k++) free(names[k]);
+    free(names);
+    return ok;
+}
+
+/* walks the host tree breadth first from root */
+static u_int8_t scan_tree(tree *t, const char *root) {
+    struct stat st;
+
+    if (stat(root, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        printf("ERROR Not a directory -> Path: %s\n", root);
+        return 0;
+    }
+    if (!add_node(t, strdup(root), strdup("/"), 0, 1)) return 0;
+
+    /* the tree grows behind i, directories found are read in turn */
+    for (u_int32_t i = 0; i < t->count; i++) {
+        if (t->nodes[i].dir && !scan_dir(t, i)) return 0;
+    }
+    return 1;
+}
+
+/* Works out what a file takes compressed by packing it the way the file
+ * system will, a frame at a time */
+static u_int8_t pack_file(node *n, char *buf, u_int8_t *frame) {
+    u_int64_t left = n->size;
+    ssize_t got;
+    int fd;
+
+    fd = open(n->host, O_RDONLY);
+    if (fd < 0) {
+        printf("ERROR Cannot open -> Path: %s\n", n->host);
+        return 0;
+    }
+
+    n->stored = 0;
+    while (left > 0) {
+        got = read(fd, buf, left < FRAME_SIZE ? left : FRAME_SIZE);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) {
+            printf("ERROR Cannot read -> Path: %s\n", n->host);
+            close(fd);
+            return 0;
+        }
+        if (got == 0) break;
+        n->stored += pack_frame(buf, got, frame);
+        left -= got;
+    }
+    close(fd);
+    return 1;
+}
+
+/* packs every file of the tree, see pack_file */
+static u_int8_t pack_tree(tree *t) {
+    u_int8_t frame[FRAME_MAX];
+    char buf[FRAME_SIZE];
+
+    t->stored = 0;
+    for (u_int32_t i = 0; i < t->count; i++) {
+        if (t->nodes[i].dir) continue;
+        if (!pack_file(&t->nodes[i], buf, frame)) return 0;
+        t->stored += t->nodes[i].stored;
+    }
+    return 1;
+}
+
+/* data blocks the tree takes once copied */
+static u_int64_t tree_blocks(tree *t, u_int32_t block_size) {
+    u_int64_t blocks = 0;
+    u_int64_t bytes;
+
+    for (u_int32_t i = 0; i < t->count; i++) {
+        bytes = t->nodes[i].dir ? dir_size(t->nodes[i].names) : t->nodes[i].stored;
+        blocks += (bytes + block_size - 1) / block_size;
+    }
+    return blocks;
+}
+
+/* makes a directory of the tree in the image and sizes its table */
+static u_int8_t make_node_dir(meta_data *md, node *n) {
+    filename fn;
+
+    if (strcmp(n->path, "/") != 0 && !make_dir(md, n->path)) {
+        printf("ERROR Cannot make directory -> Path: %s\n", n->path);
+        return 0;
+    }
+    if (!resolve_path(md, n->path, &fn) || !reserve_dir(md, fn, n->names)) {
+        printf("ERROR Cannot size directory -> Path: %s; Names: %u\n", n->path, n->names);
+        return 0;
+    }
+    return 1;
+}
+
+/* copies a host file into the image, in chunks of buf */
+static u_int8_t copy_file(meta_data *md, node *n, char *buf) {
+    file_handle *h;
+    u_int64_t left = n->size;
+    ssize_t got;
+    u_int8_t ok = 1;
+    int fd;
+
+    fd = open(n->host, O_RDONLY);
+    if (fd < 0) {
+        printf("ERROR Cannot open -> Path: %s\n", n->host);
+        return 0;
+    }
+    h = open_path(md, n->path, WRITE);
+    if (h == NULL) {
+        printf("ERROR Cannot create -> Path: %s\n", n->path);
+        close(fd);
+        return 0;
+    }
+    if (compress && !set_compressed(md, h, 1)) {
+        printf("ERROR Cannot compress -> Path: %s\n", n->path);
+        ok = 0;
+    }
+
+    /* a file that changed since the scan is cut or ends early, never grows */
+    while (ok && left > 0) {
+        got = read(fd, buf, left < COPY_CHUNK ? left : COPY_CHUNK);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) {
+            printf("ERROR Cannot read -> Path: %s\n", n->host);
+            ok = 0;
+        } else if (got == 0) {
+            printf("WARN File shrank while copying -> Path: %s\n", n->host);
+            break;
+        } else if (!write_file(md, h, buf, got)) {
+            printf("ERROR Cannot write -> Path: %s\n", n->path);
+            ok = 0;
+        } else {
+            left -= got;
+        }
+    }
+
+    ok = close_file(md, h) && ok;
+    close(fd);
+    return ok;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-b block size] [-s image MB] [-x spare KB] [-n files] [-c] [-z] [-f] [-v] source image\n"
+                    "  -b  bytes per block, %u by default\n"
+                    "  -s  size of the image, otherwise just large enough for source and the spare space\n"
+                    "  -x  free space to leave in an image sized to fit\n"
+                    "  -n  directory entries, otherwise one per file and directory in source\n"
+                    "  -c  keep a checksum of every block\n"
+                    "  -z  compress every file\n"
+                    "  -f  use positioned reads and writes instead of mmap\n"
+                    "  -v  keep the log of the file system\n", prog, MKIMAGE_BLOCK);
+}
+
+int main(int argc, char *argv[]) {
+    u_int32_t block_size = MKIMAGE_BLOCK;
+    u_int64_t size = 0;
+    u_int64_t spare = 0;
+    u_int64_t blocks, needed;
+    u_int32_t max_files = 0;
+    u_int32_t features = 0;
+    u_int8_t file_backend = 0;
+    u_int8_t ok = 1;
+    const char *image;
+    block_dev *dev;
+    meta_data *md;
+    double start;
+    char *buf;
+    tree t;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:s:x:n:czfvh")) != -1) {
+        switch (opt) {
+            case 'b': block_size = strtoul(optarg, NULL, 0); break;
+            case 's': size = strtoull(optarg, NULL, 0) << 20; break;
+            case 'x': spare = strtoull(optarg, NULL, 0) << 10; break;
+            case 'n': max_files = strtoul(optarg, NULL, 0); break;
+            case 'c': features |= FEAT_CRC; break;
+            case 'z': compress = 1; break;
+            case 'f': file_backend = 1; break;
+            case 'v': verbose = 1; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind + 2 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    image = argv[optind + 1];
+    if (!verbose) set_log_level(LOG_NONE);
+
+    start = seconds();
+    memset(&t, 0, sizeof(t));
+    if (!scan_tree(&t, argv[optind])) return 1;
+    t.stored = t.bytes;
+    if (compress && !pack_tree(&t)) return 1;
+
+    if (max_files == 0) max_files = t.count;
+    if (max_files < t.count) {
+        printf("ERROR Too few directory entries -> Entries: %u; Needed: %u\n", max_files, t.count);
+        return 1;
+    }
+
+    blocks = tree_blocks(&t, block_size) + (spare + block_size - 1) / block_size;
+    needed = image_size(block_size, blocks > 0xFFFFFFFF ? 0 : blocks, max_files, features);
+    if (needed == 0) {
+        printf("ERROR Too many blocks for one image -> Blocks: %llu\n", (unsigned long long) blocks);
+        return 1;
+    }
+    if (size == 0) size = needed;
+    if (size < needed) {
+        printf("ERROR Image too small -> Size: %llu; Needed: %llu\n", (unsigned long long) size, (unsigned long long) needed);
+        return 1;
+    }
+
+    /* starts from an empty file so nothing of an old image is left behind */
+    if (unlink(image) < 0 && errno != ENOENT) {
+        printf("ERROR Cannot replace image -> Path: %s\n", image);
+        return 1;
+    }
+    dev = file_backend ? file_dev_open(image, size) : mmap_dev_open(image, size);
+    md = calloc(1, sizeof(meta_data));
+    buf = malloc(COPY_CHUNK);
+    if (dev == NULL || md == NULL || buf == NULL) {
+        printf("ERROR Cannot create image -> Path: %s\n", image);
+        return 1;
+    }
+    set_checksums(md, features & FEAT_CRC);
+    if (!format_fs(md, dev, block_size, max_files)) {
+        printf("ERROR Cannot format image -> Size: %llu; Block size: %u\n", (unsigned long long) size, block_size);
+        return 1;
+    }
+
+    /* the meta data is written once, by sync_fs at the end */
+    set_flush_policy(md, 0, 0);
+
+    /* tables first so they sit together ahead of the file data */
+    for (u_int32_t i = 0; ok && i < t.count; i++) {
+        if (t.nodes[i].dir) ok = make_node_dir(md, &t.nodes[i]);
+    }
+    for (u_int32_t i = 0; ok && i < t.count; i++) {
+        if (!t.nodes[i].dir) ok = copy_file(md, &t.nodes[i], buf);
+    }
+    if (ok && !sync_fs(md)) {
+        printf("ERROR Cannot write meta data\n");
+        ok = 0;
+    }
+
+    printf("Image -> Path: %s; Size: %llu; Block size: %u; Blocks: %u; Free: %lld\n", image,
+           (unsigned long long) dev->size, md->sb.block_size, md->sb.total_blocks, (long long) availableBlocks(md));
+    printf("Loaded -> Files: %u; Directories: %u; Bytes: %llu; Stored: %llu; Time: %.1f ms\n", t.files, t.dirs,
+           (unsigned long long) t.bytes, (unsigned long long) t.stored, (seconds() - start) * 1e3);
+    unmount(md);
+
+    for (u_int32_t i = 0; i < t.count; i++) {
+        free(t.nodes[i].host);
+        free(t.nodes[i].path);
+    }
+    free(t.nodes);
+    free(buf);
+    free(md);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include "log.h"
+#include "stats.h"
+
+int log_level = LOG_LEVEL;
+
+void set_log_level(int level) {
+    log_level = level;
+}
+
+/* ---------------------------------------------------------------------------
+ * latency histograms
+ * ------------------------------------------------------------------------- */
+
+/* The bucket of a value is the position of its top bit followed by the
+ * HIST_SUB_BITS bits after it. Small values get a bucket each */
+static u_int32_t hist_bucket(u_int64_t value) {
+    u_int32_t shift;
+
+    if (value < HIST_SUB) return value;
+
+    shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + ((value >> shift) & (HIST_SUB - 1));
+}
+
+/* the smallest value that goes into a bucket */
+static u_int64_t hist_lowest(u_int32_t bucket) {
+    u_int32_t shift;
+
+    if (bucket < HIST_SUB) return bucket;
+
+    shift = (bucket >> HIST_SUB_BITS) - 1;
+    return (u_int64_t) ((bucket & (HIST_SUB - 1)) | HIST_SUB) << shift;
+}
+
+void hist_record(latency_hist *h, u_int64_t value) {
+    u_int64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&h->buckets[hist_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    while (value > max && !__atomic_compare_exchange_n(&h->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+u_int64_t hist_percentile(const latency_hist *h, double pct) {
+    u_int64_t want;
+    u_int64_t seen = 0;
+    u_int64_t low;
+
+    if (h->count == 0) return 0;
+
+    want = (u_int64_t) (h->count * pct / 100.0);
+    if (want >= h->count) want = h->count - 1;
+
+    for (u_int32_t b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > want) {
+            low = hist_lowest(b);
+            if (b < HIST_SUB || b + 1 == HIST_BUCKETS) return low;
+            low += (hist_lowest(b + 1) - low) / 2;
+            return low < h->max ? low : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* ---------------------------------------------------------------------------
+ * snapshots
+ * ------------------------------------------------------------------------- */
+
+void stats_copy(fs_stats *dst, const fs_stats *src) {
+    const u_int64_t *from = (const u_int64_t *) src;
+    u_int64_t *to = (u_int64_t *) dst;
+
+    for (size_t i = 0; i < sizeof(fs_stats) / sizeof(u_int64_t); i++) to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+const char *stat_op_name(enum stat_op op) {
+    static const char *names[OP_COUNT] = {"open", "close", "read", "write", "append", "delete", "flush"};
+
+    return op < OP_COUNT ? names[op] : "unknown";
+}
+
+void stats_print(const fs_stats *s, FILE *f) {
+    const latency_hist *h;
+    u_int64_t lookups;
+
+    fprintf(f, "Operation      Count     Mean ns      p50 ns      p99 ns      Max ns\n");
+    for (u_int32_t op = 0; op < OP_COUNT; op++) {
+        h = &s->lat[op];
+        fprintf(f, "%-8s %11llu %11llu %11llu %11llu %11llu\n", stat_op_name(op),
+                (unsigned long long) h->count,
+                (unsigned long long) (h->count ? h->sum / h->count : 0),
+                (unsigned long long) hist_percentile(h, 50),
+                (unsigned long long) hist_percentile(h, 99),
+                (unsigned long long) h->max);
+    }
+
+    lookups = s->cache_hits + s->cache_misses;
+    fprintf(f, "File data       -> Read: %llu bytes; Written: %llu bytes\n",
+            (unsigned long long) s->bytes_read, (unsigned long long) s->bytes_written);
+    fprintf(f, "Device reads    -> Calls: %llu; Bytes: %llu\n",
+            (unsigned long long) s->dev_reads, (unsigned long long) s->dev_read_bytes);
+    fprintf(f, "Device writes   -> Calls: %llu; Bytes: %llu; Syncs: %llu\n",
+            (unsigned long long) s->dev_writes, (unsigned long long) s->dev_write_bytes, (unsigned long long) s->dev_syncs);
+    fprintf(f, "Device batches  -> %llu\n", (unsigned long long) s->dev_batches);
+    fprintf(f, "Meta data       -> Journal commits: %llu; Checkpoints: %llu\n",
+            (unsigned long long) s->journal_commits, (unsigned long long) s->checkpoints);
+    fprintf(f, "Allocator       -> Hits: %llu; Misses: %llu; Blocks: %llu; Runs: %llu\n",
+            (unsigned long long) s->alloc_hits, (unsigned long long) s->alloc_misses,
+            (unsigned long long) s->alloc_blocks, (unsigned long long) s->alloc_extents);
+    fprintf(f, "Freeing         -> Chains: %llu; Blocks: %llu; Passes: %llu\n",
+            (unsigned long long) s->chains_deferred, (unsigned long long) s->blocks_freed, (unsigned long long) s->reclaims);
+    fprintf(f, "Checksums       -> Verified: %llu; Scrubbed: %llu; Errors: %llu\n",
+            (unsigned long long) s->blocks_verified, (unsigned long long) s->blocks_scrubbed,
+            (unsigned long long) s->crc_errors);
+    fprintf(f, "Compression     -> In: %llu; Out: %llu\n", (unsigned long long) s->zip_in, (unsigned long long) s->zip_out);
+    fprintf(f, "Block cache     -> Hits: %llu; Misses: %llu; Hit rate: %.1f%%\n",
+            (unsigned long long) s->cache_hits, (unsigned long long) s->cache_misses,
+            lookups ? 100.0 * s->cache_hits / lookups : 0.0);
+}
@@ -0,0 +1,102 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* Statistics kept while the file system is mounted. Every counter is a 64 bit
+ * word updated atomically so any thread can add to them without a lock.
+ *
+ * Latencies go into histograms with HIST_SUB_BITS bits of precision per power
+ * of two, so a recorded value is within 1 / (1 << HIST_SUB_BITS) of the real
+ * one however large it is. Values below 1 << HIST_SUB_BITS are exact.
+ */
+
+#define HIST_SUB_BITS   3           // 8 buckets per power of two, 12.5% precision
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+/* operations with a latency histogram */
+enum stat_op {
+    OP_OPEN,                        // open_for_read, open_for_write and open_for_append
+    OP_CLOSE,                       // close_file, including the flush it may start
+    OP_READ,                        // read_at, read_file and read_vec
+    OP_WRITE,                       // write_file and write_at
+    OP_APPEND,                      // append_file and log_append
+    OP_DELETE,                      // delete_file
+    OP_FLUSH,                       // meta data written back to the device
+    OP_COUNT
+};
+
+typedef struct latency_hist {
+    u_int64_t count;                // values recorded
+    u_int64_t sum;                  // nanoseconds in total
+    u_int64_t max;                  // largest value
+    u_int64_t buckets[HIST_BUCKETS];
+} latency_hist;
+
+/* Everything here is a u_int64_t so a snapshot can copy it word by word */
+typedef struct fs_stats {
+    latency_hist lat[OP_COUNT];     // one per stat_op
+    u_int64_t bytes_read;           // file data read
+    u_int64_t bytes_written;        // file data written or appended
+    u_int64_t journal_commits;      // meta data flushes added to the journal
+    u_int64_t checkpoints;          // meta data flushes written to a whole slot
+    u_int64_t alloc_hits;           // runs found in the oldest entries of the queue
+    u_int64_t alloc_misses;         // runs that needed a search of the free bitmap
+    u_int64_t alloc_blocks;         // blocks handed out
+    u_int64_t alloc_extents;        // runs they were handed out in
+    u_int64_t chains_deferred;      // chains handed over to be freed with the next flush
+    u_int64_t blocks_freed;         // blocks those gave back
+    u_int64_t reclaims;             // times the chains waiting were freed together
+    u_int64_t blocks_verified;      // blocks checked against their checksum by reads
+    u_int64_t blocks_scrubbed;      // blocks checked by the scrubber
+    u_int64_t crc_errors;           // blocks that did not match their checksum
+    u_int64_t zip_in;               // file data packed into frames of compressed files
+    u_int64_t zip_out;              // bytes of frames it was packed into
+
+    /* filled in by get_stats from the device and the block cache */
+    u_int64_t dev_reads;            // read calls to the device
+    u_int64_t dev_read_bytes;
+    u_int64_t dev_writes;           // write calls to the device
+    u_int64_t dev_write_bytes;
+    u_int64_t dev_syncs;
+    u_int64_t dev_batches;          // batches of reads and writes submitted together
+    u_int64_t cache_hits;           // blocks found in the block cache
+    u_int64_t cache_misses;         // blocks the cache read from the device
+} fs_stats;
+
+static inline void stat_add(u_int64_t *counter, u_int64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/* returns a time stamp in nanoseconds to pass to stat_done */
+static inline u_int64_t stat_start(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* adds a value to a histogram */
+void hist_record(latency_hist *h, u_int64_t value);
+
+/* records how long an operation started at start took */
+static inline void stat_done(fs_stats *s, enum stat_op op, u_int64_t start) {
+    hist_record(&s->lat[op], stat_start() - start);
+}
+
+/* Returns the value below which pct percent of the recorded values lie, as
+ * the middle of the bucket holding it. 0 if nothing was recorded */
+u_int64_t hist_percentile(const latency_hist *h, double pct);
+
+/* copies the counters of src into dst, each word is read atomically */
+void stats_copy(fs_stats *dst, const fs_stats *src);
+
+/* name of an operation as printed by stats_print */
+const char *stat_op_name(enum stat_op op);
+
+/* prints a snapshot as text, one operation per line */
+void stats_print(const fs_stats *s, FILE *f);
+
+#endif
@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "device.h"
+#include "cache.h"
+#include "log.h"
+#include "stats.h"
+#include "main.h"
+
+/* Runs threads writing, appending, reading and deleting the same files at
+ * once, then checks the fat, the free bitmap and the free queue still agree.
+ * Every byte of a file is its tag, so a read seeing a byte of any other file
+ * or of a freed block is caught while the threads run. The checks are made
+ * again after the image has been mounted again.
+ *
+ * Build with main.c compiled as a library, see the README
+ *   gcc -O2 -DMINIFAT_LIB -o test_stress test_stress.c main.c device.c aio.c cache.c crc.c lz.c stats.c -lpthread
+ *
+ *   ./test_stress [-t threads] [-n ops per thread] [-f] [-v]
+ *
+ * -f runs with the block cache instead of mapping the image. The exit status
+ * is 0 when nothing was found wrong.
+ */
+
+#define TEST_IMAGE      "/tmp/minifat_test_stress.img"
+#define TEST_IMAGE_LEN  (16ULL << 20)   // 16M bytes
+#define TEST_BLOCK_SIZE 512
+#define TEST_MAX_FILES  64
+#define STRESS_FILES    24          // files the threads fight over
+#define MAX_WRITE       0x6000      // 24k bytes written at most at once
+#define MAX_THREADS     64
+
+static u_int32_t ops = 2000;
+static u_int32_t failures;          // added to with __atomic, the threads fail too
+static meta_data *md;
+
+static void fail(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    printf("FAIL ");
+    vprintf(fmt, ap);
+    va_end(ap);
+    __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+}
+
+/* every byte of a file is its tag */
+static char tag(filename fn) {
+    return 'A' + fn;
+}
+
+/* writes size bytes of fn's tag, in two pieces so a write carries on from the
+ * one before */
+static void do_write(filename fn, char *buf, u_int32_t size) {
+    file_handle *h = open_for_write(md, fn);
+    if (h == NULL) return; // open somewhere else
+    memset(buf, tag(fn), size);
+    if (!write_file(md, h, buf, size / 2) || !write_file(md, h, buf, size - size / 2)) fail("write -> File: %u; Size: %u\n", fn, size);
+    close_file(md, h);
+}
+
+static void do_append(filename fn, char *buf, u_int32_t size) {
+    file_handle *h = open_for_append(md, fn);
+    if (h == NULL) return;
+    memset(buf, tag(fn), size);
+    if (!append_file(md, h, buf, size)) fail("append -> File: %u; Size: %u\n", fn, size);
+    close_file(md, h);
+}
+
+/* reads the whole file and checks every byte is its tag */
+static void do_read(filename fn, char *buf) {
+    u_int64_t pos = 0;
+    int64_t got;
+    file_handle *h = open_for_read(md, fn);
+
+    if (h == NULL) return;
+    while ((got = read_at(md, h, pos, buf, MAX_WRITE)) > 0) {
+        for (int64_t i = 0; i < got; i++) {
+            if (buf[i] != tag(fn)) {
+                fail("read -> File: %u; Offset: %llu\n", fn, (unsigned long long) (pos + i));
+                break;
+            }
+        }
+        pos += got;
+    }
+    if (got < 0) fail("read -> File: %u; Offset: %llu\n", fn, (unsigned long long) pos);
+    close_file(md, h);
+}
+
+static void *worker(void *arg) {
+    unsigned int seed = (unsigned int) (size_t) arg * 7919 + 1;
+    char *buf = malloc(MAX_WRITE);
+    filename fn;
+    u_int32_t size;
+
+    if (buf == NULL) {
+        fail("out of memory -> Thread: %u\n", (u_int32_t) (size_t) arg);
+        return NULL;
+    }
+    for (u_int32_t i = 0; i < ops; i++) {
+        fn = rand_r(&seed) % STRESS_FILES;
+        size = rand_r(&seed) % MAX_WRITE + 1;
+        switch (rand_r(&seed) % 8) {
+            case 0: case 1: do_write(fn, buf, size); break;
+            case 2: case 3: do_append(fn, buf, size / 8 + 1); break;
+            case 4: case 5: case 6: do_read(fn, buf); break;
+            default: delete_file(md, fn); break; // fails while the file is open
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Follows every chain and checks no block is reached twice, none is free, each
+ * ends where its length says and the free bitmap and queue hold exactly the
+ * blocks no chain reaches. Run with nothing else using the file system */
+static void check_chains(const char *when) {
+    u_int32_t total = md->sb.total_blocks;
+    u_int32_t bs = md->sb.block_size;
+    u_int32_t in_use = 0;
+    u_int32_t queued = 0;
+    u_int32_t free_bits = 0;
+    u_int32_t need;
+    u_int8_t *seen;
+    int32_t pos;
+    u_int8_t cut;
+    block b;
+
+    printf("Checking %s\n", when);
+    seen = calloc(total, 1);
+    if (seen == NULL) {
+        fail("out of memory -> Blocks: %u\n", total);
+        return;
+    }
+
+    if (md->reclaim_count != 0) fail("chains left to free -> Chains: %u\n", md->reclaim_count);
+
+    for (filename fn = 0; fn < md->sb.max_files; fn++) {
+        if (md->dir[fn].startblock == FREE_BLOCK) continue;
+        need = md->dir[fn].length / bs + (md->dir[fn].length % bs != 0);
+        if (need == 0) need = 1;
+
+        b = md->dir[fn].startblock;
+        cut = 0;
+        for (u_int32_t i = 0; i < need && !cut; i++) {
+            if (b >= total) {
+                fail("chain cut short -> File: %u; Block: %u\n", fn, i);
+                cut = 1;
+                break;
+            }
+            if (seen[b]) fail("block reached twice -> File: %u; Block: %u\n", fn, b);
+            if (is_free(md, b) || md->fat[b] == FREE_BLOCK) fail("free block in chain -> File: %u; Block: %u\n", fn, b);
+            seen[b] = 1;
+            in_use++;
+            b = md->fat[b];
+        }
+        if (!cut && b != END_BLOCK) fail("chain runs past its length -> File: %u; Next: %u\n", fn, b);
+    }
+
+    for (b = 0; b < total; b++) {
+        if (is_free(md, b)) free_bits++;
+        if (!seen[b] && md->fat[b] != FREE_BLOCK) fail("lost block -> Block: %u; Fat: %u\n", b, md->fat[b]);
+        if (!seen[b] && !is_free(md, b)) fail("free block not in bitmap -> Block: %u\n", b);
+    }
+    if (free_bits != md->free_count) fail("free count wrong -> Bitmap: %u; Count: %u\n", free_bits, md->free_count);
+    if (in_use + md->free_count != total) fail("blocks missing -> In use: %u; Free: %u\n", in_use, md->free_count);
+
+    /* every free block once in the queue, seen marks the queued ones now */
+    if (!isEmpty(md)) {
+        for (pos = md->queue.front; ; pos = pos + 1 == (int32_t) total ? 0 : pos + 1) {
+            b = md->queue.q[pos];
+            if (b >= total || !is_free(md, b) || seen[b] == 2) {
+                fail("bad queue entry -> Slot: %u; Block: %u\n", pos, b);
+                break;
+            }
+            seen[b] = 2;
+            queued++;
+            if (pos == md->queue.rear || queued > total) break;
+        }
+    }
+    if (queued != md->free_count) fail("queue length wrong -> Queued: %u; Free: %u\n", queued, md->free_count);
+    free(seen);
+}
+
+static void mount(u_int8_t file_backend) {
+    block_dev *dev = file_backend ? file_dev_open(TEST_IMAGE, 0) : mmap_dev_open(TEST_IMAGE, 0);
+
+    md = calloc(1, sizeof(meta_data));
+    if (dev == NULL || md == NULL || !init_fat(md, dev)) {
+        printf("ERROR Cannot mount image -> Path: %s\n", TEST_IMAGE);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    pthread_t tids[MAX_THREADS];
+    u_int32_t threads = 8;
+    u_int8_t file_backend = 0;
+    u_int8_t verbose = 0;
+    block_dev *dev;
+    char *buf;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:n:fvh")) != -1) {
+        switch (opt) {
+            case 't': threads = strtoul(optarg, NULL, 0); break;
+            case 'n': ops = strtoul(optarg, NULL, 0); break;
+            case 'f': file_backend = 1; break;
+            case 'v': verbose = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-t threads] [-n ops per thread] [-f] [-v]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    if (!verbose) set_log_level(LOG_NONE);
+
+    /* init_fat would set the flush policy, format_fs on its own does not */
+    unlink(TEST_IMAGE);
+    md = calloc(1, sizeof(meta_data));
+    dev = file_backend ? file_dev_open(TEST_IMAGE, TEST_IMAGE_LEN) : mmap_dev_open(TEST_IMAGE, TEST_IMAGE_LEN);
+    if (md != NULL) set_flush_policy(md, DEFAULT_FLUSH_OPS, DEFAULT_FLUSH_SECS);
+    if (md == NULL || dev == NULL || !format_fs(md, dev, TEST_BLOCK_SIZE, TEST_MAX_FILES)) {
+        printf("ERROR Cannot create image -> Path: %s\n", TEST_IMAGE);
+        return 1;
+    }
+
+    printf("Running -> Threads: %u; Ops: %u; %s\n", threads, ops, file_backend ? "block cache" : "mapped");
+    for (u_int32_t i = 0; i < threads; i++) pthread_create(&tids[i], NULL, worker, (void *) (size_t) i);
+    for (u_int32_t i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+
+    sync_fs(md);
+    check_chains("after the threads");
+
+    /* what is on the device has to agree too, a queue init_fat had to rebuild
+     * did not */
+    unmount(md);
+    free(md);
+    mount(file_backend);
+    if (md->queue_rebuilt) fail("free queue rebuilt at mount\n");
+    check_chains("after mounting again");
+
+    buf = malloc(MAX_WRITE);
+    for (filename fn = 0; buf != NULL && fn < STRESS_FILES; fn++) do_read(fn, buf);
+    free(buf);
+
+    unmount(md);
+    free(md);
+    unlink(TEST_IMAGE);
+
+    if (failures > 0) {
+        printf("Failed -> %u\n", failures);
+        return 1;
+    }
+    printf("Passed\n");
+    return 0;
+}
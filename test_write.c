@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "device.h"
+#include "cache.h"
+#include "log.h"
+#include "stats.h"
+#include "main.h"
+
+/* Checks that what is written to a file is what ends up on the device, for
+ * files of many blocks written in one go and in pieces of awkward sizes. Each
+ * file is compared byte for byte with what was written through read_at, then
+ * by following its chain in the fat and reading the blocks off the device,
+ * and again through read_at after the image has been mounted again. Last the
+ * blocks of a deleted file are checked not to be handed out before the delete
+ * is on the device, as after a crash the file would come back holding another
+ * file's data.
+ *
+ * Build with main.c compiled as a library, see the README
+ *   gcc -O2 -DMINIFAT_LIB -o test_write test_write.c main.c device.c aio.c cache.c crc.c lz.c stats.c -lpthread
+ *
+ * Every geometry is run on a mapped image and with the block cache. The exit
+ * status is 0 when everything matched.
+ */
+
+#define TEST_IMAGE      "/tmp/minifat_test_write.img"
+#define TEST_MAX_FILES  16
+#define TEST_IMAGE_LEN  (8ULL << 20)    // 8M bytes
+#define CRASH_IMAGE_LEN (512ULL << 10)  // 512k bytes, so the files fit in data
+
+enum how {
+    WHOLE,                          // one write_file of the whole file
+    CHUNKS,                         // write_file of pieces, each carries on from the last
+    APPENDS,                        // append_file of pieces after a first write
+    LOG,                            // log_append of small records
+    HOW_COUNT
+};
+
+static const char *how_names[] = {"whole", "chunks", "appends", "log"};
+
+/* sizes of the files, around and across block and cache sized edges */
+static const u_int32_t file_sizes[] = {1, 63, 64, 65, 4095, 4096, 4097, 70000, 300001};
+
+/* sizes of the pieces written, none of them a multiple of a block */
+static const u_int32_t piece_sizes[] = {1, 7, 61, 100, 513, 3000, 17};
+
+static u_int32_t failures;
+
+static void fail(const char *what, const char *how, u_int32_t size, u_int64_t at) {
+    printf("FAIL %s -> Write: %s; Size: %u; Offset: %llu\n", what, how, size, (unsigned long long) at);
+    failures++;
+}
+
+/* first byte that differs, len if none */
+static u_int64_t mismatch(const char *a, const char *b, u_int64_t len) {
+    for (u_int64_t i = 0; i < len; i++) {
+        if (a[i] != b[i]) return i;
+    }
+    return len;
+}
+
+/* writes size bytes of data to file fn the way how says */
+static u_int8_t put_file(meta_data *md, filename fn, enum how how, char *data, u_int32_t size) {
+    file_handle *h;
+    u_int32_t done = 0;
+    u_int32_t n;
+    u_int32_t p = 0;
+    u_int8_t ok = 1;
+
+    h = open_for_write(md, fn);
+    if (h == NULL) return 0;
+
+    if (how == WHOLE) ok = write_file(md, h, data, size);
+    if (how == APPENDS || how == LOG) {
+        /* appends need a handle of their own, the appends after a first write
+         * and the log to a file emptied by opening it for writing */
+        if (how == APPENDS) done = size < piece_sizes[2] ? size : piece_sizes[2];
+        if (done > 0) ok = write_file(md, h, data, done);
+        ok = close_file(md, h) && ok;
+        h = open_for_append(md, fn);
+        if (h == NULL) return 0;
+    }
+    while (ok && how != WHOLE && done < size) {
+        n = piece_sizes[p++ % (sizeof(piece_sizes) / sizeof(piece_sizes[0]))];
+        if (how == LOG) n = n % 32 + 1;
+        if (n > size - done) n = size - done;
+        if (how == CHUNKS) ok = write_file(md, h, data + done, n);
+        else if (how == APPENDS) ok = append_file(md, h, data + done, n);
+        else ok = log_append(md, h, data + done, n);
+        done += n;
+    }
+    return close_file(md, h) && ok;
+}
+
+/* reads file fn back with read_at and compares it with data */
+static void check_read(meta_data *md, filename fn, const char *how, const char *data, u_int32_t size, char *back) {
+    file_handle *h;
+    int64_t got;
+    u_int64_t at;
+
+    h = open_for_read(md, fn);
+    if (h == NULL) {
+        fail("open for read", how, size, 0);
+        return;
+    }
+    memset(back, 0, size + 1);
+    got = read_at(md, h, 0, back, size + 1); // one more than the file, to see it stops
+    if (got != size) fail("read length", how, size, got < 0 ? 0 : got);
+    else if ((at = mismatch(data, back, size)) != size) fail("read data", how, size, at);
+    close_file(md, h);
+}
+
+/* follows the chain of file fn in the fat and compares the blocks on the device
+ * with data */
+static void check_chain(meta_data *md, filename fn, const char *how, const char *data, u_int32_t size, char *back) {
+    u_int32_t bs = md->sb.block_size;
+    u_int32_t blocks = size == 0 ? 1 : (size + bs - 1) / bs;
+    u_int64_t done = 0;
+    u_int64_t at;
+    u_int32_t n;
+    block b;
+
+    if (md->dir[fn].length != size) {
+        fail("entry length", how, size, md->dir[fn].length);
+        return;
+    }
+    b = md->dir[fn].startblock;
+    for (u_int32_t i = 0; i < blocks; i++) {
+        if (b >= md->sb.total_blocks) {
+            fail("chain too short", how, size, done);
+            return;
+        }
+        n = size - done < bs ? size - done : bs;
+        if (n > 0 && !dev_read(md->dev, BLOCK_ADDR(md, b), back + done, n)) {
+            fail("device read", how, size, done);
+            return;
+        }
+        done += n;
+        b = md->fat[b];
+    }
+    if (b != END_BLOCK) fail("chain too long", how, size, done);
+    else if ((at = mismatch(data, back, size)) != size) fail("device data", how, size, at);
+}
+
+static meta_data *mount(u_int8_t file_backend) {
+    meta_data *md;
+    block_dev *dev;
+
+    dev = file_backend ? file_dev_open(TEST_IMAGE, 0) : mmap_dev_open(TEST_IMAGE, 0);
+    md = calloc(1, sizeof(meta_data));
+    if (dev == NULL || md == NULL || !init_fat(md, dev)) {
+        printf("ERROR Cannot mount image -> Path: %s\n", TEST_IMAGE);
+        exit(1);
+    }
+    return md;
+}
+
+/* writes every size every way on a fresh image of the given geometry */
+static void run(u_int32_t block_size, u_int8_t file_backend, char *data, char *back) {
+    u_int32_t sizes = sizeof(file_sizes) / sizeof(file_sizes[0]);
+    meta_data *md;
+    block_dev *dev;
+    filename fn;
+
+    printf("Block size %u, %s\n", block_size, file_backend ? "block cache" : "mapped");
+
+    md = calloc(1, sizeof(meta_data));
+    unlink(TEST_IMAGE);
+    dev = file_backend ? file_dev_open(TEST_IMAGE, TEST_IMAGE_LEN) : mmap_dev_open(TEST_IMAGE, TEST_IMAGE_LEN);
+    if (md == NULL || dev == NULL || !format_fs(md, dev, block_size, TEST_MAX_FILES)) {
+        printf("ERROR Cannot create image -> Path: %s\n", TEST_IMAGE);
+        exit(1);
+    }
+    set_flush_policy(md, DEFAULT_FLUSH_OPS, DEFAULT_FLUSH_SECS);
+
+    /* each round writes every way once, so the files of a round are spread
+     * over the device and the later ones reuse blocks of the earlier */
+    for (u_int32_t s = 0; s < sizes; s++) {
+        for (u_int32_t how = 0; how < HOW_COUNT; how++) {
+            fn = how;
+            if (!put_file(md, fn, how, data + s, file_sizes[s])) {
+                fail("write", how_names[how], file_sizes[s], 0);
+                continue;
+            }
+            check_read(md, fn, how_names[how], data + s, file_sizes[s], back);
+            sync_fs(md); // so the blocks are on the device, not in the cache
+            check_chain(md, fn, how_names[how], data + s, file_sizes[s], back);
+        }
+    }
+
+    /* the largest files are left, they have to come back after a mount */
+    unmount(md);
+    free(md);
+    md = mount(file_backend);
+    for (u_int32_t how = 0; how < HOW_COUNT; how++) {
+        check_read(md, how, how_names[how], data + sizes - 1, file_sizes[sizes - 1], back);
+    }
+    unmount(md);
+    free(md);
+}
+
+/* Deletes a file and writes one needing its blocks without the meta data
+ * being flushed in between, then mounts the image as a crash would leave it.
+ * Either the delete was flushed before the blocks were used again or the
+ * first file comes back as it was */
+static void crash_reuse(u_int8_t file_backend, char *data, char *back) {
+    u_int32_t size;
+    meta_data *md;
+    block_dev *dev;
+
+    printf("Reuse after a crash, %s\n", file_backend ? "block cache" : "mapped");
+
+    md = calloc(1, sizeof(meta_data));
+    unlink(TEST_IMAGE);
+    dev = file_backend ? file_dev_open(TEST_IMAGE, CRASH_IMAGE_LEN) : mmap_dev_open(TEST_IMAGE, CRASH_IMAGE_LEN);
+    if (md == NULL || dev == NULL || !format_fs(md, dev, 512, TEST_MAX_FILES)) {
+        printf("ERROR Cannot create image -> Path: %s\n", TEST_IMAGE);
+        exit(1);
+    }
+    set_flush_policy(md, 1000, 0);
+
+    /* each file takes over half the space, so the second needs the blocks of
+     * the first */
+    size = availableBlocks(md) * md->sb.block_size / 5 * 3;
+    if (!put_file(md, 0, WHOLE, data, size) || !sync_fs(md)) fail("write", "first", size, 0);
+    if (!delete_file(md, 0)) fail("delete", "first", size, 0);
+    if (!put_file(md, 1, WHOLE, data + 1, size)) fail("write", "second", size, 0);
+
+    /* the file data reaches the device, the meta data is left where it was.
+     * What the dropped mount holds is not given back */
+    if (md->cache != NULL) cache_flush(md->cache);
+    dev_sync(md->dev);
+    dev_close(md->dev);
+
+    md = mount(file_backend);
+    if (md->dir[0].startblock != FREE_BLOCK) check_read(md, 0, "first", data, size, back);
+    unmount(md);
+    free(md);
+}
+
+int main(int argc, char *argv[]) {
+    static const u_int32_t block_sizes[] = {DEFAULT_BLOCK_SIZE, 512, 4096};
+    u_int32_t largest = file_sizes[sizeof(file_sizes) / sizeof(file_sizes[0]) - 1];
+    char *data;
+    char *back;
+
+    if (argc < 2 || strcmp(argv[1], "-v") != 0) set_log_level(LOG_NONE);
+
+    /* the files start at different places in data so no two are the same */
+    data = malloc(largest + 16);
+    back = malloc(largest + 1);
+    if (data == NULL || back == NULL) {
+        printf("ERROR Out of memory\n");
+        return 1;
+    }
+    srand(1);
+    for (u_int32_t i = 0; i < largest + 16; i++) data[i] = rand();
+
+    for (u_int32_t b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++) {
+        run(block_sizes[b], 0, data, back);
+        run(block_sizes[b], 1, data, back);
+    }
+    crash_reuse(0, data, back);
+    crash_reuse(1, data, back);
+    unlink(TEST_IMAGE);
+    free(data);
+    free(back);
+
+    if (failures > 0) {
+        printf("Failed -> %u\n", failures);
+        return 1;
+    }
+    printf("Passed\n");
+    return 0;
+}